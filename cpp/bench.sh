@@ -0,0 +1,56 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+CPP_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+BENCH_DIR="${CPP_DIR}/bin/bench"
+PORT="${GEOIP_PORT:-5099}"
+ENGINE="${GEOIP_ENGINE:-memory}"
+DURATION="${BENCH_DURATION:-10}"
+CONNECTIONS="${BENCH_CONNECTIONS:-16}"
+RATE="${BENCH_RATE:-20000}"
+IO_BACKENDS="${BENCH_IO:-epoll io_uring}"
+
+cd "${CPP_DIR}"
+
+if ! command -v c++ >/dev/null 2>&1; then
+  echo "C++ compiler not found."
+  exit 1
+fi
+
+mkdir -p "${BENCH_DIR}"
+c++ -std=c++17 -O2 -pthread -o bin/geoip main.cpp geoip.cpp -lsqlite3
+
+./bin/geoip fixture --ips "${BENCH_DIR}/ips.txt" "${BENCH_DIR}/fixture.db" >&2
+export GEOIP_DB_PATH="${BENCH_DIR}/fixture.db"
+
+./bin/geoip check-encodings "${BENCH_DIR}/ips.txt" >&2
+./bin/geoip bench | tee "${BENCH_DIR}/micro.ndjson"
+
+# The sqlite lookups again, seeking in a prepared copy of the fixture.
+./bin/geoip prepare-db --output "${BENCH_DIR}/fixture.prepared.db" >&2
+GEOIP_DB_PATH="${BENCH_DIR}/fixture.prepared.db" ./bin/geoip bench \
+  --filter sqlite/ | tee "${BENCH_DIR}/micro-prepared.ndjson"
+
+SERVER_PID=""
+trap 'if [ -n "${SERVER_PID}" ]; then kill "${SERVER_PID}" 2>/dev/null || true; fi' EXIT
+
+for IO in ${IO_BACKENDS}; do
+  GEOIP_ENGINE="${ENGINE}" GEOIP_PORT="${PORT}" GEOIP_IO="${IO}" ./bin/geoip \
+    >"${BENCH_DIR}/server-${IO}.log" 2>&1 &
+  SERVER_PID=$!
+  for _ in $(seq 50); do
+    if (exec 3<>"/dev/tcp/127.0.0.1/${PORT}") 2>/dev/null; then
+      break
+    fi
+    sleep 0.1
+  done
+
+  ./bin/geoip loadgen --port "${PORT}" --connections "${CONNECTIONS}" \
+    --duration "${DURATION}" "${BENCH_DIR}/ips.txt" | tee "${BENCH_DIR}/closed-${IO}.json"
+  ./bin/geoip loadgen --port "${PORT}" --connections "${CONNECTIONS}" \
+    --duration "${DURATION}" --rate "${RATE}" "${BENCH_DIR}/ips.txt" | tee "${BENCH_DIR}/open-${IO}.json"
+
+  kill "${SERVER_PID}"
+  wait "${SERVER_PID}" 2>/dev/null || true
+  SERVER_PID=""
+done
@@ -0,0 +1,3258 @@
+#include "geoip.h"
+#include "geoip_internal.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <ostream>
+#include <queue>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+namespace geoip::internal {
+
+std::optional<int64_t> column_int64(sqlite3_stmt *stmt, int idx) {
+  if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
+    return std::nullopt;
+  }
+  return sqlite3_column_int64(stmt, idx);
+}
+
+std::optional<double> column_double(sqlite3_stmt *stmt, int idx) {
+  if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
+    return std::nullopt;
+  }
+  return sqlite3_column_double(stmt, idx);
+}
+
+std::optional<std::string> column_text(sqlite3_stmt *stmt, int idx) {
+  if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
+    return std::nullopt;
+  }
+  const unsigned char *text = sqlite3_column_text(stmt, idx);
+  return std::string(reinterpret_cast<const char *>(text));
+}
+
+// Length of the prefix of `data` that needs no escaping. SSE2 checks 16
+// bytes per step for a quote, a backslash or a control character.
+size_t plain_prefix(const char *data, size_t size) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1F);
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return i + static_cast<size_t>(__builtin_ctz(mask));
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    if (c == '"' || c == '\\' || c < 0x20) {
+      break;
+    }
+  }
+  return i;
+}
+
+void append_escaped(std::string &out, std::string_view input) {
+  while (!input.empty()) {
+    size_t plain = plain_prefix(input.data(), input.size());
+    out.append(input.data(), plain);
+    if (plain == input.size()) {
+      return;
+    }
+    unsigned char c = static_cast<unsigned char>(input[plain]);
+    input.remove_prefix(plain + 1);
+    switch (c) {
+    case '\"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\b':
+      out += "\\b";
+      break;
+    case '\f':
+      out += "\\f";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default: {
+      const char *hex = "0123456789ABCDEF";
+      const char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+      out.append(escape, sizeof(escape));
+    }
+    }
+  }
+}
+
+void append_int(std::string &out, int64_t value) {
+  char text[24];
+  auto result = std::to_chars(text, text + sizeof(text), value);
+  out.append(text, static_cast<size_t>(result.ptr - text));
+}
+
+void append_json_string(std::string &out,
+                        const std::optional<std::string> &value) {
+  if (!value.has_value()) {
+    out += "null";
+    return;
+  }
+  out += '"';
+  append_escaped(out, *value);
+  out += '"';
+}
+
+void append_json_number(std::string &out, const std::optional<int64_t> &value) {
+  if (!value.has_value()) {
+    out += "null";
+    return;
+  }
+  append_int(out, *value);
+}
+
+// Matches the default ostream format: %g with 6 significant digits.
+void append_json_number(std::string &out, const std::optional<double> &value) {
+  if (!value.has_value()) {
+    out += "null";
+    return;
+  }
+  char text[32];
+  auto result = std::to_chars(text, text + sizeof(text), *value,
+                              std::chars_format::general, 6);
+  out.append(text, static_cast<size_t>(result.ptr - text));
+}
+
+std::string utf8_from_codepoint(int codepoint) {
+  std::string out;
+  if (codepoint <= 0x7F) {
+    out.push_back(static_cast<char>(codepoint));
+  } else if (codepoint <= 0x7FF) {
+    out.push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
+    out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+  } else if (codepoint <= 0xFFFF) {
+    out.push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+  } else {
+    out.push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
+    out.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+  }
+  return out;
+}
+
+std::optional<std::string> iso_to_flag(const std::optional<std::string> &iso) {
+  if (!iso.has_value() || iso->size() != 2) {
+    return std::nullopt;
+  }
+  std::string upper = *iso;
+  for (auto &ch : upper) {
+    ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+  }
+  int code1 = 0x1F1E6 + (upper[0] - 'A');
+  int code2 = 0x1F1E6 + (upper[1] - 'A');
+  return utf8_from_codepoint(code1) + utf8_from_codepoint(code2);
+}
+
+void append_network(std::string &out, std::string_view cidr,
+                    int64_t prefix_length, int64_t ip_version) {
+  out += "\"network\":{\"cidr\":\"";
+  append_escaped(out, cidr);
+  out += "\",\"prefix_length\":";
+  append_int(out, prefix_length);
+  out += ",\"ip_version\":";
+  append_int(out, ip_version);
+  out += '}';
+}
+
+// `key` is the member's quoted key and colon; the first member opens the
+// object and the rest are separated.
+void append_member(std::string &out, char &separator, std::string_view key) {
+  out += separator;
+  separator = ',';
+  out += key;
+}
+
+// A country row has no subdivisions, city or time zone and renders them as
+// null.
+constexpr std::string_view kNullSubdivision1 =
+    "\"subdivision_1\":{\"iso_code\":null,\"name\":null}";
+constexpr std::string_view kNullSubdivision2 =
+    "\"subdivision_2\":{\"iso_code\":null,\"name\":null}";
+constexpr std::string_view kNullCity =
+    "\"city\":{\"name\":null,\"metro_code\":null}";
+constexpr std::string_view kNullTimeZone = "\"time_zone\":null";
+constexpr uint32_t kCityGeoFields =
+    kFieldSubdivision1 | kFieldSubdivision2 | kFieldCity | kFieldTimeZone;
+constexpr std::string_view kNullCityGeo =
+    "\"subdivision_1\":{\"iso_code\":null,\"name\":null},"
+    "\"subdivision_2\":{\"iso_code\":null,\"name\":null},"
+    "\"city\":{\"name\":null,\"metro_code\":null},\"time_zone\":null";
+constexpr std::string_view kNullCoordinates =
+    ",\"coordinates\":{\"latitude\":null,\"longitude\":null,"
+    "\"accuracy_radius\":null}";
+constexpr std::string_view kNullPostalCode = ",\"postal_code\":null";
+
+// The "geo" object depends only on the location, so the memory engines
+// render it once per location when the index is built.
+template <typename Row>
+void append_geo_members(std::string &out, const Row &row, uint32_t fields) {
+  constexpr bool kCity = std::is_same_v<Row, CityRow>;
+  char separator = '{';
+  if (fields & kFieldContinent) {
+    append_member(out, separator, "\"continent\":{\"code\":");
+    append_json_string(out, row.continent_code);
+    out += ",\"name\":";
+    append_json_string(out, row.continent_name);
+    out += '}';
+  }
+  if (fields & kFieldCountry) {
+    append_member(out, separator, "\"country\":{\"iso_code\":");
+    append_json_string(out, row.country_iso_code);
+    out += ",\"name\":";
+    append_json_string(out, row.country_name);
+    out += ",\"flag_emoji\":";
+    append_json_string(out, iso_to_flag(row.country_iso_code));
+    out += ",\"is_in_european_union\":";
+    append_json_number(out, row.is_in_european_union);
+    out += '}';
+  }
+  if constexpr (kCity) {
+    if (fields & kFieldSubdivision1) {
+      append_member(out, separator, "\"subdivision_1\":{\"iso_code\":");
+      append_json_string(out, row.subdivision_1_iso_code);
+      out += ",\"name\":";
+      append_json_string(out, row.subdivision_1_name);
+      out += '}';
+    }
+    if (fields & kFieldSubdivision2) {
+      append_member(out, separator, "\"subdivision_2\":{\"iso_code\":");
+      append_json_string(out, row.subdivision_2_iso_code);
+      out += ",\"name\":";
+      append_json_string(out, row.subdivision_2_name);
+      out += '}';
+    }
+    if (fields & kFieldCity) {
+      append_member(out, separator, "\"city\":{\"name\":");
+      append_json_string(out, row.city_name);
+      out += ",\"metro_code\":";
+      append_json_string(out, row.metro_code);
+      out += '}';
+    }
+    if (fields & kFieldTimeZone) {
+      append_member(out, separator, "\"time_zone\":");
+      append_json_string(out, row.time_zone);
+    }
+  } else if ((fields & kCityGeoFields) == kCityGeoFields) {
+    append_member(out, separator, kNullCityGeo);
+  } else {
+    if (fields & kFieldSubdivision1) {
+      append_member(out, separator, kNullSubdivision1);
+    }
+    if (fields & kFieldSubdivision2) {
+      append_member(out, separator, kNullSubdivision2);
+    }
+    if (fields & kFieldCity) {
+      append_member(out, separator, kNullCity);
+    }
+    if (fields & kFieldTimeZone) {
+      append_member(out, separator, kNullTimeZone);
+    }
+  }
+  out += separator == '{' ? "{}" : "}";
+}
+
+void append_geo(std::string &out, const CityRow &row, uint32_t fields) {
+  append_geo_members(out, row, fields);
+}
+
+void append_geo(std::string &out, const CountryRow &row, uint32_t fields) {
+  append_geo_members(out, row, fields);
+}
+
+void append_coordinates(std::string &out, const std::optional<double> &latitude,
+                        const std::optional<double> &longitude,
+                        const std::optional<int64_t> &accuracy_radius) {
+  out += ",\"coordinates\":{\"latitude\":";
+  append_json_number(out, latitude);
+  out += ",\"longitude\":";
+  append_json_number(out, longitude);
+  out += ",\"accuracy_radius\":";
+  append_json_number(out, accuracy_radius);
+  out += '}';
+}
+
+// The members every location object ends with, up to its closing brace.
+void append_traits(std::string &out, uint32_t fields,
+                   std::optional<int64_t> is_anonymous_proxy,
+                   std::optional<int64_t> is_satellite_provider,
+                   std::optional<int64_t> is_anycast,
+                   std::optional<int64_t> geoname_id,
+                   std::optional<int64_t> registered_country_geoname_id,
+                   std::optional<int64_t> represented_country_geoname_id) {
+  if (fields & kFieldTraits) {
+    out += ",\"traits\":{\"is_anonymous_proxy\":";
+    append_json_number(out, is_anonymous_proxy);
+    out += ",\"is_satellite_provider\":";
+    append_json_number(out, is_satellite_provider);
+    out += ",\"is_anycast\":";
+    append_json_number(out, is_anycast);
+    out += '}';
+  }
+  if (fields & kFieldGeonameIds) {
+    out += ",\"geoname_id\":";
+    append_json_number(out, geoname_id);
+    out += ",\"registered_country_geoname_id\":";
+    append_json_number(out, registered_country_geoname_id);
+    out += ",\"represented_country_geoname_id\":";
+    append_json_number(out, represented_country_geoname_id);
+  }
+  out += '}';
+}
+
+template <typename Row>
+void append_row_location(std::string &out, const Row &row,
+                         std::string_view source, uint32_t fields) {
+  out += "{\"source\":\"";
+  append_escaped(out, source);
+  out += '"';
+  if (fields & kFieldNetwork) {
+    out += ',';
+    append_network(out, row.network, row.prefix_length, row.ip_version);
+  }
+  if (fields & kGeoFields) {
+    out += ",\"geo\":";
+    append_geo(out, row, fields);
+  }
+  if constexpr (std::is_same_v<Row, CityRow>) {
+    if (fields & kFieldCoordinates) {
+      append_coordinates(out, row.latitude, row.longitude,
+                         row.accuracy_radius);
+    }
+    if (fields & kFieldPostalCode) {
+      out += ",\"postal_code\":";
+      append_json_string(out, row.postal_code);
+    }
+  } else {
+    if (fields & kFieldCoordinates) {
+      out += kNullCoordinates;
+    }
+    if (fields & kFieldPostalCode) {
+      out += kNullPostalCode;
+    }
+  }
+  append_traits(out, fields, row.is_anonymous_proxy, row.is_satellite_provider,
+                row.is_anycast, row.geoname_id,
+                row.registered_country_geoname_id,
+                row.represented_country_geoname_id);
+}
+
+void append_location(std::string &out, const CityRow &row,
+                     std::string_view source, uint32_t fields) {
+  append_row_location(out, row, source, fields);
+}
+
+void append_location(std::string &out, const CountryRow &row,
+                     std::string_view source, uint32_t fields) {
+  append_row_location(out, row, source, fields);
+}
+
+// The "number" and "organization" members of an ASN object.
+void append_asn_members(std::string &out, const std::optional<int64_t> &number,
+                        const std::optional<std::string> &organization) {
+  out += "\"number\":";
+  append_json_number(out, number);
+  out += ",\"organization\":";
+  append_json_string(out, organization);
+}
+
+void append_asn(std::string &out, const std::optional<AsnRow> &row) {
+  if (!row.has_value()) {
+    out += "null";
+    return;
+  }
+  out += '{';
+  append_network(out, row->network, row->prefix_length, row->ip_version);
+  out += ',';
+  append_asn_members(out, row->autonomous_system_number,
+                     row->autonomous_system_organization);
+  out += '}';
+}
+
+constexpr const char *kAsnSql =
+    "SELECT network, prefix_length, ip_version, "
+    "autonomous_system_number, autonomous_system_organization "
+    "FROM asn_blocks "
+    "WHERE ip_version = ? AND network_start <= ? AND network_end >= ? "
+    "ORDER BY prefix_length DESC LIMIT 1";
+
+constexpr const char *kCitySql =
+    "SELECT b.network, b.prefix_length, b.ip_version, b.geoname_id, "
+    "b.registered_country_geoname_id, b.represented_country_geoname_id, "
+    "b.is_anonymous_proxy, b.is_satellite_provider, b.is_anycast, "
+    "b.postal_code, b.latitude, b.longitude, b.accuracy_radius, "
+    "l.continent_code, l.continent_name, l.country_iso_code, l.country_name, "
+    "l.subdivision_1_iso_code, l.subdivision_1_name, "
+    "l.subdivision_2_iso_code, l.subdivision_2_name, l.city_name, "
+    "l.metro_code, l.time_zone, l.is_in_european_union "
+    "FROM city_blocks b "
+    "LEFT JOIN city_locations l ON l.geoname_id = b.geoname_id "
+    "AND l.locale_code = ? "
+    "WHERE b.ip_version = ? AND b.network_start <= ? AND b.network_end >= ? "
+    "ORDER BY b.prefix_length DESC LIMIT 1";
+
+// kCitySql without the location join, for lookups that render no "geo"
+// member.
+constexpr const char *kCityBlockSql =
+    "SELECT network, prefix_length, ip_version, geoname_id, "
+    "registered_country_geoname_id, represented_country_geoname_id, "
+    "is_anonymous_proxy, is_satellite_provider, is_anycast, "
+    "postal_code, latitude, longitude, accuracy_radius "
+    "FROM city_blocks "
+    "WHERE ip_version = ? AND network_start <= ? AND network_end >= ? "
+    "ORDER BY prefix_length DESC LIMIT 1";
+
+constexpr const char *kCountrySql =
+    "SELECT b.network, b.prefix_length, b.ip_version, b.geoname_id, "
+    "b.registered_country_geoname_id, b.represented_country_geoname_id, "
+    "b.is_anonymous_proxy, b.is_satellite_provider, b.is_anycast, "
+    "l.continent_code, l.continent_name, l.country_iso_code, l.country_name, "
+    "l.is_in_european_union "
+    "FROM country_blocks b "
+    "LEFT JOIN country_locations l ON l.geoname_id = b.geoname_id "
+    "AND l.locale_code = ? "
+    "WHERE b.ip_version = ? AND b.network_start <= ? AND b.network_end >= ? "
+    "ORDER BY b.prefix_length DESC LIMIT 1";
+
+// The statements above read every block starting at or below the key and
+// sort the matches, since nested blocks may hold it. In a database that
+// `geoip prepare-db` has checked to hold disjoint blocks only the block
+// with the greatest network_start at or below the key can, so these seek
+// to it in the (ip_version, network_start) index and fetch it by rowid.
+// Parameters keep the positions of the statements they replace.
+constexpr const char *kAsnSeekSql =
+    "SELECT network, prefix_length, ip_version, "
+    "autonomous_system_number, autonomous_system_organization "
+    "FROM asn_blocks "
+    "WHERE rowid = (SELECT rowid FROM asn_blocks "
+    "WHERE ip_version = ?1 AND network_start <= ?2 "
+    "ORDER BY network_start DESC LIMIT 1) AND network_end >= ?3";
+
+constexpr const char *kCitySeekSql =
+    "SELECT b.network, b.prefix_length, b.ip_version, b.geoname_id, "
+    "b.registered_country_geoname_id, b.represented_country_geoname_id, "
+    "b.is_anonymous_proxy, b.is_satellite_provider, b.is_anycast, "
+    "b.postal_code, b.latitude, b.longitude, b.accuracy_radius, "
+    "l.continent_code, l.continent_name, l.country_iso_code, l.country_name, "
+    "l.subdivision_1_iso_code, l.subdivision_1_name, "
+    "l.subdivision_2_iso_code, l.subdivision_2_name, l.city_name, "
+    "l.metro_code, l.time_zone, l.is_in_european_union "
+    "FROM city_blocks b "
+    "LEFT JOIN city_locations l ON l.geoname_id = b.geoname_id "
+    "AND l.locale_code = ?1 "
+    "WHERE b.rowid = (SELECT rowid FROM city_blocks "
+    "WHERE ip_version = ?2 AND network_start <= ?3 "
+    "ORDER BY network_start DESC LIMIT 1) AND b.network_end >= ?4";
+
+constexpr const char *kCityBlockSeekSql =
+    "SELECT network, prefix_length, ip_version, geoname_id, "
+    "registered_country_geoname_id, represented_country_geoname_id, "
+    "is_anonymous_proxy, is_satellite_provider, is_anycast, "
+    "postal_code, latitude, longitude, accuracy_radius "
+    "FROM city_blocks "
+    "WHERE rowid = (SELECT rowid FROM city_blocks "
+    "WHERE ip_version = ?1 AND network_start <= ?2 "
+    "ORDER BY network_start DESC LIMIT 1) AND network_end >= ?3";
+
+constexpr const char *kCountrySeekSql =
+    "SELECT b.network, b.prefix_length, b.ip_version, b.geoname_id, "
+    "b.registered_country_geoname_id, b.represented_country_geoname_id, "
+    "b.is_anonymous_proxy, b.is_satellite_provider, b.is_anycast, "
+    "l.continent_code, l.continent_name, l.country_iso_code, l.country_name, "
+    "l.is_in_european_union "
+    "FROM country_blocks b "
+    "LEFT JOIN country_locations l ON l.geoname_id = b.geoname_id "
+    "AND l.locale_code = ?1 "
+    "WHERE b.rowid = (SELECT rowid FROM country_blocks "
+    "WHERE ip_version = ?2 AND network_start <= ?3 "
+    "ORDER BY network_start DESC LIMIT 1) AND b.network_end >= ?4";
+
+// Version of the checks and indexes `geoip prepare-db` records in
+// geoip_prepared. Databases without it are searched with the range
+// statements.
+constexpr int64_t kPreparedFormat = 1;
+
+constexpr const char *kPreparedSql = "SELECT format FROM geoip_prepared";
+
+constexpr const char *kLocalesSql =
+    "SELECT locale_code FROM city_locations WHERE locale_code IS NOT NULL "
+    "UNION SELECT locale_code FROM country_locations "
+    "WHERE locale_code IS NOT NULL";
+
+OpenResult open_sqlite(SqliteContext &context, const std::string &db_path) {
+  if (context.db) {
+    return OpenResult::kOk;
+  }
+  if (!std::filesystem::exists(db_path)) {
+    return OpenResult::kMissing;
+  }
+  if (sqlite3_open_v2(db_path.c_str(), &context.db,
+                      SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                      nullptr) != SQLITE_OK) {
+    context.close_sqlite();
+    return OpenResult::kFailed;
+  }
+  sqlite3_exec(context.db, "PRAGMA mmap_size = 1073741824", nullptr, nullptr,
+               nullptr);
+  sqlite3_stmt *stmt = nullptr;
+  if (sqlite3_prepare_v2(context.db, kPreparedSql, -1, &stmt, nullptr) ==
+          SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW) {
+    context.seek = sqlite3_column_int64(stmt, 0) == kPreparedFormat;
+  }
+  sqlite3_finalize(stmt);
+  bool seek = context.seek;
+  if (sqlite3_prepare_v3(context.db, seek ? kAsnSeekSql : kAsnSql, -1,
+                         SQLITE_PREPARE_PERSISTENT, &context.asn,
+                         nullptr) != SQLITE_OK ||
+      sqlite3_prepare_v3(context.db, seek ? kCitySeekSql : kCitySql, -1,
+                         SQLITE_PREPARE_PERSISTENT, &context.city,
+                         nullptr) != SQLITE_OK ||
+      sqlite3_prepare_v3(context.db, seek ? kCityBlockSeekSql : kCityBlockSql,
+                         -1, SQLITE_PREPARE_PERSISTENT, &context.city_block,
+                         nullptr) != SQLITE_OK ||
+      sqlite3_prepare_v3(context.db, seek ? kCountrySeekSql : kCountrySql, -1,
+                         SQLITE_PREPARE_PERSISTENT, &context.country,
+                         nullptr) != SQLITE_OK) {
+    context.close_sqlite();
+    return OpenResult::kFailed;
+  }
+  if (sqlite3_prepare_v2(context.db, kLocalesSql, -1, &stmt, nullptr) !=
+      SQLITE_OK) {
+    context.close_sqlite();
+    return OpenResult::kFailed;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    context.locales.emplace_back(
+        reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+  }
+  sqlite3_finalize(stmt);
+  return OpenResult::kOk;
+}
+
+// Binds `lang` to the location joins when the database has it, otherwise
+// `fallback`. A database lacking both leaves every location NULL.
+void bind_locale(SqliteContext &context, const std::string &lang,
+                 const std::string &fallback) {
+  const std::string *locale = &fallback;
+  if (!lang.empty() && std::find(context.locales.begin(), context.locales.end(),
+                                 lang) != context.locales.end()) {
+    locale = &lang;
+  }
+  if (*locale == context.bound_locale && !context.bound_locale.empty()) {
+    return;
+  }
+  context.bound_locale = *locale;
+  sqlite3_bind_text(context.city, 1, context.bound_locale.c_str(), -1,
+                    SQLITE_STATIC);
+  sqlite3_bind_text(context.country, 1, context.bound_locale.c_str(), -1,
+                    SQLITE_STATIC);
+}
+
+std::optional<AsnRow> lookup_asn(sqlite3_stmt *stmt, int64_t ip_version,
+                                 int64_t ip_key) {
+  sqlite3_bind_int64(stmt, 1, ip_version);
+  sqlite3_bind_int64(stmt, 2, ip_key);
+  sqlite3_bind_int64(stmt, 3, ip_key);
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    sqlite3_reset(stmt);
+    return std::nullopt;
+  }
+  AsnRow row;
+  row.network = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+  row.prefix_length = sqlite3_column_int64(stmt, 1);
+  row.ip_version = sqlite3_column_int64(stmt, 2);
+  row.autonomous_system_number = column_int64(stmt, 3);
+  row.autonomous_system_organization = column_text(stmt, 4);
+  sqlite3_reset(stmt);
+  return row;
+}
+
+// The locale is bound by bind_locale(); only the address is rebound here.
+// `stmt` is kCitySql or kCityBlockSql, whose rows lack the location.
+std::optional<CityRow> lookup_city(sqlite3_stmt *stmt, int64_t ip_version,
+                                   int64_t ip_key) {
+  int first = sqlite3_bind_parameter_count(stmt) - 2;
+  sqlite3_bind_int64(stmt, first, ip_version);
+  sqlite3_bind_int64(stmt, first + 1, ip_key);
+  sqlite3_bind_int64(stmt, first + 2, ip_key);
+
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    sqlite3_reset(stmt);
+    return std::nullopt;
+  }
+
+  CityRow row;
+  row.network = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+  row.prefix_length = sqlite3_column_int64(stmt, 1);
+  row.ip_version = sqlite3_column_int64(stmt, 2);
+  row.geoname_id = column_int64(stmt, 3);
+  row.registered_country_geoname_id = column_int64(stmt, 4);
+  row.represented_country_geoname_id = column_int64(stmt, 5);
+  row.is_anonymous_proxy = column_int64(stmt, 6);
+  row.is_satellite_provider = column_int64(stmt, 7);
+  row.is_anycast = column_int64(stmt, 8);
+  row.postal_code = column_text(stmt, 9);
+  row.latitude = column_double(stmt, 10);
+  row.longitude = column_double(stmt, 11);
+  row.accuracy_radius = column_int64(stmt, 12);
+  if (sqlite3_column_count(stmt) == 13) {
+    sqlite3_reset(stmt);
+    return row;
+  }
+  row.continent_code = column_text(stmt, 13);
+  row.continent_name = column_text(stmt, 14);
+  row.country_iso_code = column_text(stmt, 15);
+  row.country_name = column_text(stmt, 16);
+  row.subdivision_1_iso_code = column_text(stmt, 17);
+  row.subdivision_1_name = column_text(stmt, 18);
+  row.subdivision_2_iso_code = column_text(stmt, 19);
+  row.subdivision_2_name = column_text(stmt, 20);
+  row.city_name = column_text(stmt, 21);
+  row.metro_code = column_text(stmt, 22);
+  row.time_zone = column_text(stmt, 23);
+  row.is_in_european_union = column_int64(stmt, 24);
+
+  sqlite3_reset(stmt);
+  return row;
+}
+
+std::optional<CountryRow> lookup_country(sqlite3_stmt *stmt,
+                                         int64_t ip_version, int64_t ip_key) {
+  sqlite3_bind_int64(stmt, 2, ip_version);
+  sqlite3_bind_int64(stmt, 3, ip_key);
+  sqlite3_bind_int64(stmt, 4, ip_key);
+
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    sqlite3_reset(stmt);
+    return std::nullopt;
+  }
+
+  CountryRow row;
+  row.network = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+  row.prefix_length = sqlite3_column_int64(stmt, 1);
+  row.ip_version = sqlite3_column_int64(stmt, 2);
+  row.geoname_id = column_int64(stmt, 3);
+  row.registered_country_geoname_id = column_int64(stmt, 4);
+  row.represented_country_geoname_id = column_int64(stmt, 5);
+  row.is_anonymous_proxy = column_int64(stmt, 6);
+  row.is_satellite_provider = column_int64(stmt, 7);
+  row.is_anycast = column_int64(stmt, 8);
+  row.continent_code = column_text(stmt, 9);
+  row.continent_name = column_text(stmt, 10);
+  row.country_iso_code = column_text(stmt, 11);
+  row.country_name = column_text(stmt, 12);
+  row.is_in_european_union = column_int64(stmt, 13);
+
+  sqlite3_reset(stmt);
+  return row;
+}
+
+int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c = static_cast<char>(c | 0x20);
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// The parsers below accept exactly what glibc's inet_pton does, without
+// its NUL scan and per-call dispatch. A dotted quad has four decimal
+// octets of at most 255, without leading zeros.
+bool parse_ipv4_scalar(const char *text, size_t size, uint32_t &value) {
+  uint32_t result = 0;
+  size_t i = 0;
+  for (int octets = 1;; ++octets) {
+    if (i >= size || !is_digit(text[i])) {
+      return false;
+    }
+    uint32_t octet = static_cast<uint32_t>(text[i++] - '0');
+    if (octet == 0 && i < size && is_digit(text[i])) {
+      return false;
+    }
+    while (i < size && is_digit(text[i])) {
+      octet = octet * 10 + static_cast<uint32_t>(text[i++] - '0');
+      if (octet > 255) {
+        return false;
+      }
+    }
+    result = result << 8 | octet;
+    if (octets == 4) {
+      value = result;
+      return i == size;
+    }
+    if (i >= size || text[i] != '.') {
+      return false;
+    }
+    ++i;
+  }
+}
+
+// Writes `groups[0..filled)` to `bits`, expanding "::" before group `gap`
+// (-1 for none) as inet_pton does.
+bool finish_ipv6(const uint16_t *groups, int filled, int gap, Uint128 &bits) {
+  // "::" must stand for at least one group.
+  if (gap >= 0 ? filled == 8 : filled != 8) {
+    return false;
+  }
+  bits = 0;
+  for (int i = 0; i <= filled; ++i) {
+    if (i == gap) {
+      for (int zero = filled; zero < 8; ++zero) {
+        bits <<= 16;
+      }
+    }
+    if (i < filled) {
+      bits = (bits << 16) | groups[i];
+    }
+  }
+  return true;
+}
+
+// Up to eight groups of one to four hex digits, one "::" standing for a
+// run of zero groups, and optionally a dotted quad as the last 32 bits.
+bool parse_ipv6_scalar(const char *text, size_t size, Uint128 &bits) {
+  uint16_t groups[8];
+  int filled = 0;
+  int gap = -1;
+  size_t i = 0;
+  if (size == 0) {
+    return false;
+  }
+  if (text[0] == ':') {
+    if (size < 2 || text[1] != ':') {
+      return false;
+    }
+    i = 1;
+  }
+  size_t token = i;
+  int digits = 0;
+  uint32_t group = 0;
+  while (i < size) {
+    char c = text[i++];
+    int digit = hex_value(c);
+    if (digit >= 0) {
+      if (digits == 4) {
+        return false;
+      }
+      group = group << 4 | static_cast<uint32_t>(digit);
+      ++digits;
+      continue;
+    }
+    if (c == ':') {
+      token = i;
+      if (digits == 0) {
+        if (gap >= 0) {
+          return false;
+        }
+        gap = filled;
+        continue;
+      }
+      if (i == size || filled == 8) {
+        return false;
+      }
+      groups[filled++] = static_cast<uint16_t>(group);
+      digits = 0;
+      group = 0;
+      continue;
+    }
+    uint32_t quad;
+    if (c == '.' && filled + 2 <= 8 &&
+        parse_ipv4_scalar(text + token, size - token, quad)) {
+      groups[filled++] = static_cast<uint16_t>(quad >> 16);
+      groups[filled++] = static_cast<uint16_t>(quad);
+      digits = 0;
+      break;
+    }
+    return false;
+  }
+  if (digits > 0) {
+    if (filled == 8) {
+      return false;
+    }
+    groups[filled++] = static_cast<uint16_t>(group);
+  }
+  return finish_ipv6(groups, filled, gap, bits);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// pshufb patterns for dotted quads, indexed by the octet lengths (1 to 3
+// each, base 3). Each pattern right-aligns one octet's digits in each
+// 32-bit lane; 0x80 yields a zero byte.
+struct QuadPatterns {
+  uint8_t bytes[81][16];
+};
+
+constexpr QuadPatterns make_quad_patterns() {
+  QuadPatterns patterns{};
+  for (int index = 0; index < 81; ++index) {
+    int start = 0;
+    for (int octet = 0; octet < 4; ++octet) {
+      int divisor = octet == 0 ? 27 : octet == 1 ? 9 : octet == 2 ? 3 : 1;
+      int length = index / divisor % 3 + 1;
+      for (int byte = 0; byte < 4; ++byte) {
+        int digit = byte - (4 - length);
+        patterns.bytes[index][octet * 4 + byte] =
+            digit < 0 ? 0x80 : static_cast<uint8_t>(start + digit);
+      }
+      start += length + 1;
+    }
+  }
+  return patterns;
+}
+
+alignas(16) constexpr QuadPatterns kQuadPatterns = make_quad_patterns();
+
+// SSE4.2 dotted quad: one compare classifies all 15 bytes, bit tricks on
+// the digit and dot masks check the layout, and a shuffle plus two
+// multiply-adds convert the four octets at once.
+__attribute__((target("sse4.2"))) bool
+parse_ipv4_sse42(const char *text, size_t size, uint32_t &value) {
+  if (size < 8 || size > 15) {
+    // Seven bytes is the rare quad of single digits.
+    return size == 7 && parse_ipv4_scalar(text, size, value);
+  }
+  // Two overlapping 8-byte loads instead of a variable-length copy.
+  uint64_t low;
+  uint64_t high;
+  std::memcpy(&low, text, 8);
+  std::memcpy(&high, text + size - 8, 8);
+  high = size == 8 ? 0 : high >> (8 * (16 - size));
+  __m128i chars = _mm_set_epi64x(static_cast<long long>(high),
+                                 static_cast<long long>(low));
+  __m128i digits = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+  unsigned used = (1u << size) - 1;
+  unsigned digit_mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(
+                            _mm_min_epu8(digits, _mm_set1_epi8(9)), digits))) &
+                        used;
+  unsigned dot_mask = static_cast<unsigned>(_mm_movemask_epi8(
+                          _mm_cmpeq_epi8(chars, _mm_set1_epi8('.')))) &
+                      used;
+  unsigned zero_mask = static_cast<unsigned>(_mm_movemask_epi8(
+                           _mm_cmpeq_epi8(chars, _mm_set1_epi8('0')))) &
+                       used;
+  unsigned octet_starts = digit_mask & ~(digit_mask << 1);
+  if ((digit_mask | dot_mask) != used || __builtin_popcount(dot_mask) != 3 ||
+      // An empty octet.
+      (dot_mask & ((dot_mask << 1) | 1u | (1u << (size - 1)))) != 0 ||
+      // More than three digits.
+      (digit_mask & (digit_mask >> 1) & (digit_mask >> 2) &
+       (digit_mask >> 3)) != 0 ||
+      // A leading zero.
+      (zero_mask & octet_starts & (digit_mask >> 1)) != 0) {
+    return false;
+  }
+  int dot1 = __builtin_ctz(dot_mask);
+  dot_mask &= dot_mask - 1;
+  int dot2 = __builtin_ctz(dot_mask);
+  dot_mask &= dot_mask - 1;
+  int dot3 = __builtin_ctz(dot_mask);
+  int index = (dot1 - 1) * 27 + (dot2 - dot1 - 2) * 9 + (dot3 - dot2 - 2) * 3 +
+              (static_cast<int>(size) - dot3 - 2);
+  __m128i pattern = _mm_load_si128(
+      reinterpret_cast<const __m128i *>(kQuadPatterns.bytes[index]));
+  __m128i aligned = _mm_shuffle_epi8(digits, pattern);
+  __m128i pairs = _mm_maddubs_epi16(
+      aligned, _mm_setr_epi8(0, 100, 10, 1, 0, 100, 10, 1, 0, 100, 10, 1, 0,
+                             100, 10, 1));
+  __m128i octets = _mm_madd_epi16(pairs, _mm_set1_epi16(1));
+  if (_mm_movemask_epi8(_mm_cmpgt_epi32(octets, _mm_set1_epi32(255))) != 0) {
+    return false;
+  }
+  __m128i packed = _mm_shuffle_epi8(
+      octets, _mm_setr_epi8(12, 8, 4, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                            -1, -1, -1));
+  value = static_cast<uint32_t>(_mm_cvtsi128_si32(packed));
+  return true;
+}
+
+// SSE4.2 IPv6: classifies and converts up to 48 bytes in three steps, then
+// walks the colons with the bit mask. Addresses ending in a dotted quad
+// take the scalar path.
+__attribute__((target("sse4.2"))) bool
+parse_ipv6_sse42(const char *text, size_t size, Uint128 &bits) {
+  if (size == 0 || size > 45) {
+    return false;
+  }
+  alignas(16) char buffer[48] = {};
+  // Digit values, four bytes in: a group is read as the four bytes ending
+  // at its last digit.
+  uint8_t nibbles[4 + 48] = {};
+  std::memcpy(buffer, text, size);
+  uint64_t hex_mask = 0;
+  uint64_t colon_mask = 0;
+  uint64_t dot_mask = 0;
+  for (int part = 0; part < 3; ++part) {
+    __m128i chars =
+        _mm_load_si128(reinterpret_cast<const __m128i *>(buffer + part * 16));
+    __m128i digits = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    __m128i is_digit =
+        _mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits);
+    __m128i letters = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)),
+                                   _mm_set1_epi8('a'));
+    __m128i is_letter =
+        _mm_cmpeq_epi8(_mm_min_epu8(letters, _mm_set1_epi8(5)), letters);
+    __m128i values = _mm_blendv_epi8(
+        _mm_add_epi8(letters, _mm_set1_epi8(10)), digits, is_digit);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(nibbles + 4 + part * 16),
+                     values);
+    int shift = part * 16;
+    hex_mask |= static_cast<uint64_t>(static_cast<uint16_t>(
+                    _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter))))
+                << shift;
+    colon_mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(
+                      _mm_cmpeq_epi8(chars, _mm_set1_epi8(':')))))
+                  << shift;
+    dot_mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(chars, _mm_set1_epi8('.')))))
+                << shift;
+  }
+  uint64_t used = (uint64_t{1} << size) - 1;
+  if (dot_mask & used) {
+    return parse_ipv6_scalar(text, size, bits);
+  }
+  if (((hex_mask | colon_mask) & used) != used) {
+    return false;
+  }
+
+  uint16_t groups[8];
+  int filled = 0;
+  int gap = -1;
+  size_t pos = 0;
+  if (text[0] == ':') {
+    if (size < 2 || text[1] != ':') {
+      return false;
+    }
+    pos = 1;
+  }
+  colon_mask &= used;
+  while (pos < size) {
+    uint64_t ahead = colon_mask >> pos;
+    size_t end = ahead ? pos + static_cast<size_t>(__builtin_ctzll(ahead)) : size;
+    size_t length = end - pos;
+    if (length > 4) {
+      return false;
+    }
+    if (length == 0) {
+      if (gap >= 0) {
+        return false;
+      }
+      gap = filled;
+    } else {
+      if (end + 1 == size || filled == 8) {
+        return false;
+      }
+      uint32_t digits;
+      std::memcpy(&digits, nibbles + end, 4);
+      digits &= ~0u << (8 * (4 - length));
+      groups[filled++] = static_cast<uint16_t>(
+          ((digits << 12) & 0xF000) | (digits & 0x0F00) |
+          ((digits >> 12) & 0x00F0) | ((digits >> 24) & 0x000F));
+    }
+    pos = end + 1;
+  }
+  return finish_ipv6(groups, filled, gap, bits);
+}
+#endif
+
+struct IpParsers {
+  bool (*ipv4)(const char *, size_t, uint32_t &);
+  bool (*ipv6)(const char *, size_t, Uint128 &);
+};
+
+IpParsers select_ip_parsers() {
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return {parse_ipv4_sse42, parse_ipv6_sse42};
+  }
+#endif
+  return {parse_ipv4_scalar, parse_ipv6_scalar};
+}
+
+const IpParsers ip_parsers = select_ip_parsers();
+
+bool parse_ip(std::string_view ip, IpAddress &addr) {
+  // Like inet_pton, stop at a NUL.
+  size_t size = strnlen(ip.data(), ip.size());
+  uint32_t ipv4 = 0;
+  if (ip_parsers.ipv4(ip.data(), size, ipv4)) {
+    addr.version = 4;
+    addr.bits = static_cast<Uint128>(ipv4) << 96;
+    return true;
+  }
+  Uint128 ipv6 = 0;
+  if (ip_parsers.ipv6(ip.data(), size, ipv6)) {
+    addr.version = 6;
+    addr.bits = ipv6;
+    return true;
+  }
+  return false;
+}
+
+// First address bytes a reserved range can start with, per IP version, so
+// most addresses are cleared by one load.
+struct ReservedLeads {
+  bool lead[2][256] = {};
+};
+
+constexpr ReservedLeads reserved_leads() {
+  ReservedLeads leads;
+  for (const ReservedRange &range : kReservedRanges) {
+    int first = static_cast<int>(range.bits >> 120);
+    int count = range.prefix_length < 8 ? 1 << (8 - range.prefix_length) : 1;
+    for (int i = 0; i < count; ++i) {
+      leads.lead[range.ip_version == 6][first + i] = true;
+    }
+  }
+  return leads;
+}
+
+constexpr ReservedLeads kReservedLeads = reserved_leads();
+
+const ReservedRange *find_reserved(const IpAddress &addr) {
+  uint8_t first = static_cast<uint8_t>(addr.bits >> 120);
+  if (!kReservedLeads.lead[addr.version == 6][first]) {
+    return nullptr;
+  }
+  for (const ReservedRange &range : kReservedRanges) {
+    Uint128 mask = ~Uint128{0} << (128 - range.prefix_length);
+    if (range.ip_version == addr.version &&
+        ((addr.bits ^ range.bits) & mask) == 0) {
+      return range.globally_reachable ? nullptr : &range;
+    }
+  }
+  return nullptr;
+}
+
+// Narrows `span` to the addresses whose range key lies in [first, last].
+void narrow_span(AddressSpan &span, const IpAddress &addr, uint64_t first,
+                 uint64_t last) {
+  int shift = addr.version == 4 ? 96 : 64;
+  if (addr.version == 4) {
+    last = std::min<uint64_t>(last, 0xFFFFFFFFu);
+  }
+  Uint128 low = Uint128{first} << shift;
+  Uint128 high = (Uint128{last} << shift) | ((Uint128{1} << shift) - 1);
+  span.first = std::max(span.first, low);
+  span.last = std::min(span.last, high);
+}
+
+// Splits possibly nested ranges into elementary ones, keeping the longest
+// prefix (then the first row) that covers each of them.
+RangeColumns build_range_index(std::vector<RangeEntry> entries) {
+  RangeColumns index;
+  if (entries.empty()) {
+    return index;
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const RangeEntry &a, const RangeEntry &b) {
+              return a.start < b.start;
+            });
+
+  std::vector<int64_t> points;
+  points.reserve(entries.size() * 2);
+  for (const auto &entry : entries) {
+    points.push_back(entry.start);
+    if (entry.end < std::numeric_limits<int64_t>::max()) {
+      points.push_back(entry.end + 1);
+    }
+  }
+  std::sort(points.begin(), points.end());
+  points.erase(std::unique(points.begin(), points.end()), points.end());
+
+  auto weaker = [](const RangeEntry &a, const RangeEntry &b) {
+    if (a.prefix_length != b.prefix_length) {
+      return a.prefix_length < b.prefix_length;
+    }
+    return a.row > b.row;
+  };
+  std::priority_queue<RangeEntry, std::vector<RangeEntry>, decltype(weaker)>
+      active(weaker);
+
+  size_t next = 0;
+  for (size_t i = 0; i < points.size(); ++i) {
+    int64_t point = points[i];
+    while (next < entries.size() && entries[next].start <= point) {
+      active.push(entries[next]);
+      ++next;
+    }
+    while (!active.empty() && active.top().end < point) {
+      active.pop();
+    }
+    if (active.empty()) {
+      continue;
+    }
+    const RangeEntry &best = active.top();
+    int64_t end = i + 1 < points.size() ? points[i + 1] - 1 : best.end;
+    if (!index.rows.empty() && index.rows.back() == best.row &&
+        index.ends.back() == point - 1) {
+      index.ends.back() = end;
+      continue;
+    }
+    index.starts.push_back(point);
+    index.ends.push_back(end);
+    index.rows.push_back(best.row);
+  }
+  return index;
+}
+
+bool same_rows(const JoinedRow &a, const JoinedRow &b) {
+  return a.city == b.city && a.country == b.country && a.asn == b.asn;
+}
+
+// Overlays the elementary ranges of the city, country and ASN tables so a
+// single search answers all three.
+JoinedColumns join_ranges(const RangeColumns (&tables)[3]) {
+  std::vector<int64_t> points;
+  for (const RangeColumns &table : tables) {
+    for (size_t i = 0; i < table.starts.size(); ++i) {
+      points.push_back(table.starts[i]);
+      if (table.ends[i] < std::numeric_limits<int64_t>::max()) {
+        points.push_back(table.ends[i] + 1);
+      }
+    }
+  }
+  std::sort(points.begin(), points.end());
+  points.erase(std::unique(points.begin(), points.end()), points.end());
+
+  JoinedColumns joined;
+  size_t next[3] = {0, 0, 0};
+  for (size_t i = 0; i < points.size(); ++i) {
+    int64_t point = points[i];
+    uint32_t rows[3];
+    for (int t = 0; t < 3; ++t) {
+      const RangeColumns &table = tables[t];
+      while (next[t] < table.ends.size() && table.ends[next[t]] < point) {
+        ++next[t];
+      }
+      rows[t] = next[t] < table.starts.size() && table.starts[next[t]] <= point
+                    ? table.rows[next[t]]
+                    : kNoRow;
+    }
+    JoinedRow row;
+    row.city = rows[kCityTable];
+    row.country = row.city == kNoRow ? rows[kCountryTable] : kNoRow;
+    row.asn = rows[kAsnTable];
+    if (same_rows(row, JoinedRow())) {
+      continue;
+    }
+    int64_t end = i + 1 < points.size() ? points[i + 1] - 1
+                                        : std::numeric_limits<int64_t>::max();
+    if (!joined.rows.empty() && same_rows(joined.rows.back(), row) &&
+        joined.ends.back() == point - 1) {
+      joined.ends.back() = end;
+      continue;
+    }
+    joined.starts.push_back(point);
+    joined.ends.push_back(end);
+    joined.rows.push_back(row);
+  }
+  return joined;
+}
+
+// Fills the subtree rooted at node `k` with starts[pos...] in order and
+// returns the position after the last one used.
+size_t fill_tree(JoinedColumns &joined, size_t k, size_t pos) {
+  if (k >= joined.tree.size()) {
+    return pos;
+  }
+  pos = fill_tree(joined, 2 * k, pos);
+  joined.tree[k] = joined.starts[pos];
+  joined.ranks[k] = static_cast<uint32_t>(pos);
+  return fill_tree(joined, 2 * k + 1, pos + 1);
+}
+
+void build_search_tree(JoinedColumns &joined) {
+  joined.tree.clear();
+  joined.ranks.clear();
+  if (joined.starts.empty()) {
+    return;
+  }
+  joined.tree.resize(joined.starts.size() + 1);
+  joined.ranks.resize(joined.starts.size() + 1);
+  joined.tree[0] = std::numeric_limits<int64_t>::min();
+  joined.ranks[0] = static_cast<uint32_t>(joined.starts.size());
+  fill_tree(joined, 1, 0);
+}
+
+// One step down the tree. Past the leaves the walk reads the sentinel and
+// keeps going right, which the final shift discards.
+inline size_t tree_step(const int64_t *tree, size_t size, size_t k,
+                        int64_t key) {
+  return 2 * k + (tree[k <= size ? k : 0] <= key);
+}
+
+// Position in `starts` of the node the walk ended below: strip the right
+// turns taken after the last left turn, and that turn itself.
+inline size_t tree_rank(const RangeIndex &index, size_t k) {
+  return index.ranks[k >> __builtin_ffsll(static_cast<long long>(~k))];
+}
+
+// Position of the first start above `key`, or starts.size(). Branch-free:
+// every walk takes the same number of steps.
+size_t upper_bound(const RangeIndex &index, int64_t key) {
+  size_t size = index.starts.size();
+  if (size == 0) {
+    return 0;
+  }
+  const int64_t *tree = index.tree.data;
+  int levels = 64 - __builtin_clzll(size);
+  size_t k = 1;
+  for (int level = 0; level < levels; ++level) {
+    // Eight nodes fill a cache line: the descendants three levels down.
+    __builtin_prefetch(tree + 8 * k);
+    k = tree_step(tree, size, k, key);
+  }
+  return tree_rank(index, k);
+}
+
+// upper_bound for up to kSearchLanes keys. The walks advance one level at
+// a time in lockstep, so their cache misses overlap instead of queueing.
+void upper_bounds(const RangeIndex &index, const int64_t *keys, size_t count,
+                  size_t *next) {
+  size_t size = index.starts.size();
+  if (size == 0) {
+    std::fill(next, next + count, 0);
+    return;
+  }
+  const int64_t *tree = index.tree.data;
+  int levels = 64 - __builtin_clzll(size);
+  size_t k[kSearchLanes];
+  std::fill(k, k + count, 1);
+  for (int level = 0; level < levels; ++level) {
+    for (size_t lane = 0; lane < count; ++lane) {
+      k[lane] = tree_step(tree, size, k[lane], keys[lane]);
+      __builtin_prefetch(tree + k[lane]);
+    }
+  }
+  for (size_t lane = 0; lane < count; ++lane) {
+    next[lane] = tree_rank(index, k[lane]);
+  }
+}
+
+// The range holding `key`, given `next`, the upper bound of `key` in the
+// starts. Also narrows [first, last] to the keys that get the same answer.
+JoinedRow range_row(const RangeIndex &index, int64_t key, size_t next,
+                    uint64_t &first, uint64_t &last) {
+  if (next < index.starts.size()) {
+    last = static_cast<uint64_t>(index.starts[next]) - 1;
+  }
+  if (next == 0) {
+    return {};
+  }
+  size_t pos = next - 1;
+  if (index.ends[pos] < key) {
+    first = static_cast<uint64_t>(index.ends[pos]) + 1;
+    return {};
+  }
+  first = static_cast<uint64_t>(index.starts[pos]);
+  last = static_cast<uint64_t>(index.ends[pos]);
+  return index.rows[pos];
+}
+
+JoinedRow find_range(const RangeIndex &index, int64_t key, uint64_t &first,
+                     uint64_t &last) {
+  return range_row(index, key, upper_bound(index, key), first, last);
+}
+
+void paint_prefix(const TriePrefix &prefix, int offset, int stride,
+                  std::vector<uint32_t> &values, std::vector<int> &lengths) {
+  uint32_t first = prefix_chunk(prefix.bits, offset, stride);
+  uint32_t count = 1u << (offset + stride - prefix.length);
+  for (uint32_t slot = first; slot < first + count; ++slot) {
+    if (prefix.length > lengths[slot]) {
+      values[slot] = prefix.row;
+      lengths[slot] = prefix.length;
+    }
+  }
+}
+
+// Prefixes in [lo, hi) are sorted, lie under the node and are longer than
+// offset. Deeper ones are grouped per slot and become child nodes.
+void build_prefix_node(PrefixTrieArrays &trie, uint32_t node_id,
+                       const std::vector<TriePrefix> &prefixes, size_t lo,
+                       size_t hi, int offset, uint32_t inherited) {
+  std::vector<uint32_t> values(1u << kStride, inherited);
+  std::vector<int> lengths(1u << kStride, -1);
+  std::vector<std::pair<size_t, size_t>> groups(1u << kStride, {0, 0});
+  uint64_t vector = 0;
+  for (size_t i = lo; i < hi; ++i) {
+    const TriePrefix &prefix = prefixes[i];
+    if (prefix.length <= offset + kStride) {
+      paint_prefix(prefix, offset, kStride, values, lengths);
+      continue;
+    }
+    uint32_t slot = prefix_chunk(prefix.bits, offset, kStride);
+    if (!(vector >> slot & 1)) {
+      vector |= uint64_t{1} << slot;
+      groups[slot].first = i;
+    }
+    groups[slot].second = i + 1;
+  }
+
+  PrefixNode node;
+  node.vector = vector;
+  node.base0 = static_cast<uint32_t>(trie.leaves.size());
+  bool has_leaf = false;
+  uint32_t last = kNoRow;
+  for (uint32_t slot = 0; slot < (1u << kStride); ++slot) {
+    if (vector >> slot & 1) {
+      continue;
+    }
+    if (!has_leaf || values[slot] != last) {
+      node.leafvec |= uint64_t{1} << slot;
+      trie.leaves.push_back(values[slot]);
+      last = values[slot];
+      has_leaf = true;
+    }
+  }
+  node.base1 = static_cast<uint32_t>(trie.nodes.size());
+  trie.nodes.resize(trie.nodes.size() + __builtin_popcountll(vector));
+  trie.nodes[node_id] = node;
+
+  uint32_t child = node.base1;
+  for (uint32_t slot = 0; slot < (1u << kStride); ++slot) {
+    if (vector >> slot & 1) {
+      build_prefix_node(trie, child++, prefixes, groups[slot].first,
+                        groups[slot].second, offset + kStride, values[slot]);
+    }
+  }
+}
+
+PrefixTrieArrays build_prefix_trie(std::vector<TriePrefix> prefixes) {
+  std::stable_sort(prefixes.begin(), prefixes.end(),
+                   [](const TriePrefix &a, const TriePrefix &b) {
+                     if (a.bits != b.bits) {
+                       return a.bits < b.bits;
+                     }
+                     return a.length < b.length;
+                   });
+  PrefixTrieArrays trie;
+  std::vector<uint32_t> values(1u << kDirectBits, kNoRow);
+  std::vector<int> lengths(1u << kDirectBits, -1);
+  std::vector<std::pair<size_t, size_t>> groups(1u << kDirectBits, {0, 0});
+  std::vector<bool> deep(1u << kDirectBits, false);
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    const TriePrefix &prefix = prefixes[i];
+    if (prefix.length <= kDirectBits) {
+      paint_prefix(prefix, 0, kDirectBits, values, lengths);
+      continue;
+    }
+    uint32_t slot = prefix_chunk(prefix.bits, 0, kDirectBits);
+    if (!deep[slot]) {
+      deep[slot] = true;
+      groups[slot].first = i;
+    }
+    groups[slot].second = i + 1;
+  }
+
+  trie.direct.resize(1u << kDirectBits);
+  for (uint32_t slot = 0; slot < (1u << kDirectBits); ++slot) {
+    if (!deep[slot]) {
+      trie.direct[slot] = kDirectLeaf | static_cast<uint32_t>(trie.leaves.size());
+      trie.leaves.push_back(values[slot]);
+      continue;
+    }
+    uint32_t node_id = static_cast<uint32_t>(trie.nodes.size());
+    trie.nodes.emplace_back();
+    trie.direct[slot] = node_id;
+    build_prefix_node(trie, node_id, prefixes, groups[slot].first,
+                      groups[slot].second, kDirectBits, values[slot]);
+  }
+  return trie;
+}
+
+
+bool parse_network(std::string_view network, int64_t prefix_length,
+                   int64_t ip_version, TriePrefix &prefix) {
+  IpAddress addr;
+  if (!parse_ip(std::string(network.substr(0, network.find('/'))), addr) ||
+      addr.version != ip_version) {
+    return false;
+  }
+  int width = ip_version == 4 ? 32 : 128;
+  if (prefix_length < 0 || prefix_length > width) {
+    return false;
+  }
+  prefix.length = static_cast<int>(prefix_length);
+  prefix.bits = prefix.length == 0
+                    ? 0
+                    : addr.bits & ((~Uint128{0}) << (128 - prefix.length));
+  return true;
+}
+
+// Compiled index file layout: a header page, then one page-aligned section
+// per table. Location tables hold one run per locale, all indexed by the
+// same location id, so blocks are shared between locales.
+constexpr char kIndexMagic[8] = {'G', 'E', 'O', 'I', 'P', 'I', 'D', 'X'};
+constexpr uint32_t kIndexByteOrder = 0x01020304;
+constexpr size_t kIndexPage = 4096;
+constexpr size_t kIndexLocaleBytes = 16;
+
+enum IndexSectionId {
+  kStringsSection,
+  kCityBlocksSection,
+  kCityLocationsSection,
+  kCountryBlocksSection,
+  kCountryLocationsSection,
+  kAsnBlocksSection,
+  kCityGeoSection,
+  kCountryGeoSection,
+  kContinentsSection,
+  kCountriesSection,
+  kSubdivisionsSection,
+  kCitiesSection,
+  kTimeZonesSection,
+  kPostalCodesSection,
+  kOrganizationsSection,
+  kCoordinatesSection,
+  kIntegersSection,
+  kExactFlagsSection,
+  // starts, ends, joined rows, search tree and tree ranks for each ip
+  // version.
+  kRangeSections,
+  // direct, nodes and leaves for each table and ip version.
+  kTrieSections = kRangeSections + 2 * 5,
+  kSectionCount = kTrieSections + 3 * 2 * 3,
+};
+
+struct IndexSection {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t format_version;
+  uint32_t byte_order;
+  uint64_t file_size;
+  // Covers everything after the header page.
+  uint64_t checksum;
+  int64_t built_at;
+  uint32_t flags;
+  uint32_t locale_count;
+  uint64_t city_location_count;
+  uint64_t country_location_count;
+  char locales[kMaxIndexLocales][kIndexLocaleBytes];
+  IndexSection sections[kSectionCount];
+  // Covers the fields above.
+  uint64_t header_checksum;
+};
+
+static_assert(sizeof(IndexHeader) <= kIndexPage, "index header fits a page");
+static_assert(offsetof(IndexHeader, header_checksum) % 8 == 0,
+              "header checksum covers whole words");
+
+// Locale codes are stored NUL-padded; longer codes are compared on their
+// first kIndexLocaleBytes - 1 bytes.
+std::string_view index_locale(const std::string &locale) {
+  return std::string_view(locale).substr(0, kIndexLocaleBytes - 1);
+}
+
+int range_section(int slot) {
+  return kRangeSections + slot * 5;
+}
+
+int trie_section(BlockTable table, int slot) {
+  return kTrieSections + (table * 2 + slot) * 3;
+}
+
+// FNV-1a over 64-bit words. It only has to catch truncated or damaged
+// files, and runs at memory speed.
+uint64_t index_checksum(const uint64_t *words, size_t count) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < count; ++i) {
+    hash ^= words[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Repeated values (names, codes, time zones) share one copy in the pool;
+// networks are unique per block and skip the lookup.
+PoolString pool_string(IndexBuilder &builder, const char *text, size_t length,
+                       bool shared) {
+  std::string value(text, length);
+  if (shared) {
+    auto it = builder.shared_strings.find(value);
+    if (it != builder.shared_strings.end()) {
+      return it->second;
+    }
+  }
+  PoolString stored;
+  stored.offset = static_cast<uint32_t>(builder.strings.size());
+  stored.length = static_cast<uint32_t>(length);
+  builder.strings += value;
+  if (shared) {
+    builder.shared_strings.emplace(std::move(value), stored);
+  }
+  return stored;
+}
+
+PoolString column_pool(IndexBuilder &builder, sqlite3_stmt *stmt, int idx,
+                       bool shared = true) {
+  if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
+    return {};
+  }
+  const auto *text =
+      reinterpret_cast<const char *>(sqlite3_column_text(stmt, idx));
+  return pool_string(builder, text,
+                     static_cast<size_t>(sqlite3_column_bytes(stmt, idx)),
+                     shared);
+}
+
+void compact_error(IndexBuilder &builder, const char *column,
+                   const std::string &value) {
+  if (builder.error.empty()) {
+    builder.error = std::string("Value ") + value + " of " + column +
+                    " does not fit the compact index.";
+  }
+}
+
+// Narrows a network column to T; NULL becomes the largest T. The engines
+// read prefix lengths and ip versions directly, so they cannot spill.
+template <typename T>
+T compact_int(IndexBuilder &builder, const char *column,
+              std::optional<int64_t> value) {
+  constexpr T null = std::numeric_limits<T>::max();
+  if (!value.has_value()) {
+    return null;
+  }
+  if (*value < 0 || static_cast<uint64_t>(*value) >= null) {
+    compact_error(builder, column, std::to_string(*value));
+    return null;
+  }
+  return static_cast<T>(*value);
+}
+
+// Appends `value` to the exact integer table and returns its position.
+size_t exact_int(IndexBuilder &builder, int64_t value) {
+  builder.integers.push_back(value);
+  return builder.integers.size() - 1;
+}
+
+// Narrows an id or radius column to T; NULL becomes the largest T, and a
+// value that does not fit below kExactInt<T> is kept exactly.
+template <typename T>
+T compact_column(IndexBuilder &builder, sqlite3_stmt *stmt, int idx,
+                 const char *column) {
+  constexpr T null = std::numeric_limits<T>::max();
+  auto value = column_int64(stmt, idx);
+  if (!value.has_value()) {
+    return null;
+  }
+  if (*value >= 0 && static_cast<uint64_t>(*value) < kExactInt<T>) {
+    return static_cast<T>(*value);
+  }
+  if (builder.integers.size() >= static_cast<size_t>(null - kExactInt<T>)) {
+    compact_error(builder, column, std::to_string(*value));
+    return null;
+  }
+  return static_cast<T>(kExactInt<T> + exact_int(builder, *value));
+}
+
+// Packs a nullable boolean column into two bits of `flags`. Any other value
+// goes to the exact flag table under `record`.
+void compact_flag(IndexBuilder &builder, sqlite3_stmt *stmt, int idx,
+                  uint64_t record, int shift, uint8_t &flags) {
+  auto value = column_int64(stmt, idx);
+  int code = 0;
+  if (value == 0 || value == 1) {
+    code = static_cast<int>(*value) + 1;
+  } else if (value.has_value()) {
+    builder.exact_flags.push_back({record | static_cast<uint64_t>(shift),
+                                   *value});
+    code = kExactFlag;
+  }
+  flags |= static_cast<uint8_t>(code << shift);
+}
+
+int32_t compact_coordinate(IndexBuilder &builder, sqlite3_stmt *stmt,
+                           int idx) {
+  auto value = column_double(stmt, idx);
+  if (!value.has_value()) {
+    return kNullCoordinate;
+  }
+  double scaled = std::round(*value * kCoordinateScale);
+  if (std::abs(scaled) < kExactCoordinate) {
+    double decoded = scaled / kCoordinateScale;
+    if (std::memcmp(&decoded, &*value, sizeof(double)) == 0) {
+      return static_cast<int32_t>(scaled);
+    }
+  }
+  builder.coordinates.push_back(*value);
+  return kExactCoordinate +
+         static_cast<int32_t>(builder.coordinates.size() - 1);
+}
+
+uint64_t dictionary_key(PoolString value) {
+  return value.offset;
+}
+
+uint64_t dictionary_key(NamedCode value) {
+  return uint64_t{value.code.offset} << 32 | value.name.offset;
+}
+
+uint64_t dictionary_key(CityName value) {
+  return uint64_t{value.name.offset} << 32 | value.metro_code.offset;
+}
+
+// The id of `entry`, added on first use. Shared pool strings are unique,
+// so equal entries have equal keys.
+template <typename T, typename Entry>
+T dictionary_id(IndexBuilder &builder, DictionaryBuilder<Entry> &dictionary,
+                const char *column, const Entry &entry) {
+  auto [it, added] = dictionary.ids.emplace(
+      dictionary_key(entry), static_cast<uint32_t>(dictionary.entries.size()));
+  if (added) {
+    dictionary.entries.push_back(entry);
+  }
+  if (it->second > std::numeric_limits<T>::max()) {
+    compact_error(builder, column, "#" + std::to_string(it->second));
+    return 0;
+  }
+  return static_cast<T>(it->second);
+}
+
+Dictionaries dictionary_view(const IndexBuilder &builder) {
+  auto view = [](const auto &dictionary) {
+    using Entries = std::decay_t<decltype(dictionary.entries)>;
+    return Table<typename Entries::value_type>{dictionary.entries.data(),
+                                               dictionary.entries.size()};
+  };
+  return {view(builder.continents),    view(builder.countries),
+          view(builder.subdivisions),  view(builder.cities),
+          view(builder.time_zones),    view(builder.postal_codes),
+          view(builder.organizations)};
+}
+
+std::optional<std::string> stored_string(const Table<char> &strings,
+                                         PoolString value) {
+  if (value.offset == kNullString) {
+    return std::nullopt;
+  }
+  return std::string(pool_view(strings, value));
+}
+
+std::optional<std::string> stored_string(const MemoryIndex &index,
+                                         PoolString value) {
+  return stored_string(index.strings, value);
+}
+
+template <typename T>
+std::optional<int64_t> stored_int(const MemoryIndex &index, T value) {
+  if (value == std::numeric_limits<T>::max()) {
+    return std::nullopt;
+  }
+  if (value >= kExactInt<T>) {
+    return index.integers[value - kExactInt<T>];
+  }
+  return value;
+}
+
+std::optional<int64_t> stored_flag(const Table<ExactFlag> &exact_flags,
+                                   uint64_t record, uint8_t flags, int shift) {
+  int value = flags >> shift & 3;
+  if (value == 0) {
+    return std::nullopt;
+  }
+  if (value == kExactFlag) {
+    uint64_t key = record | static_cast<uint64_t>(shift);
+    auto it = std::lower_bound(
+        exact_flags.begin(), exact_flags.end(), key,
+        [](const ExactFlag &flag, uint64_t key) { return flag.key < key; });
+    if (it == exact_flags.end() || it->key != key) {
+      return std::nullopt;
+    }
+    return it->value;
+  }
+  return value - 1;
+}
+
+std::optional<double> stored_coordinate(const MemoryIndex &index,
+                                        int32_t value) {
+  if (value == kNullCoordinate) {
+    return std::nullopt;
+  }
+  if (value >= kExactCoordinate) {
+    return index.coordinates[static_cast<size_t>(value - kExactCoordinate)];
+  }
+  return value / kCoordinateScale;
+}
+
+template <typename Fn>
+bool for_each_row(sqlite3 *db, const char *sql, const std::string *locale,
+                  Fn &&fn) {
+  sqlite3_stmt *stmt = nullptr;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    return false;
+  }
+  if (locale) {
+    sqlite3_bind_text(stmt, 1, locale->c_str(), -1, SQLITE_TRANSIENT);
+  }
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    fn(stmt);
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE;
+}
+
+void add_range(std::vector<RangeEntry> (&entries)[2], sqlite3_stmt *stmt,
+               int start_idx, int64_t prefix_length, int64_t ip_version,
+               size_t row) {
+  int slot = version_slot(ip_version);
+  if (slot < 0) {
+    return;
+  }
+  entries[slot].push_back({sqlite3_column_int64(stmt, start_idx),
+                           sqlite3_column_int64(stmt, start_idx + 1),
+                           prefix_length, static_cast<uint32_t>(row)});
+}
+
+template <typename Block>
+void collect_prefixes(const IndexBuilder &builder,
+                      const std::vector<Block> &blocks,
+                      std::vector<TriePrefix> (&prefixes)[2]) {
+  Table<char> strings{builder.strings.data(), builder.strings.size()};
+  for (size_t row = 0; row < blocks.size(); ++row) {
+    const Block &block = blocks[row];
+    int slot = version_slot(block.ip_version);
+    TriePrefix prefix;
+    if (slot < 0 ||
+        !parse_network(pool_view(strings, block.network), block.prefix_length,
+                       block.ip_version, prefix)) {
+      continue;
+    }
+    prefix.row = static_cast<uint32_t>(row);
+    prefixes[slot].push_back(prefix);
+  }
+}
+
+void build_prefix_tries(IndexBuilder &builder) {
+  std::vector<TriePrefix> prefixes[3][2];
+  collect_prefixes(builder, builder.city_blocks, prefixes[kCityTable]);
+  collect_prefixes(builder, builder.country_blocks, prefixes[kCountryTable]);
+  collect_prefixes(builder, builder.asn_blocks, prefixes[kAsnTable]);
+  for (int table = 0; table < 3; ++table) {
+    for (int slot = 0; slot < 2; ++slot) {
+      builder.tries[table][slot] =
+          build_prefix_trie(std::move(prefixes[table][slot]));
+    }
+  }
+}
+
+// Location rows of every locale share one id per geoname_id. A locale that
+// lacks a geoname gets an all-NULL record, which renders like a miss.
+// `fill` also gets the key of the record's flags.
+template <typename Location, typename Fill>
+bool load_locations(sqlite3 *db, const char *sql, IndexBuilder &builder,
+                    std::unordered_map<int64_t, uint32_t> &ids,
+                    std::vector<std::vector<Location>> &tables,
+                    FlagTable flag_table, Fill &&fill) {
+  tables.resize(builder.locales.size());
+  for (size_t locale = 0; locale < builder.locales.size(); ++locale) {
+    std::vector<Location> &table = tables[locale];
+    std::vector<bool> seen;
+    bool ok = for_each_row(
+        db, sql, &builder.locales[locale], [&](sqlite3_stmt *stmt) {
+          auto id = column_int64(stmt, 0);
+          if (!id.has_value()) {
+            return;
+          }
+          auto it = ids.emplace(*id, static_cast<uint32_t>(ids.size())).first;
+          if (table.size() <= it->second) {
+            table.resize(ids.size());
+            seen.resize(ids.size());
+          }
+          if (seen[it->second]) {
+            return;
+          }
+          seen[it->second] = true;
+          fill(stmt, table[it->second],
+               flag_record(flag_table, locale, it->second));
+        });
+    if (!ok) {
+      return false;
+    }
+  }
+  for (auto &table : tables) {
+    table.resize(ids.size());
+  }
+  return true;
+}
+
+uint32_t location_id(const std::unordered_map<int64_t, uint32_t> &ids,
+                     std::optional<int64_t> geoname_id) {
+  if (!geoname_id.has_value()) {
+    return kNoLocation;
+  }
+  auto it = ids.find(*geoname_id);
+  return it == ids.end() ? kNoLocation : it->second;
+}
+
+void copy_location(const Table<char> &strings, const Dictionaries &dictionaries,
+                   const Table<ExactFlag> &exact_flags, uint64_t record,
+                   const CityLocation &loc, CityRow &row) {
+  const NamedCode &continent = dictionaries.continents[loc.continent];
+  const NamedCode &country = dictionaries.countries[loc.country];
+  const NamedCode &subdivision_1 = dictionaries.subdivisions[loc.subdivision_1];
+  const NamedCode &subdivision_2 = dictionaries.subdivisions[loc.subdivision_2];
+  const CityName &city = dictionaries.cities[loc.city];
+  row.continent_code = stored_string(strings, continent.code);
+  row.continent_name = stored_string(strings, continent.name);
+  row.country_iso_code = stored_string(strings, country.code);
+  row.country_name = stored_string(strings, country.name);
+  row.subdivision_1_iso_code = stored_string(strings, subdivision_1.code);
+  row.subdivision_1_name = stored_string(strings, subdivision_1.name);
+  row.subdivision_2_iso_code = stored_string(strings, subdivision_2.code);
+  row.subdivision_2_name = stored_string(strings, subdivision_2.name);
+  row.city_name = stored_string(strings, city.name);
+  row.metro_code = stored_string(strings, city.metro_code);
+  row.time_zone =
+      stored_string(strings, dictionaries.time_zones[loc.time_zone]);
+  row.is_in_european_union =
+      stored_flag(exact_flags, record, loc.flags, kEuropeanUnionFlag);
+}
+
+void copy_location(const Table<char> &strings, const Dictionaries &dictionaries,
+                   const Table<ExactFlag> &exact_flags, uint64_t record,
+                   const CountryLocation &loc, CountryRow &row) {
+  const NamedCode &continent = dictionaries.continents[loc.continent];
+  const NamedCode &country = dictionaries.countries[loc.country];
+  row.continent_code = stored_string(strings, continent.code);
+  row.continent_name = stored_string(strings, continent.name);
+  row.country_iso_code = stored_string(strings, country.code);
+  row.country_name = stored_string(strings, country.name);
+  row.is_in_european_union =
+      stored_flag(exact_flags, record, loc.flags, kEuropeanUnionFlag);
+}
+
+// Renders the "geo" object of every location in every locale into the
+// pool. Locations that render alike share one copy.
+template <typename Row, typename Location>
+void render_geo(IndexBuilder &builder,
+                const std::vector<std::vector<Location>> &tables,
+                FlagTable flag_table,
+                std::vector<std::vector<PoolString>> &fragments) {
+  std::string text;
+  Dictionaries dictionaries = dictionary_view(builder);
+  Table<ExactFlag> exact_flags{builder.exact_flags.data(),
+                               builder.exact_flags.size()};
+  fragments.resize(tables.size());
+  for (size_t locale = 0; locale < tables.size(); ++locale) {
+    fragments[locale].reserve(tables[locale].size());
+    for (size_t i = 0; i < tables[locale].size(); ++i) {
+      Row row;
+      copy_location({builder.strings.data(), builder.strings.size()},
+                    dictionaries, exact_flags,
+                    flag_record(flag_table, locale, i), tables[locale][i],
+                    row);
+      text.clear();
+      append_geo(text, row);
+      fragments[locale].push_back(
+          pool_string(builder, text.data(), text.size(), true));
+    }
+  }
+}
+
+void render_asn(IndexBuilder &builder) {
+  std::string text;
+  for (AsnBlock &block : builder.asn_blocks) {
+    Table<char> strings{builder.strings.data(), builder.strings.size()};
+    std::optional<int64_t> number;
+    if (block.has_number == kExactNumber) {
+      number = builder.integers[block.autonomous_system_number];
+    } else if (block.has_number == kNumber) {
+      number = block.autonomous_system_number;
+    }
+    text.clear();
+    append_asn_members(
+        text, number,
+        stored_string(strings,
+                      builder.organizations.entries[block.organization]));
+    block.rendered = pool_string(builder, text.data(), text.size(), true);
+  }
+}
+
+// Reads the blocks and the given locales from SQLite and builds the range
+// index and/or the prefix tries, as selected by `flags`.
+bool build_index(sqlite3 *db, uint32_t flags, IndexBuilder &builder) {
+  // Id 0 is the all-NULL entry, so a default location record is all NULL.
+  dictionary_id<uint16_t>(builder, builder.continents, "continent",
+                          NamedCode());
+  dictionary_id<uint16_t>(builder, builder.countries, "country", NamedCode());
+  dictionary_id<uint32_t>(builder, builder.subdivisions, "subdivision",
+                          NamedCode());
+  dictionary_id<uint32_t>(builder, builder.cities, "city_name", CityName());
+  dictionary_id<uint16_t>(builder, builder.time_zones, "time_zone",
+                          PoolString());
+  std::unordered_map<int64_t, uint32_t> city_location_ids;
+  bool ok = load_locations(
+      db,
+      "SELECT geoname_id, continent_code, continent_name, country_iso_code, "
+      "country_name, subdivision_1_iso_code, subdivision_1_name, "
+      "subdivision_2_iso_code, subdivision_2_name, city_name, metro_code, "
+      "time_zone, is_in_european_union "
+      "FROM city_locations WHERE locale_code = ?",
+      builder, city_location_ids, builder.city_locations, kCityLocationFlags,
+      [&](sqlite3_stmt *stmt, CityLocation &loc, uint64_t record) {
+        loc.continent = dictionary_id<uint16_t>(
+            builder, builder.continents, "continent",
+            NamedCode{column_pool(builder, stmt, 1),
+                      column_pool(builder, stmt, 2)});
+        loc.country = dictionary_id<uint16_t>(
+            builder, builder.countries, "country",
+            NamedCode{column_pool(builder, stmt, 3),
+                      column_pool(builder, stmt, 4)});
+        loc.subdivision_1 = dictionary_id<uint32_t>(
+            builder, builder.subdivisions, "subdivision_1",
+            NamedCode{column_pool(builder, stmt, 5),
+                      column_pool(builder, stmt, 6)});
+        loc.subdivision_2 = dictionary_id<uint32_t>(
+            builder, builder.subdivisions, "subdivision_2",
+            NamedCode{column_pool(builder, stmt, 7),
+                      column_pool(builder, stmt, 8)});
+        loc.city = dictionary_id<uint32_t>(
+            builder, builder.cities, "city_name",
+            CityName{column_pool(builder, stmt, 9),
+                     column_pool(builder, stmt, 10)});
+        loc.time_zone = dictionary_id<uint16_t>(
+            builder, builder.time_zones, "time_zone",
+            column_pool(builder, stmt, 11));
+        compact_flag(builder, stmt, 12, record, kEuropeanUnionFlag,
+                     loc.flags);
+      });
+
+  ok = ok && for_each_row(
+      db,
+      "SELECT network, prefix_length, ip_version, network_start, network_end, "
+      "geoname_id, registered_country_geoname_id, "
+      "represented_country_geoname_id, is_anonymous_proxy, "
+      "is_satellite_provider, is_anycast, postal_code, latitude, longitude, "
+      "accuracy_radius "
+      "FROM city_blocks",
+      nullptr, [&](sqlite3_stmt *stmt) {
+        CityBlock block;
+        uint64_t record =
+            flag_record(kCityBlockFlags, 0, builder.city_blocks.size());
+        int64_t prefix_length = sqlite3_column_int64(stmt, 1);
+        int64_t ip_version = sqlite3_column_int64(stmt, 2);
+        block.network = column_pool(builder, stmt, 0, false);
+        block.prefix_length =
+            compact_int<uint8_t>(builder, "prefix_length", prefix_length);
+        block.ip_version =
+            compact_int<uint8_t>(builder, "ip_version", ip_version);
+        block.geoname_id =
+            compact_column<uint32_t>(builder, stmt, 5, "geoname_id");
+        block.registered_country_geoname_id = compact_column<uint32_t>(
+            builder, stmt, 6, "registered_country_geoname_id");
+        block.represented_country_geoname_id = compact_column<uint32_t>(
+            builder, stmt, 7, "represented_country_geoname_id");
+        compact_flag(builder, stmt, 8, record, kAnonymousProxyFlag,
+                     block.flags);
+        compact_flag(builder, stmt, 9, record, kSatelliteProviderFlag,
+                     block.flags);
+        compact_flag(builder, stmt, 10, record, kAnycastFlag, block.flags);
+        block.postal_code = dictionary_id<uint32_t>(
+            builder, builder.postal_codes, "postal_code",
+            column_pool(builder, stmt, 11));
+        block.latitude = compact_coordinate(builder, stmt, 12);
+        block.longitude = compact_coordinate(builder, stmt, 13);
+        block.accuracy_radius =
+            compact_column<uint16_t>(builder, stmt, 14, "accuracy_radius");
+        block.location = location_id(city_location_ids, column_int64(stmt, 5));
+        add_range(builder.entries[kCityTable], stmt, 3, prefix_length,
+                  ip_version, builder.city_blocks.size());
+        builder.city_blocks.push_back(block);
+      });
+
+  std::unordered_map<int64_t, uint32_t> country_location_ids;
+  ok = ok && load_locations(
+      db,
+      "SELECT geoname_id, continent_code, continent_name, country_iso_code, "
+      "country_name, is_in_european_union "
+      "FROM country_locations WHERE locale_code = ?",
+      builder, country_location_ids, builder.country_locations,
+      kCountryLocationFlags,
+      [&](sqlite3_stmt *stmt, CountryLocation &loc, uint64_t record) {
+        loc.continent = dictionary_id<uint16_t>(
+            builder, builder.continents, "continent",
+            NamedCode{column_pool(builder, stmt, 1),
+                      column_pool(builder, stmt, 2)});
+        loc.country = dictionary_id<uint16_t>(
+            builder, builder.countries, "country",
+            NamedCode{column_pool(builder, stmt, 3),
+                      column_pool(builder, stmt, 4)});
+        compact_flag(builder, stmt, 5, record, kEuropeanUnionFlag,
+                     loc.flags);
+      });
+
+  ok = ok && for_each_row(
+      db,
+      "SELECT network, prefix_length, ip_version, network_start, network_end, "
+      "geoname_id, registered_country_geoname_id, "
+      "represented_country_geoname_id, is_anonymous_proxy, "
+      "is_satellite_provider, is_anycast "
+      "FROM country_blocks",
+      nullptr, [&](sqlite3_stmt *stmt) {
+        CountryBlock block;
+        uint64_t record =
+            flag_record(kCountryBlockFlags, 0, builder.country_blocks.size());
+        int64_t prefix_length = sqlite3_column_int64(stmt, 1);
+        int64_t ip_version = sqlite3_column_int64(stmt, 2);
+        block.network = column_pool(builder, stmt, 0, false);
+        block.prefix_length =
+            compact_int<uint8_t>(builder, "prefix_length", prefix_length);
+        block.ip_version =
+            compact_int<uint8_t>(builder, "ip_version", ip_version);
+        block.geoname_id =
+            compact_column<uint32_t>(builder, stmt, 5, "geoname_id");
+        block.registered_country_geoname_id = compact_column<uint32_t>(
+            builder, stmt, 6, "registered_country_geoname_id");
+        block.represented_country_geoname_id = compact_column<uint32_t>(
+            builder, stmt, 7, "represented_country_geoname_id");
+        compact_flag(builder, stmt, 8, record, kAnonymousProxyFlag,
+                     block.flags);
+        compact_flag(builder, stmt, 9, record, kSatelliteProviderFlag,
+                     block.flags);
+        compact_flag(builder, stmt, 10, record, kAnycastFlag, block.flags);
+        block.location =
+            location_id(country_location_ids, column_int64(stmt, 5));
+        add_range(builder.entries[kCountryTable], stmt, 3, prefix_length,
+                  ip_version, builder.country_blocks.size());
+        builder.country_blocks.push_back(block);
+      });
+
+  ok = ok && for_each_row(
+      db,
+      "SELECT network, prefix_length, ip_version, network_start, network_end, "
+      "autonomous_system_number, autonomous_system_organization "
+      "FROM asn_blocks",
+      nullptr, [&](sqlite3_stmt *stmt) {
+        AsnBlock block;
+        int64_t prefix_length = sqlite3_column_int64(stmt, 1);
+        int64_t ip_version = sqlite3_column_int64(stmt, 2);
+        block.network = column_pool(builder, stmt, 0, false);
+        block.prefix_length =
+            compact_int<uint8_t>(builder, "prefix_length", prefix_length);
+        block.ip_version =
+            compact_int<uint8_t>(builder, "ip_version", ip_version);
+        auto number = column_int64(stmt, 5);
+        if (number.has_value()) {
+          if (*number < 0 || *number > std::numeric_limits<uint32_t>::max()) {
+            block.autonomous_system_number =
+                static_cast<uint32_t>(exact_int(builder, *number));
+            block.has_number = kExactNumber;
+          } else {
+            block.autonomous_system_number = static_cast<uint32_t>(*number);
+            block.has_number = kNumber;
+          }
+        }
+        block.organization = dictionary_id<uint32_t>(
+            builder, builder.organizations, "autonomous_system_organization",
+            column_pool(builder, stmt, 6));
+        add_range(builder.entries[kAsnTable], stmt, 3, prefix_length,
+                  ip_version, builder.asn_blocks.size());
+        builder.asn_blocks.push_back(block);
+      });
+  if (!ok) {
+    builder.error = std::string("Failed to read blocks: ") + sqlite3_errmsg(db);
+    return false;
+  }
+  if (!builder.error.empty()) {
+    return false;
+  }
+  std::sort(builder.exact_flags.begin(), builder.exact_flags.end(),
+            [](const ExactFlag &a, const ExactFlag &b) { return a.key < b.key; });
+  render_geo<CityRow>(builder, builder.city_locations, kCityLocationFlags,
+                      builder.city_geo);
+  render_geo<CountryRow>(builder, builder.country_locations,
+                         kCountryLocationFlags, builder.country_geo);
+  render_asn(builder);
+  if (builder.strings.size() >= kNullString) {
+    builder.error = "The string pool does not fit the compact index.";
+    return false;
+  }
+
+  if (flags & kIndexHasTries) {
+    build_prefix_tries(builder);
+  }
+  for (int slot = 0; slot < 2; ++slot) {
+    if (flags & kIndexHasRanges) {
+      RangeColumns tables[3];
+      for (int table = 0; table < 3; ++table) {
+        tables[table] =
+            build_range_index(std::move(builder.entries[table][slot]));
+      }
+      builder.ranges[slot] = join_ranges(tables);
+      build_search_tree(builder.ranges[slot]);
+    }
+    for (int table = 0; table < 3; ++table) {
+      builder.entries[table][slot] = {};
+    }
+  }
+  return true;
+}
+
+// Appends `bytes` at the next page boundary of the image.
+void add_section(std::vector<uint64_t> &image, IndexHeader &header, int id,
+                 const void *data, size_t bytes) {
+  size_t offset = (image.size() * 8 + kIndexPage - 1) / kIndexPage * kIndexPage;
+  image.resize((offset + bytes + 7) / 8, 0);
+  if (bytes > 0) {
+    std::memcpy(reinterpret_cast<char *>(image.data()) + offset, data, bytes);
+  }
+  header.sections[id] = {offset, bytes};
+}
+
+template <typename T>
+void add_section(std::vector<uint64_t> &image, IndexHeader &header, int id,
+                 const std::vector<T> &values) {
+  add_section(image, header, id, values.data(), values.size() * sizeof(T));
+}
+
+template <typename T>
+void add_locale_section(std::vector<uint64_t> &image, IndexHeader &header,
+                        int id, const std::vector<std::vector<T>> &tables) {
+  std::vector<T> flat;
+  for (const auto &table : tables) {
+    flat.insert(flat.end(), table.begin(), table.end());
+  }
+  add_section(image, header, id, flat);
+}
+
+// Lays the builder out as an index image: the exact bytes of the file.
+std::vector<uint64_t> write_index_image(const IndexBuilder &builder,
+                                        uint32_t flags) {
+  IndexHeader header{};
+  std::memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+  header.format_version = kIndexFormatVersion;
+  header.byte_order = kIndexByteOrder;
+  header.built_at = static_cast<int64_t>(std::time(nullptr));
+  header.flags = flags;
+  header.locale_count = static_cast<uint32_t>(builder.locales.size());
+  for (size_t i = 0; i < builder.locales.size(); ++i) {
+    std::memcpy(header.locales[i], builder.locales[i].data(),
+                index_locale(builder.locales[i]).size());
+  }
+  header.city_location_count =
+      builder.city_locations.empty() ? 0 : builder.city_locations[0].size();
+  header.country_location_count =
+      builder.country_locations.empty() ? 0 : builder.country_locations[0].size();
+
+  std::vector<uint64_t> image(kIndexPage / 8, 0);
+  add_section(image, header, kStringsSection, builder.strings.data(),
+              builder.strings.size());
+  add_section(image, header, kCityBlocksSection, builder.city_blocks);
+  add_locale_section(image, header, kCityLocationsSection,
+                     builder.city_locations);
+  add_section(image, header, kCountryBlocksSection, builder.country_blocks);
+  add_locale_section(image, header, kCountryLocationsSection,
+                     builder.country_locations);
+  add_section(image, header, kAsnBlocksSection, builder.asn_blocks);
+  add_locale_section(image, header, kCityGeoSection, builder.city_geo);
+  add_locale_section(image, header, kCountryGeoSection, builder.country_geo);
+  add_section(image, header, kContinentsSection, builder.continents.entries);
+  add_section(image, header, kCountriesSection, builder.countries.entries);
+  add_section(image, header, kSubdivisionsSection,
+              builder.subdivisions.entries);
+  add_section(image, header, kCitiesSection, builder.cities.entries);
+  add_section(image, header, kTimeZonesSection, builder.time_zones.entries);
+  add_section(image, header, kPostalCodesSection,
+              builder.postal_codes.entries);
+  add_section(image, header, kOrganizationsSection,
+              builder.organizations.entries);
+  add_section(image, header, kCoordinatesSection, builder.coordinates);
+  add_section(image, header, kIntegersSection, builder.integers);
+  add_section(image, header, kExactFlagsSection, builder.exact_flags);
+  for (int slot = 0; slot < 2; ++slot) {
+    const JoinedColumns &ranges = builder.ranges[slot];
+    add_section(image, header, range_section(slot), ranges.starts);
+    add_section(image, header, range_section(slot) + 1, ranges.ends);
+    add_section(image, header, range_section(slot) + 2, ranges.rows);
+    add_section(image, header, range_section(slot) + 3, ranges.tree);
+    add_section(image, header, range_section(slot) + 4, ranges.ranks);
+  }
+  for (int table = 0; table < 3; ++table) {
+    for (int slot = 0; slot < 2; ++slot) {
+      const PrefixTrieArrays &trie = builder.tries[table][slot];
+      int trie_id = trie_section(static_cast<BlockTable>(table), slot);
+      add_section(image, header, trie_id, trie.direct);
+      add_section(image, header, trie_id + 1, trie.nodes);
+      add_section(image, header, trie_id + 2, trie.leaves);
+    }
+  }
+  image.resize((image.size() * 8 + kIndexPage - 1) / kIndexPage * kIndexPage / 8,
+               0);
+
+  header.file_size = image.size() * 8;
+  header.checksum = index_checksum(image.data() + kIndexPage / 8,
+                                   image.size() - kIndexPage / 8);
+  header.header_checksum =
+      index_checksum(reinterpret_cast<const uint64_t *>(&header),
+                     offsetof(IndexHeader, header_checksum) / 8);
+  std::memcpy(image.data(), &header, sizeof(header));
+  return image;
+}
+
+template <typename T>
+bool section_table(const char *data, const IndexSection &section,
+                   Table<T> &table) {
+  if (section.size % sizeof(T) != 0) {
+    return false;
+  }
+  table.data = reinterpret_cast<const T *>(data + section.offset);
+  table.count = section.size / sizeof(T);
+  return true;
+}
+
+// Points `index` at an index image. Only the header is checked unless
+// `verify` is set, so attaching a mapped file stays O(1).
+bool attach_index(const char *data, size_t size, bool verify,
+                  MemoryIndex &index, std::string &error) {
+  IndexHeader header;
+  if (size < kIndexPage) {
+    error = "file too small";
+    return false;
+  }
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) != 0) {
+    error = "not a GeoIP index";
+    return false;
+  }
+  if (header.format_version != kIndexFormatVersion ||
+      header.byte_order != kIndexByteOrder) {
+    error = "unsupported index format version or byte order";
+    return false;
+  }
+  if (header.header_checksum !=
+          index_checksum(reinterpret_cast<const uint64_t *>(data),
+                         offsetof(IndexHeader, header_checksum) / 8) ||
+      header.file_size != size || size % 8 != 0 ||
+      header.locale_count > kMaxIndexLocales) {
+    error = "damaged or truncated index";
+    return false;
+  }
+  for (const IndexSection &section : header.sections) {
+    if (section.offset % 8 != 0 || section.offset > size ||
+        section.size > size - section.offset) {
+      error = "damaged index section table";
+      return false;
+    }
+  }
+  if (verify &&
+      header.checksum != index_checksum(reinterpret_cast<const uint64_t *>(
+                                            data + kIndexPage),
+                                        (size - kIndexPage) / 8)) {
+    error = "checksum mismatch";
+    return false;
+  }
+  uint32_t needed = index.prefix_match ? kIndexHasTries : kIndexHasRanges;
+  if (!(header.flags & needed)) {
+    error = index.prefix_match ? "index has no prefix tries"
+                               : "index has no range index";
+    return false;
+  }
+
+  const IndexSection *sections = header.sections;
+  bool ok = section_table(data, sections[kStringsSection], index.strings) &&
+            section_table(data, sections[kCityBlocksSection], index.city_blocks) &&
+            section_table(data, sections[kCountryBlocksSection],
+                          index.country_blocks) &&
+            section_table(data, sections[kAsnBlocksSection], index.asn_blocks);
+  Dictionaries &dictionaries = index.dictionaries;
+  ok = ok &&
+       section_table(data, sections[kContinentsSection],
+                     dictionaries.continents) &&
+       section_table(data, sections[kCountriesSection],
+                     dictionaries.countries) &&
+       section_table(data, sections[kSubdivisionsSection],
+                     dictionaries.subdivisions) &&
+       section_table(data, sections[kCitiesSection], dictionaries.cities) &&
+       section_table(data, sections[kTimeZonesSection],
+                     dictionaries.time_zones) &&
+       section_table(data, sections[kPostalCodesSection],
+                     dictionaries.postal_codes) &&
+       section_table(data, sections[kOrganizationsSection],
+                     dictionaries.organizations) &&
+       section_table(data, sections[kCoordinatesSection], index.coordinates) &&
+       section_table(data, sections[kIntegersSection], index.integers) &&
+       section_table(data, sections[kExactFlagsSection], index.exact_flags);
+  for (int slot = 0; ok && slot < 2; ++slot) {
+    RangeIndex &ranges = index.ranges[slot];
+    ok = section_table(data, sections[range_section(slot)], ranges.starts) &&
+         section_table(data, sections[range_section(slot) + 1], ranges.ends) &&
+         section_table(data, sections[range_section(slot) + 2], ranges.rows) &&
+         section_table(data, sections[range_section(slot) + 3], ranges.tree) &&
+         section_table(data, sections[range_section(slot) + 4], ranges.ranks) &&
+         ranges.starts.size() == ranges.ends.size() &&
+         ranges.starts.size() == ranges.rows.size() &&
+         ranges.tree.size() ==
+             (ranges.starts.empty() ? 0 : ranges.starts.size() + 1) &&
+         ranges.ranks.size() == ranges.tree.size();
+  }
+  for (int table = 0; ok && table < 3; ++table) {
+    for (int slot = 0; ok && slot < 2; ++slot) {
+      int trie_id = trie_section(static_cast<BlockTable>(table), slot);
+      PrefixTrie &trie = index.tries[table][slot];
+      ok = section_table(data, sections[trie_id], trie.direct) &&
+           section_table(data, sections[trie_id + 1], trie.nodes) &&
+           section_table(data, sections[trie_id + 2], trie.leaves);
+    }
+  }
+  Table<CityLocation> city_locations;
+  Table<CountryLocation> country_locations;
+  Table<PoolString> city_geo;
+  Table<PoolString> country_geo;
+  ok = ok &&
+       section_table(data, sections[kCityLocationsSection], city_locations) &&
+       section_table(data, sections[kCountryLocationsSection],
+                     country_locations) &&
+       section_table(data, sections[kCityGeoSection], city_geo) &&
+       section_table(data, sections[kCountryGeoSection], country_geo) &&
+       city_locations.count ==
+           header.city_location_count * header.locale_count &&
+       country_locations.count ==
+           header.country_location_count * header.locale_count &&
+       city_geo.count == city_locations.count &&
+       country_geo.count == country_locations.count;
+  if (!ok) {
+    error = "damaged index section table";
+    return false;
+  }
+
+  index.locales.assign(header.locale_count + 1, LocaleTables());
+  for (uint32_t i = 0; i < header.locale_count; ++i) {
+    LocaleTables &tables = index.locales[i];
+    tables.code.assign(header.locales[i],
+                       strnlen(header.locales[i], kIndexLocaleBytes));
+    tables.slot = i;
+    tables.city_locations = {
+        city_locations.data + i * header.city_location_count,
+        header.city_location_count};
+    tables.country_locations = {
+        country_locations.data + i * header.country_location_count,
+        header.country_location_count};
+    tables.city_geo = {city_geo.data + i * header.city_location_count,
+                       header.city_location_count};
+    tables.country_geo = {
+        country_geo.data + i * header.country_location_count,
+        header.country_location_count};
+  }
+  index.built_at = header.built_at;
+  return true;
+}
+
+bool locale_codes(sqlite3 *db, std::vector<std::string> &locales) {
+  return for_each_row(
+      db, kLocalesSql, nullptr, [&](sqlite3_stmt *stmt) {
+        locales.push_back(*column_text(stmt, 0));
+      });
+}
+
+// Whether an index of `table` that covers every row starts with `columns`.
+bool has_index(sqlite3 *db, const char *table,
+               const std::vector<std::string> &columns) {
+  const char *sql = "SELECT il.name, ii.name FROM pragma_index_list(?1) il "
+                    "JOIN pragma_index_info(il.name) ii "
+                    "WHERE il.partial = 0 ORDER BY il.name, ii.seqno";
+  sqlite3_stmt *stmt = nullptr;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    return false;
+  }
+  sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+  std::unordered_map<std::string, std::vector<std::string>> indexes;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    indexes[*column_text(stmt, 0)].push_back(*column_text(stmt, 1));
+  }
+  sqlite3_finalize(stmt);
+  for (const auto &[name, indexed] : indexes) {
+    if (indexed.size() >= columns.size() &&
+        std::equal(columns.begin(), columns.end(), indexed.begin())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Fails on the first two blocks of one ip_version whose ranges share a key,
+// or a block that ends before it starts.
+bool check_disjoint(sqlite3 *db, const char *table, size_t &blocks,
+                    std::string &error) {
+  std::string sql = std::string("SELECT network, ip_version, network_start, "
+                                "network_end FROM ") +
+                    table + " ORDER BY ip_version, network_start, network_end";
+  std::string previous;
+  int64_t previous_version = 0;
+  int64_t previous_end = 0;
+  bool ok = for_each_row(db, sql.c_str(), nullptr, [&](sqlite3_stmt *stmt) {
+    if (!error.empty()) {
+      return;
+    }
+    std::string network = column_text(stmt, 0).value_or("");
+    int64_t ip_version = sqlite3_column_int64(stmt, 1);
+    int64_t start = sqlite3_column_int64(stmt, 2);
+    int64_t end = sqlite3_column_int64(stmt, 3);
+    if (end < start) {
+      error = std::string(table) + ": " + network + " ends before it starts";
+    } else if (blocks > 0 && ip_version == previous_version &&
+               start <= previous_end) {
+      error = std::string(table) + ": " + network + " overlaps " + previous;
+    }
+    previous = std::move(network);
+    previous_version = ip_version;
+    previous_end = end;
+    ++blocks;
+  });
+  if (!ok && error.empty()) {
+    error = std::string("Failed to read ") + table + ": " + sqlite3_errmsg(db);
+  }
+  return error.empty();
+}
+
+// Appends the query plan of `sql` to `plan` and fails when a step reads a
+// table or index in full, sorts, or builds an index for the query.
+bool check_plan(sqlite3 *db, const char *name, const char *sql,
+                std::string &plan, std::string &error) {
+  std::string explain = std::string("EXPLAIN QUERY PLAN ") + sql;
+  plan = name;
+  plan += ':';
+  bool ok = for_each_row(db, explain.c_str(), nullptr, [&](sqlite3_stmt *stmt) {
+    std::string detail = column_text(stmt, 3).value_or("");
+    plan += ' ';
+    plan += detail;
+    plan += ';';
+    if (error.empty() && (detail.compare(0, 5, "SCAN ") == 0 ||
+                          detail.find("TEMP B-TREE") != std::string::npos ||
+                          detail.find("AUTOMATIC") != std::string::npos)) {
+      error = std::string(name) + " does not seek: " + detail;
+    }
+  });
+  plan.pop_back();
+  if (!ok && error.empty()) {
+    error = std::string("Failed to plan ") + name + ": " + sqlite3_errmsg(db);
+  }
+  return error.empty();
+}
+
+bool prepare_steps(sqlite3 *db, PreparedDatabase &prepared,
+                   std::string &error) {
+  const std::vector<std::string> range_columns = {"ip_version",
+                                                  "network_start",
+                                                  "network_end"};
+  const std::vector<std::string> locale_columns = {"geoname_id",
+                                                   "locale_code"};
+  const struct {
+    const char *table;
+    const std::vector<std::string> &columns;
+    const char *suffix;
+  } indexes[] = {
+      {"city_blocks", range_columns, "_seek"},
+      {"country_blocks", range_columns, "_seek"},
+      {"asn_blocks", range_columns, "_seek"},
+      {"city_locations", locale_columns, "_locale"},
+      {"country_locations", locale_columns, "_locale"},
+  };
+  for (const auto &index : indexes) {
+    if (has_index(db, index.table, index.columns)) {
+      continue;
+    }
+    std::string name = std::string(index.table) + index.suffix;
+    std::string sql = "CREATE INDEX " + name + " ON " + index.table + "(";
+    for (size_t i = 0; i < index.columns.size(); ++i) {
+      sql += (i > 0 ? ", " : "") + index.columns[i];
+    }
+    sql += ')';
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr) !=
+        SQLITE_OK) {
+      error = "Failed to create " + name + ": " + sqlite3_errmsg(db);
+      return false;
+    }
+    prepared.indexes.push_back(std::move(name));
+  }
+
+  const char *tables[] = {"city_blocks", "country_blocks", "asn_blocks"};
+  for (int table : {kCityTable, kCountryTable, kAsnTable}) {
+    if (!check_disjoint(db, tables[table], prepared.blocks[table], error)) {
+      return false;
+    }
+  }
+  std::string sql =
+      "ANALYZE; DROP TABLE IF EXISTS geoip_prepared; "
+      "CREATE TABLE geoip_prepared(format INTEGER, prepared_at INTEGER); "
+      "INSERT INTO geoip_prepared VALUES(" +
+      std::to_string(kPreparedFormat) + ", " +
+      std::to_string(static_cast<int64_t>(std::time(nullptr))) + ")";
+  if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+    error = std::string("Failed to record the checks: ") + sqlite3_errmsg(db);
+    return false;
+  }
+
+  const struct {
+    const char *name;
+    const char *sql;
+  } statements[] = {
+      {"asn", kAsnSeekSql},
+      {"city", kCitySeekSql},
+      {"city_block", kCityBlockSeekSql},
+      {"country", kCountrySeekSql},
+  };
+  for (const auto &statement : statements) {
+    prepared.plans.emplace_back();
+    if (!check_plan(db, statement.name, statement.sql, prepared.plans.back(),
+                    error)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Adds what the seek statements need to a writable copy of the database,
+// in one transaction: the range and location indexes it lacks, a check
+// that blocks of one ip_version are disjoint, statistics for the planner
+// and the geoip_prepared marker. Fails unless every seek statement then
+// plans as index searches.
+bool prepare_database(sqlite3 *db, PreparedDatabase &prepared,
+                      std::string &error) {
+  if (sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    error = std::string("Failed to begin: ") + sqlite3_errmsg(db);
+    return false;
+  }
+  if (!prepare_steps(db, prepared, error)) {
+    sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+    return false;
+  }
+  if (sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    error = std::string("Failed to commit: ") + sqlite3_errmsg(db);
+    return false;
+  }
+  return true;
+}
+
+// Builds the image for every locale in memory and attaches to it, for the
+// engines that load straight from SQLite.
+bool load_memory_index(sqlite3 *db, MemoryIndex &index, std::string &error) {
+  uint32_t flags = index.prefix_match ? kIndexHasTries : kIndexHasRanges;
+  auto image = std::make_shared<std::vector<uint64_t>>();
+  {
+    IndexBuilder builder;
+    if (!locale_codes(db, builder.locales)) {
+      error = std::string("Failed to read locales: ") + sqlite3_errmsg(db);
+      return false;
+    }
+    if (builder.locales.size() > kMaxIndexLocales) {
+      error = "Too many locales: " + std::to_string(builder.locales.size()) +
+              " (max " + std::to_string(kMaxIndexLocales) + ")";
+      return false;
+    }
+    if (!build_index(db, flags, builder)) {
+      error = std::move(builder.error);
+      return false;
+    }
+    *image = write_index_image(builder, flags);
+  }
+  if (!attach_index(reinterpret_cast<const char *>(image->data()),
+                    image->size() * 8, false, index, error)) {
+    return false;
+  }
+  index.storage = image;
+  return true;
+}
+
+// Maps a compiled index read-only. Pages are shared with every other
+// process that maps the same file.
+bool map_index(const std::string &path, bool verify, MemoryIndex &index,
+               std::string &error) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    error = std::strerror(errno);
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    error = "cannot stat index";
+    close(fd);
+    return false;
+  }
+  size_t size = static_cast<size_t>(info.st_size);
+  void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    error = std::strerror(errno);
+    return false;
+  }
+  std::shared_ptr<const void> mapping(
+      data, [size](const void *ptr) { munmap(const_cast<void *>(ptr), size); });
+  if (!attach_index(static_cast<const char *>(data), size, verify, index,
+                    error)) {
+    return false;
+  }
+  index.storage = std::move(mapping);
+  return true;
+}
+
+bool load_index(const std::string &db_path, const std::string &index_path,
+                MemoryIndex &index, std::string &error) {
+  if (!index_path.empty()) {
+    if (!map_index(index_path, false, index, error)) {
+      error = "Failed to map index " + index_path + ": " + error;
+      return false;
+    }
+    return true;
+  }
+  sqlite3 *db = nullptr;
+  if (!std::filesystem::exists(db_path) ||
+      sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) !=
+          SQLITE_OK) {
+    error = "Failed to open database: " + db_path;
+    sqlite3_close(db);
+    return false;
+  }
+  bool loaded = load_memory_index(db, index, error);
+  sqlite3_close(db);
+  if (!loaded) {
+    error = "Failed to load database into memory: " + error;
+    return false;
+  }
+  return true;
+}
+
+template <typename T>
+size_t table_bytes(const Table<T> &table) {
+  return table.size() * sizeof(T);
+}
+
+// One line per table: rows, bytes per row and total size. Location tables
+// count every locale.
+void log_index_tables(std::ostream &log, const MemoryIndex &index) {
+  struct TableSize {
+    const char *name;
+    size_t rows;
+    size_t row_bytes;
+  };
+  size_t locales = index.locales.size() - 1;
+  size_t city_locations =
+      locales == 0 ? 0 : index.locales[0].city_locations.size() * locales;
+  size_t country_locations =
+      locales == 0 ? 0 : index.locales[0].country_locations.size() * locales;
+  const Dictionaries &dictionaries = index.dictionaries;
+  size_t search_bytes = 0;
+  for (const RangeIndex &ranges : index.ranges) {
+    search_bytes += table_bytes(ranges.starts) + table_bytes(ranges.ends) +
+                    table_bytes(ranges.rows) + table_bytes(ranges.tree) +
+                    table_bytes(ranges.ranks);
+  }
+  for (const auto &tries : index.tries) {
+    for (const PrefixTrie &trie : tries) {
+      search_bytes += table_bytes(trie.direct) + table_bytes(trie.nodes) +
+                      table_bytes(trie.leaves);
+    }
+  }
+  const TableSize tables[] = {
+      {"city blocks", index.city_blocks.size(), sizeof(CityBlock)},
+      {"country blocks", index.country_blocks.size(), sizeof(CountryBlock)},
+      {"ASN blocks", index.asn_blocks.size(), sizeof(AsnBlock)},
+      {"city locations", city_locations,
+       sizeof(CityLocation) + sizeof(PoolString)},
+      {"country locations", country_locations,
+       sizeof(CountryLocation) + sizeof(PoolString)},
+      {"continents", dictionaries.continents.size(), sizeof(NamedCode)},
+      {"countries", dictionaries.countries.size(), sizeof(NamedCode)},
+      {"subdivisions", dictionaries.subdivisions.size(), sizeof(NamedCode)},
+      {"cities", dictionaries.cities.size(), sizeof(CityName)},
+      {"time zones", dictionaries.time_zones.size(), sizeof(PoolString)},
+      {"postal codes", dictionaries.postal_codes.size(), sizeof(PoolString)},
+      {"organizations", dictionaries.organizations.size(), sizeof(PoolString)},
+      {"exact coordinates", index.coordinates.size(), sizeof(double)},
+      {"exact integers", index.integers.size(), sizeof(int64_t)},
+      {"exact flags", index.exact_flags.size(), sizeof(ExactFlag)},
+  };
+  size_t total = index.strings.size() + search_bytes;
+  for (const TableSize &table : tables) {
+    size_t bytes = table.rows * table.row_bytes;
+    total += bytes;
+    log << "  " << std::left << std::setw(18) << table.name << std::right
+        << std::setw(10) << table.rows << " x " << std::setw(2)
+        << table.row_bytes << " B = " << std::setw(8) << bytes / 1024
+        << " KiB" << std::endl;
+  }
+  log << "  " << std::left << std::setw(35) << "string pool" << std::right
+      << " = " << std::setw(8) << index.strings.size() / 1024 << " KiB"
+      << std::endl;
+  log << "  " << std::left << std::setw(35) << "search index" << std::right
+      << " = " << std::setw(8) << search_bytes / 1024 << " KiB" << std::endl;
+  log << "  " << std::left << std::setw(35) << "total" << std::right << " = "
+      << std::setw(8) << total / 1024 << " KiB" << std::endl;
+}
+
+// The tables of `lang` when the index has it, otherwise of `fallback`, and
+// otherwise the empty entry.
+const LocaleTables &find_locale(const MemoryIndex &index, std::string_view lang,
+                                const std::string &fallback) {
+  size_t last = index.locales.size() - 1;
+  for (std::string_view code : {lang, index_locale(fallback)}) {
+    code = code.substr(0, kIndexLocaleBytes - 1);
+    for (size_t i = 0; i < last && !code.empty(); ++i) {
+      if (index.locales[i].code == code) {
+        return index.locales[i];
+      }
+    }
+  }
+  return index.locales[last];
+}
+
+// Finds the blocks of all three tables with one search of the joined
+// ranges. Narrows `span` to the addresses that get the same blocks.
+JoinedRow find_joined(const MemoryIndex &index, const IpAddress &addr,
+                      AddressSpan &span) {
+  int slot = version_slot(addr.version);
+  if (slot < 0) {
+    return {};
+  }
+  uint64_t first = 0;
+  uint64_t last = std::numeric_limits<int64_t>::max();
+  auto key = range_key(addr);
+  if (!key.has_value()) {
+    narrow_span(span, addr, last + 1, ~uint64_t{0});
+    return {};
+  }
+  JoinedRow row = find_range(index.ranges[slot], *key, first, last);
+  narrow_span(span, addr, first, last);
+  return row;
+}
+
+// find_joined for addresses[0..count), which share an ip_version and have
+// a range key, searched together with upper_bounds.
+void find_joined(const MemoryIndex &index, const IpAddress *const *addrs,
+                 size_t count, JoinedRow *rows, AddressSpan *spans) {
+  const RangeIndex &ranges = index.ranges[version_slot(addrs[0]->version)];
+  int64_t keys[kSearchLanes] = {};
+  size_t next[kSearchLanes];
+  for (size_t lane = 0; lane < count; ++lane) {
+    keys[lane] = *range_key(*addrs[lane]);
+  }
+  upper_bounds(ranges, keys, count, next);
+  for (size_t lane = 0; lane < count; ++lane) {
+    uint64_t first = 0;
+    uint64_t last = std::numeric_limits<int64_t>::max();
+    rows[lane] = range_row(ranges, keys[lane], next[lane], first, last);
+    narrow_span(spans[lane], *addrs[lane], first, last);
+  }
+}
+
+// The key of a block's flags; `block` is a row of the index's table.
+uint64_t block_record(const MemoryIndex &index, const CityBlock &block) {
+  return flag_record(kCityBlockFlags, 0, &block - index.city_blocks.data);
+}
+
+uint64_t block_record(const MemoryIndex &index, const CountryBlock &block) {
+  return flag_record(kCountryBlockFlags, 0, &block - index.country_blocks.data);
+}
+
+uint64_t location_record(const LocaleTables &locale, const CityLocation &,
+                         uint32_t location) {
+  return flag_record(kCityLocationFlags, locale.slot, location);
+}
+
+uint64_t location_record(const LocaleTables &locale, const CountryLocation &,
+                         uint32_t location) {
+  return flag_record(kCountryLocationFlags, locale.slot, location);
+}
+
+std::optional<int64_t> stored_asn(const MemoryIndex &index,
+                                  const AsnBlock &block) {
+  if (block.has_number == kExactNumber) {
+    return index.integers[block.autonomous_system_number];
+  }
+  if (block.has_number == kNoNumber) {
+    return std::nullopt;
+  }
+  return block.autonomous_system_number;
+}
+
+AsnRow asn_row(const MemoryIndex &index, uint32_t pos) {
+  const AsnBlock &block = index.asn_blocks[pos];
+  AsnRow row;
+  row.network = std::string(pool_view(index.strings, block.network));
+  row.prefix_length = block.prefix_length;
+  row.ip_version = block.ip_version;
+  row.autonomous_system_number = stored_asn(index, block);
+  row.autonomous_system_organization = stored_string(
+      index, index.dictionaries.organizations[block.organization]);
+  return row;
+}
+
+CityRow city_row(const MemoryIndex &index, const LocaleTables &locale,
+                 uint32_t pos) {
+  const CityBlock &block = index.city_blocks[pos];
+  CityRow row;
+  row.network = std::string(pool_view(index.strings, block.network));
+  row.prefix_length = block.prefix_length;
+  row.ip_version = block.ip_version;
+  row.geoname_id = stored_int(index, block.geoname_id);
+  row.registered_country_geoname_id =
+      stored_int(index, block.registered_country_geoname_id);
+  row.represented_country_geoname_id =
+      stored_int(index, block.represented_country_geoname_id);
+  uint64_t record = block_record(index, block);
+  row.is_anonymous_proxy =
+      stored_flag(index.exact_flags, record, block.flags, kAnonymousProxyFlag);
+  row.is_satellite_provider = stored_flag(index.exact_flags, record,
+                                          block.flags, kSatelliteProviderFlag);
+  row.is_anycast =
+      stored_flag(index.exact_flags, record, block.flags, kAnycastFlag);
+  row.postal_code = stored_string(
+      index, index.dictionaries.postal_codes[block.postal_code]);
+  row.latitude = stored_coordinate(index, block.latitude);
+  row.longitude = stored_coordinate(index, block.longitude);
+  row.accuracy_radius = stored_int(index, block.accuracy_radius);
+  if (block.location < locale.city_locations.size()) {
+    const CityLocation &loc = locale.city_locations[block.location];
+    copy_location(index.strings, index.dictionaries, index.exact_flags,
+                  location_record(locale, loc, block.location), loc, row);
+  }
+  return row;
+}
+
+CountryRow country_row(const MemoryIndex &index, const LocaleTables &locale,
+                       uint32_t pos) {
+  const CountryBlock &block = index.country_blocks[pos];
+  CountryRow row;
+  row.network = std::string(pool_view(index.strings, block.network));
+  row.prefix_length = block.prefix_length;
+  row.ip_version = block.ip_version;
+  row.geoname_id = stored_int(index, block.geoname_id);
+  row.registered_country_geoname_id =
+      stored_int(index, block.registered_country_geoname_id);
+  row.represented_country_geoname_id =
+      stored_int(index, block.represented_country_geoname_id);
+  uint64_t record = block_record(index, block);
+  row.is_anonymous_proxy =
+      stored_flag(index.exact_flags, record, block.flags, kAnonymousProxyFlag);
+  row.is_satellite_provider = stored_flag(index.exact_flags, record,
+                                          block.flags, kSatelliteProviderFlag);
+  row.is_anycast =
+      stored_flag(index.exact_flags, record, block.flags, kAnycastFlag);
+  if (block.location < locale.country_locations.size()) {
+    const CountryLocation &loc = locale.country_locations[block.location];
+    copy_location(index.strings, index.dictionaries, index.exact_flags,
+                  location_record(locale, loc, block.location), loc, row);
+  }
+  return row;
+}
+
+void append_json_string(std::string &out, const MemoryIndex &index,
+                        PoolString value) {
+  if (value.offset == kNullString) {
+    out += "null";
+    return;
+  }
+  out += '"';
+  append_escaped(out, pool_view(index.strings, value));
+  out += '"';
+}
+
+template <typename Block>
+void append_traits(std::string &out, const MemoryIndex &index,
+                   uint32_t fields, const Block &block) {
+  uint64_t record = block_record(index, block);
+  const Table<ExactFlag> &exact_flags = index.exact_flags;
+  append_traits(out, fields,
+                stored_flag(exact_flags, record, block.flags,
+                            kAnonymousProxyFlag),
+                stored_flag(exact_flags, record, block.flags,
+                            kSatelliteProviderFlag),
+                stored_flag(exact_flags, record, block.flags, kAnycastFlag),
+                stored_int(index, block.geoname_id),
+                stored_int(index, block.registered_country_geoname_id),
+                stored_int(index, block.represented_country_geoname_id));
+}
+
+// The whole "geo" object is copied from its pre-rendered fragment; a part
+// of it is rendered from the location's dictionary entries.
+template <typename Row, typename Location>
+void append_geo(std::string &out, const MemoryIndex &index,
+                const LocaleTables &locale, const Table<PoolString> &fragments,
+                const Table<Location> &locations, uint32_t location,
+                uint32_t fields) {
+  out += ",\"geo\":";
+  if ((fields & kGeoFields) == kGeoFields && location < fragments.size()) {
+    out += pool_view(index.strings, fragments[location]);
+    return;
+  }
+  Row row;
+  if (location < locations.size()) {
+    const Location &loc = locations[location];
+    copy_location(index.strings, index.dictionaries, index.exact_flags,
+                  location_record(locale, loc, location), loc, row);
+  }
+  append_geo(out, row, fields);
+}
+
+// Renders straight from the index: the "geo" object and the ASN members
+// are copied from their pre-rendered fragments.
+void append_location(std::string &out, const MemoryIndex &index,
+                     const LocaleTables &locale, const CityBlock &block,
+                     uint32_t fields) {
+  out += "{\"source\":\"city\"";
+  if (fields & kFieldNetwork) {
+    out += ',';
+    append_network(out, pool_view(index.strings, block.network),
+                   block.prefix_length, block.ip_version);
+  }
+  if (fields & kGeoFields) {
+    append_geo<CityRow>(out, index, locale, locale.city_geo,
+                        locale.city_locations, block.location, fields);
+  }
+  if (fields & kFieldCoordinates) {
+    append_coordinates(out, stored_coordinate(index, block.latitude),
+                       stored_coordinate(index, block.longitude),
+                       stored_int(index, block.accuracy_radius));
+  }
+  if (fields & kFieldPostalCode) {
+    out += ",\"postal_code\":";
+    append_json_string(out, index,
+                       index.dictionaries.postal_codes[block.postal_code]);
+  }
+  append_traits(out, index, fields, block);
+}
+
+void append_location(std::string &out, const MemoryIndex &index,
+                     const LocaleTables &locale, const CountryBlock &block,
+                     uint32_t fields) {
+  out += "{\"source\":\"country\"";
+  if (fields & kFieldNetwork) {
+    out += ',';
+    append_network(out, pool_view(index.strings, block.network),
+                   block.prefix_length, block.ip_version);
+  }
+  if (fields & kGeoFields) {
+    append_geo<CountryRow>(out, index, locale, locale.country_geo,
+                           locale.country_locations, block.location, fields);
+  }
+  if (fields & kFieldCoordinates) {
+    out += kNullCoordinates;
+  }
+  if (fields & kFieldPostalCode) {
+    out += kNullPostalCode;
+  }
+  append_traits(out, index, fields, block);
+}
+
+void append_asn(std::string &out, const MemoryIndex &index,
+                const AsnBlock &block) {
+  out += '{';
+  append_network(out, pool_view(index.strings, block.network),
+                 block.prefix_length, block.ip_version);
+  out += ',';
+  out += pool_view(index.strings, block.rendered);
+  out += '}';
+}
+
+} // namespace geoip::internal
+
+namespace geoip {
+
+using namespace internal;
+
+struct GeoIpDatabase::Impl {
+  MemoryIndex index;
+  std::string locale;
+};
+
+namespace {
+
+std::optional<std::string_view> string_view_of(const MemoryIndex &index,
+                                               PoolString value) {
+  if (value.offset == kNullString) {
+    return std::nullopt;
+  }
+  return pool_view(index.strings, value);
+}
+
+template <typename Block>
+GeoIpNetwork network_of(const MemoryIndex &index, const Block &block) {
+  return {pool_view(index.strings, block.network), block.prefix_length,
+          block.ip_version};
+}
+
+template <typename Block>
+void copy_traits(const MemoryIndex &index, const Block &block,
+                 GeoIpLocation &location) {
+  uint64_t record = block_record(index, block);
+  location.is_anonymous_proxy =
+      stored_flag(index.exact_flags, record, block.flags, kAnonymousProxyFlag);
+  location.is_satellite_provider = stored_flag(
+      index.exact_flags, record, block.flags, kSatelliteProviderFlag);
+  location.is_anycast =
+      stored_flag(index.exact_flags, record, block.flags, kAnycastFlag);
+  location.geoname_id = stored_int(index, block.geoname_id);
+  location.registered_country_geoname_id =
+      stored_int(index, block.registered_country_geoname_id);
+  location.represented_country_geoname_id =
+      stored_int(index, block.represented_country_geoname_id);
+}
+
+// `record` is the key of the location's flags.
+template <typename Location>
+void copy_country(const MemoryIndex &index, const Location &loc,
+                  uint64_t record, GeoIpLocation &location) {
+  const NamedCode &continent = index.dictionaries.continents[loc.continent];
+  const NamedCode &country = index.dictionaries.countries[loc.country];
+  location.continent_code = string_view_of(index, continent.code);
+  location.continent_name = string_view_of(index, continent.name);
+  location.country_iso_code = string_view_of(index, country.code);
+  location.country_name = string_view_of(index, country.name);
+  location.is_in_european_union =
+      stored_flag(index.exact_flags, record, loc.flags, kEuropeanUnionFlag);
+}
+
+GeoIpLocation city_location(const MemoryIndex &index,
+                            const LocaleTables &locale, uint32_t pos) {
+  const CityBlock &block = index.city_blocks[pos];
+  const Dictionaries &dictionaries = index.dictionaries;
+  GeoIpLocation location;
+  location.source = "city";
+  location.network = network_of(index, block);
+  if (block.location < locale.city_locations.size()) {
+    const CityLocation &loc = locale.city_locations[block.location];
+    copy_country(index, loc, location_record(locale, loc, block.location),
+                 location);
+    const NamedCode &subdivision_1 = dictionaries.subdivisions[loc.subdivision_1];
+    const NamedCode &subdivision_2 = dictionaries.subdivisions[loc.subdivision_2];
+    const CityName &city = dictionaries.cities[loc.city];
+    location.subdivision_1_iso_code = string_view_of(index, subdivision_1.code);
+    location.subdivision_1_name = string_view_of(index, subdivision_1.name);
+    location.subdivision_2_iso_code = string_view_of(index, subdivision_2.code);
+    location.subdivision_2_name = string_view_of(index, subdivision_2.name);
+    location.city_name = string_view_of(index, city.name);
+    location.metro_code = string_view_of(index, city.metro_code);
+    location.time_zone =
+        string_view_of(index, dictionaries.time_zones[loc.time_zone]);
+  }
+  location.latitude = stored_coordinate(index, block.latitude);
+  location.longitude = stored_coordinate(index, block.longitude);
+  location.accuracy_radius = stored_int(index, block.accuracy_radius);
+  location.postal_code =
+      string_view_of(index, dictionaries.postal_codes[block.postal_code]);
+  copy_traits(index, block, location);
+  return location;
+}
+
+GeoIpLocation country_location(const MemoryIndex &index,
+                               const LocaleTables &locale, uint32_t pos) {
+  const CountryBlock &block = index.country_blocks[pos];
+  GeoIpLocation location;
+  location.source = "country";
+  location.network = network_of(index, block);
+  if (block.location < locale.country_locations.size()) {
+    const CountryLocation &loc = locale.country_locations[block.location];
+    copy_country(index, loc, location_record(locale, loc, block.location),
+                 location);
+  }
+  copy_traits(index, block, location);
+  return location;
+}
+
+GeoIpAsn asn_of(const MemoryIndex &index, uint32_t pos) {
+  const AsnBlock &block = index.asn_blocks[pos];
+  GeoIpAsn asn;
+  asn.network = network_of(index, block);
+  asn.number = stored_asn(index, block);
+  asn.organization = string_view_of(
+      index, index.dictionaries.organizations[block.organization]);
+  return asn;
+}
+
+void fill_result(const MemoryIndex &index, const LocaleTables &locale,
+                 const JoinedRow &row, GeoIpResult &result) {
+  if (row.asn != kNoRow) {
+    result.asn = asn_of(index, row.asn);
+  }
+  if (row.city != kNoRow) {
+    result.location = city_location(index, locale, row.city);
+  } else if (row.country != kNoRow) {
+    result.location = country_location(index, locale, row.country);
+  }
+  result.status =
+      result.location ? GeoIpStatus::kFound : GeoIpStatus::kNotFound;
+}
+
+// Parses `ip` and answers it unless the blocks have to be searched: false
+// for an invalid or reserved address, whose `result` is complete.
+bool prepare(std::string_view ip, IpAddress &addr, GeoIpResult &result) {
+  result = GeoIpResult();
+  if (!parse_ip(ip, addr)) {
+    return false;
+  }
+  if (const ReservedRange *range = find_reserved(addr)) {
+    result.status = GeoIpStatus::kReserved;
+    result.reserved = GeoIpReserved{range->network, range->name, range->rfc};
+    return false;
+  }
+  return true;
+}
+
+// One search per table with the tries; otherwise one of the joined ranges.
+void lookup_blocks(const MemoryIndex &index, const LocaleTables &locale,
+                   const IpAddress &addr, GeoIpResult &result) {
+  AddressSpan span;
+  JoinedRow row;
+  if (!index.prefix_match) {
+    row = find_joined(index, addr, span);
+  } else if (int slot = version_slot(addr.version); slot >= 0) {
+    row.asn = find_prefix(index, kAsnTable, slot, addr, span);
+    row.city = find_prefix(index, kCityTable, slot, addr, span);
+    if (row.city == kNoRow) {
+      row.country = find_prefix(index, kCountryTable, slot, addr, span);
+    }
+  }
+  fill_result(index, locale, row, result);
+}
+
+} // namespace
+
+GeoIpDatabase::GeoIpDatabase(std::unique_ptr<Impl> impl)
+    : impl_(std::move(impl)) {}
+
+GeoIpDatabase::~GeoIpDatabase() = default;
+
+std::unique_ptr<GeoIpDatabase> GeoIpDatabase::open(const GeoIpOptions &options,
+                                                   std::string &error) {
+  if (options.engine != "memory" && options.engine != "lpm") {
+    error = "Unknown engine: " + options.engine;
+    return nullptr;
+  }
+  if (options.db_path.empty() && options.index_path.empty()) {
+    error = "No database: set db_path or index_path";
+    return nullptr;
+  }
+  auto impl = std::make_unique<Impl>();
+  impl->locale = options.locale;
+  impl->index.prefix_match = options.engine == "lpm";
+  if (!load_index(options.db_path, options.index_path, impl->index, error)) {
+    return nullptr;
+  }
+  return std::unique_ptr<GeoIpDatabase>(new GeoIpDatabase(std::move(impl)));
+}
+
+GeoIpResult GeoIpDatabase::lookup(std::string_view ip,
+                                  std::string_view lang) const {
+  GeoIpResult result;
+  IpAddress addr;
+  if (prepare(ip, addr, result)) {
+    const MemoryIndex &index = impl_->index;
+    lookup_blocks(index, find_locale(index, lang, impl_->locale), addr,
+                  result);
+  }
+  return result;
+}
+
+// Runs of up to kSearchLanes addresses of one ip_version share a walk of
+// the joined ranges, as in POST /lookup.
+void GeoIpDatabase::lookup_batch(const std::vector<std::string_view> &ips,
+                                 std::vector<GeoIpResult> &results,
+                                 std::string_view lang) const {
+  const MemoryIndex &index = impl_->index;
+  const LocaleTables &locale = find_locale(index, lang, impl_->locale);
+  results.resize(ips.size());
+  IpAddress addrs[kSearchLanes];
+  const IpAddress *lanes[kSearchLanes];
+  size_t slots[kSearchLanes];
+  JoinedRow rows[kSearchLanes];
+  AddressSpan spans[kSearchLanes];
+  size_t count = 0;
+  auto flush = [&]() {
+    if (count == 0) {
+      return;
+    }
+    find_joined(index, lanes, count, rows, spans);
+    for (size_t lane = 0; lane < count; ++lane) {
+      fill_result(index, locale, rows[lane], results[slots[lane]]);
+    }
+    count = 0;
+  };
+  for (size_t i = 0; i < ips.size(); ++i) {
+    IpAddress addr;
+    if (!prepare(ips[i], addr, results[i])) {
+      continue;
+    }
+    if (index.prefix_match || !range_key(addr)) {
+      lookup_blocks(index, locale, addr, results[i]);
+      continue;
+    }
+    if (count > 0 && addr.version != addrs[0].version) {
+      flush();
+    }
+    addrs[count] = addr;
+    lanes[count] = &addrs[count];
+    slots[count] = i;
+    spans[count] = AddressSpan();
+    if (++count == kSearchLanes) {
+      flush();
+    }
+  }
+  flush();
+}
+
+std::vector<std::string_view> GeoIpDatabase::locales() const {
+  std::vector<std::string_view> codes;
+  const std::vector<LocaleTables> &locales = impl_->index.locales;
+  for (size_t i = 0; i + 1 < locales.size(); ++i) {
+    codes.push_back(locales[i].code);
+  }
+  return codes;
+}
+
+} // namespace geoip
@@ -0,0 +1,134 @@
+// In-process lookups against the same in-memory index the server answers
+// from, for programs that would otherwise call GET /lookup over HTTP.
+//
+// A GeoIpDatabase is immutable once opened, so any number of threads may
+// look up through one handle without locking. Results do not own their
+// strings: every std::string_view points into the database's storage and
+// stays valid until the handle is destroyed. To pick up new data, open a
+// new handle and destroy the old one once no result of it is in use.
+#ifndef GEOIP_H
+#define GEOIP_H
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace geoip {
+
+struct GeoIpOptions {
+  // SQLite database loaded into memory when the handle is opened. open()
+  // fails when both this and index_path are empty.
+  std::string db_path;
+  // Index written by `geoip compile`, mapped instead of loading db_path.
+  std::string index_path;
+  // "memory" answers like the SQL queries (the longest prefix of the
+  // key's range); "lpm" matches prefixes on the full 128-bit address.
+  std::string engine = "memory";
+  // Locale of the names when a lookup asks for none, or for one the data
+  // lacks.
+  std::string locale = "en";
+};
+
+enum class GeoIpStatus {
+  kFound,
+  // A valid address in no city or country block; `asn` may still be set.
+  kNotFound,
+  // A special-purpose address (private, loopback, documentation, ...),
+  // described by `reserved` instead of the blocks.
+  kReserved,
+  kInvalidAddress,
+};
+
+struct GeoIpNetwork {
+  std::string_view cidr;
+  int prefix_length = 0;
+  int ip_version = 0;
+};
+
+// The members of the "location" object of GET /lookup. An empty optional
+// is a NULL column.
+struct GeoIpLocation {
+  // "city", or "country" when no city block holds the address.
+  std::string_view source;
+  GeoIpNetwork network;
+  std::optional<std::string_view> continent_code;
+  std::optional<std::string_view> continent_name;
+  std::optional<std::string_view> country_iso_code;
+  std::optional<std::string_view> country_name;
+  std::optional<int64_t> is_in_european_union;
+  std::optional<std::string_view> subdivision_1_iso_code;
+  std::optional<std::string_view> subdivision_1_name;
+  std::optional<std::string_view> subdivision_2_iso_code;
+  std::optional<std::string_view> subdivision_2_name;
+  std::optional<std::string_view> city_name;
+  std::optional<std::string_view> metro_code;
+  std::optional<std::string_view> time_zone;
+  std::optional<double> latitude;
+  std::optional<double> longitude;
+  std::optional<int64_t> accuracy_radius;
+  std::optional<std::string_view> postal_code;
+  std::optional<int64_t> is_anonymous_proxy;
+  std::optional<int64_t> is_satellite_provider;
+  std::optional<int64_t> is_anycast;
+  std::optional<int64_t> geoname_id;
+  std::optional<int64_t> registered_country_geoname_id;
+  std::optional<int64_t> represented_country_geoname_id;
+};
+
+struct GeoIpAsn {
+  GeoIpNetwork network;
+  std::optional<int64_t> number;
+  std::optional<std::string_view> organization;
+};
+
+struct GeoIpReserved {
+  std::string_view network;
+  std::string_view name;
+  // The RFC that reserves the range.
+  std::string_view rfc;
+};
+
+struct GeoIpResult {
+  GeoIpStatus status = GeoIpStatus::kInvalidAddress;
+  std::optional<GeoIpLocation> location;
+  std::optional<GeoIpAsn> asn;
+  std::optional<GeoIpReserved> reserved;
+};
+
+class GeoIpDatabase {
+public:
+  // Loads or maps the index; null with `error` set when that fails.
+  static std::unique_ptr<GeoIpDatabase> open(const GeoIpOptions &options,
+                                             std::string &error);
+
+  GeoIpDatabase(const GeoIpDatabase &) = delete;
+  GeoIpDatabase &operator=(const GeoIpDatabase &) = delete;
+  ~GeoIpDatabase();
+
+  // Names are in `lang` when the data has it, otherwise in the locale of
+  // the options.
+  GeoIpResult lookup(std::string_view ip, std::string_view lang = {}) const;
+
+  // results[i] answers ips[i]; `results` is resized and its capacity kept.
+  // Addresses are searched several at a time, so their cache misses
+  // overlap.
+  void lookup_batch(const std::vector<std::string_view> &ips,
+                    std::vector<GeoIpResult> &results,
+                    std::string_view lang = {}) const;
+
+  // Locale codes the data has names in.
+  std::vector<std::string_view> locales() const;
+
+private:
+  struct Impl;
+  explicit GeoIpDatabase(std::unique_ptr<Impl> impl);
+
+  std::unique_ptr<Impl> impl_;
+};
+
+} // namespace geoip
+
+#endif // GEOIP_H
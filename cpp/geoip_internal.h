@@ -0,0 +1,741 @@
+// Internals of the lookup library, shared with the server and the tools in
+// main.cpp: the row types, the address parser, the SQLite queries and the
+// in-memory index with its builder. None of it is a stable interface;
+// programs that embed the lookups use geoip.h.
+#ifndef GEOIP_INTERNAL_H
+#define GEOIP_INTERNAL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <sqlite3.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace geoip::internal {
+
+struct CityRow {
+  std::string network;
+  int64_t prefix_length;
+  int64_t ip_version;
+  std::optional<int64_t> geoname_id;
+  std::optional<int64_t> registered_country_geoname_id;
+  std::optional<int64_t> represented_country_geoname_id;
+  std::optional<int64_t> is_anonymous_proxy;
+  std::optional<int64_t> is_satellite_provider;
+  std::optional<int64_t> is_anycast;
+  std::optional<std::string> postal_code;
+  std::optional<double> latitude;
+  std::optional<double> longitude;
+  std::optional<int64_t> accuracy_radius;
+  std::optional<std::string> continent_code;
+  std::optional<std::string> continent_name;
+  std::optional<std::string> country_iso_code;
+  std::optional<std::string> country_name;
+  std::optional<std::string> subdivision_1_iso_code;
+  std::optional<std::string> subdivision_1_name;
+  std::optional<std::string> subdivision_2_iso_code;
+  std::optional<std::string> subdivision_2_name;
+  std::optional<std::string> city_name;
+  std::optional<std::string> metro_code;
+  std::optional<std::string> time_zone;
+  std::optional<int64_t> is_in_european_union;
+};
+
+struct CountryRow {
+  std::string network;
+  int64_t prefix_length;
+  int64_t ip_version;
+  std::optional<int64_t> geoname_id;
+  std::optional<int64_t> registered_country_geoname_id;
+  std::optional<int64_t> represented_country_geoname_id;
+  std::optional<int64_t> is_anonymous_proxy;
+  std::optional<int64_t> is_satellite_provider;
+  std::optional<int64_t> is_anycast;
+  std::optional<std::string> continent_code;
+  std::optional<std::string> continent_name;
+  std::optional<std::string> country_iso_code;
+  std::optional<std::string> country_name;
+  std::optional<int64_t> is_in_european_union;
+};
+
+struct AsnRow {
+  std::string network;
+  int64_t prefix_length;
+  int64_t ip_version;
+  std::optional<int64_t> autonomous_system_number;
+  std::optional<std::string> autonomous_system_organization;
+};
+
+// Members of the GET /lookup body a fields= projection can select. The
+// geo members keep the order they are rendered in.
+enum Field : uint32_t {
+  kFieldNetwork = 1u << 0,
+  kFieldContinent = 1u << 1,
+  kFieldCountry = 1u << 2,
+  kFieldSubdivision1 = 1u << 3,
+  kFieldSubdivision2 = 1u << 4,
+  kFieldCity = 1u << 5,
+  kFieldTimeZone = 1u << 6,
+  kFieldCoordinates = 1u << 7,
+  kFieldPostalCode = 1u << 8,
+  kFieldTraits = 1u << 9,
+  kFieldGeonameIds = 1u << 10,
+  kFieldAsn = 1u << 11,
+};
+
+constexpr uint32_t kGeoFields = kFieldContinent | kFieldCountry |
+                                kFieldSubdivision1 | kFieldSubdivision2 |
+                                kFieldCity | kFieldTimeZone;
+constexpr uint32_t kLocationFields = kFieldAsn - 1;
+constexpr uint32_t kAllFields = kLocationFields | kFieldAsn;
+
+// JSON is appended to caller-owned buffers that are reused between
+// responses, so rendering into a warm buffer does not allocate.
+void append_escaped(std::string &out, std::string_view input);
+void append_int(std::string &out, int64_t value);
+void append_json_string(std::string &out,
+                        const std::optional<std::string> &value);
+void append_json_number(std::string &out, const std::optional<int64_t> &value);
+void append_json_number(std::string &out, const std::optional<double> &value);
+std::optional<std::string> iso_to_flag(const std::optional<std::string> &iso);
+void append_network(std::string &out, std::string_view cidr,
+                    int64_t prefix_length, int64_t ip_version);
+// The renderers below write only the members `fields` selects.
+void append_geo(std::string &out, const CityRow &row,
+                uint32_t fields = kGeoFields);
+void append_geo(std::string &out, const CountryRow &row,
+                uint32_t fields = kGeoFields);
+void append_location(std::string &out, const CityRow &row,
+                     std::string_view source,
+                     uint32_t fields = kLocationFields);
+void append_location(std::string &out, const CountryRow &row,
+                     std::string_view source,
+                     uint32_t fields = kLocationFields);
+void append_asn(std::string &out, const std::optional<AsnRow> &row);
+
+// A read-only connection and its prepared statements. Each worker thread
+// owns one, so the connection is opened without SQLite's mutexes.
+struct SqliteContext {
+  sqlite3 *db = nullptr;
+  sqlite3_stmt *asn = nullptr;
+  sqlite3_stmt *city = nullptr;
+  sqlite3_stmt *city_block = nullptr;
+  sqlite3_stmt *country = nullptr;
+  // Locales the database holds, read when it is opened.
+  std::vector<std::string> locales;
+  // The locale bound to the city and country statements.
+  std::string bound_locale;
+  // Whether the statements seek the block instead of scanning ranges,
+  // in a database prepared by `geoip prepare-db`.
+  bool seek = false;
+
+  SqliteContext() = default;
+  SqliteContext(const SqliteContext &) = delete;
+  SqliteContext &operator=(const SqliteContext &) = delete;
+  ~SqliteContext() { close_sqlite(); }
+
+  void close_sqlite() {
+    sqlite3_finalize(asn);
+    sqlite3_finalize(city);
+    sqlite3_finalize(city_block);
+    sqlite3_finalize(country);
+    sqlite3_close(db);
+    asn = city = city_block = country = nullptr;
+    db = nullptr;
+    locales.clear();
+    bound_locale.clear();
+    seek = false;
+  }
+};
+
+enum class OpenResult { kOk, kMissing, kFailed };
+
+OpenResult open_sqlite(SqliteContext &context, const std::string &db_path);
+void bind_locale(SqliteContext &context, const std::string &lang,
+                 const std::string &fallback);
+std::optional<AsnRow> lookup_asn(sqlite3_stmt *stmt, int64_t ip_version,
+                                 int64_t ip_key);
+std::optional<CityRow> lookup_city(sqlite3_stmt *stmt, int64_t ip_version,
+                                   int64_t ip_key);
+std::optional<CountryRow> lookup_country(sqlite3_stmt *stmt,
+                                         int64_t ip_version, int64_t ip_key);
+
+using Uint128 = unsigned __int128;
+
+struct IpAddress {
+  int64_t version = 0;
+  // Left-aligned address: IPv4 occupies the top 32 bits.
+  Uint128 bits = 0;
+};
+
+bool parse_ipv4_scalar(const char *text, size_t size, uint32_t &value);
+bool parse_ipv6_scalar(const char *text, size_t size, Uint128 &bits);
+bool parse_ip(std::string_view ip, IpAddress &addr);
+
+// Special-purpose ranges from the IANA IPv4 and IPv6 registries (RFC 6890)
+// that are not globally reachable, plus multicast. Private, loopback and
+// documentation addresses are answered from this table without searching
+// the blocks. More specific entries come first; a globally reachable one
+// carves its addresses out of the range below it, and they are searched.
+struct ReservedRange {
+  int64_t ip_version;
+  Uint128 bits;
+  int prefix_length;
+  const char *network;
+  const char *name;
+  const char *rfc;
+  bool globally_reachable = false;
+};
+
+constexpr Uint128 ipv4_bits(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+  return static_cast<Uint128>(a << 24 | b << 16 | c << 8 | d) << 96;
+}
+
+constexpr Uint128 ipv6_bits(uint64_t high, uint64_t low = 0) {
+  return static_cast<Uint128>(high) << 64 | low;
+}
+
+inline constexpr ReservedRange kReservedRanges[] = {
+    {4, ipv4_bits(0, 0, 0, 0), 8, "0.0.0.0/8", "This network", "RFC 791"},
+    {4, ipv4_bits(10, 0, 0, 0), 8, "10.0.0.0/8", "Private-Use", "RFC 1918"},
+    {4, ipv4_bits(100, 64, 0, 0), 10, "100.64.0.0/10", "Shared Address Space",
+     "RFC 6598"},
+    {4, ipv4_bits(127, 0, 0, 0), 8, "127.0.0.0/8", "Loopback", "RFC 1122"},
+    {4, ipv4_bits(169, 254, 0, 0), 16, "169.254.0.0/16", "Link Local",
+     "RFC 3927"},
+    {4, ipv4_bits(172, 16, 0, 0), 12, "172.16.0.0/12", "Private-Use",
+     "RFC 1918"},
+    {4, ipv4_bits(192, 0, 0, 9), 32, "192.0.0.9/32",
+     "Port Control Protocol Anycast", "RFC 7723", true},
+    {4, ipv4_bits(192, 0, 0, 10), 32, "192.0.0.10/32",
+     "Traversal Using Relays around NAT Anycast", "RFC 8155", true},
+    {4, ipv4_bits(192, 0, 0, 0), 24, "192.0.0.0/24",
+     "IETF Protocol Assignments", "RFC 6890"},
+    {4, ipv4_bits(192, 0, 2, 0), 24, "192.0.2.0/24",
+     "Documentation (TEST-NET-1)", "RFC 5737"},
+    {4, ipv4_bits(192, 88, 99, 0), 24, "192.88.99.0/24",
+     "Deprecated (6to4 Relay Anycast)", "RFC 7526"},
+    {4, ipv4_bits(192, 168, 0, 0), 16, "192.168.0.0/16", "Private-Use",
+     "RFC 1918"},
+    {4, ipv4_bits(198, 18, 0, 0), 15, "198.18.0.0/15", "Benchmarking",
+     "RFC 2544"},
+    {4, ipv4_bits(198, 51, 100, 0), 24, "198.51.100.0/24",
+     "Documentation (TEST-NET-2)", "RFC 5737"},
+    {4, ipv4_bits(203, 0, 113, 0), 24, "203.0.113.0/24",
+     "Documentation (TEST-NET-3)", "RFC 5737"},
+    {4, ipv4_bits(224, 0, 0, 0), 4, "224.0.0.0/4", "Multicast", "RFC 5771"},
+    {4, ipv4_bits(255, 255, 255, 255), 32, "255.255.255.255/32",
+     "Limited Broadcast", "RFC 919"},
+    {4, ipv4_bits(240, 0, 0, 0), 4, "240.0.0.0/4", "Reserved", "RFC 1112"},
+    {6, ipv6_bits(0), 128, "::/128", "Unspecified Address", "RFC 4291"},
+    {6, ipv6_bits(0, 1), 128, "::1/128", "Loopback Address", "RFC 4291"},
+    {6, ipv6_bits(0, 0xffff00000000), 96, "::ffff:0:0/96",
+     "IPv4-mapped Address", "RFC 4291"},
+    {6, ipv6_bits(0x0064ff9b00010000), 48, "64:ff9b:1::/48",
+     "IPv4-IPv6 Translation", "RFC 8215"},
+    {6, ipv6_bits(0x0100000000000000), 64, "100::/64",
+     "Discard-Only Address Block", "RFC 6666"},
+    {6, ipv6_bits(0x2001000100000000, 1), 128, "2001:1::1/128",
+     "Port Control Protocol Anycast", "RFC 7723", true},
+    {6, ipv6_bits(0x2001000100000000, 2), 128, "2001:1::2/128",
+     "Traversal Using Relays around NAT Anycast", "RFC 8155", true},
+    {6, ipv6_bits(0x2001000100000000, 3), 128, "2001:1::3/128",
+     "DNS-SD Service Registration Protocol Anycast", "RFC 9665", true},
+    {6, ipv6_bits(0x2001000200000000), 48, "2001:2::/48", "Benchmarking",
+     "RFC 5180"},
+    {6, ipv6_bits(0x2001000300000000), 32, "2001:3::/32", "AMT", "RFC 7450",
+     true},
+    {6, ipv6_bits(0x2001000401120000), 48, "2001:4:112::/48", "AS112-v6",
+     "RFC 7535", true},
+    {6, ipv6_bits(0x2001002000000000), 28, "2001:20::/28", "ORCHIDv2",
+     "RFC 7343", true},
+    {6, ipv6_bits(0x2001003000000000), 28, "2001:30::/28",
+     "Drone Remote ID Protocol Entity Tags (DETs) Prefix", "RFC 9374", true},
+    {6, ipv6_bits(0x2001000000000000), 23, "2001::/23",
+     "IETF Protocol Assignments", "RFC 2928"},
+    {6, ipv6_bits(0x20010db800000000), 32, "2001:db8::/32", "Documentation",
+     "RFC 3849"},
+    {6, ipv6_bits(0x3fff000000000000), 20, "3fff::/20", "Documentation",
+     "RFC 9637"},
+    {6, ipv6_bits(0x5f00000000000000), 16, "5f00::/16",
+     "Segment Routing (SRv6) SIDs", "RFC 9602"},
+    {6, ipv6_bits(0xfc00000000000000), 7, "fc00::/7", "Unique-Local",
+     "RFC 4193"},
+    {6, ipv6_bits(0xfe80000000000000), 10, "fe80::/10", "Link-Local Unicast",
+     "RFC 4291"},
+    {6, ipv6_bits(0xff00000000000000), 8, "ff00::/8", "Multicast", "RFC 4291"},
+};
+
+const ReservedRange *find_reserved(const IpAddress &addr);
+
+// Key stored in network_start/network_end: the IPv4 address, or the high 64
+// bits of an IPv6 address. Addresses above INT64_MAX cannot be in the tables.
+inline std::optional<int64_t> range_key(const IpAddress &addr) {
+  uint64_t key = addr.version == 4 ? static_cast<uint64_t>(addr.bits >> 96)
+                                   : static_cast<uint64_t>(addr.bits >> 64);
+  if (key > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+    return std::nullopt;
+  }
+  return static_cast<int64_t>(key);
+}
+
+// Addresses that get the same answer as the one looked up, as a closed
+// interval of IpAddress::bits.
+struct AddressSpan {
+  Uint128 first = 0;
+  Uint128 last = ~Uint128{0};
+};
+
+// Narrows `span` to the addresses sharing the first `length` bits of `addr`.
+inline void narrow_span(AddressSpan &span, const IpAddress &addr,
+                        int length) {
+  Uint128 mask = length == 0 ? 0 : (~Uint128{0}) << (128 - length);
+  span.first = std::max(span.first, addr.bits & mask);
+  span.last = std::min(span.last, (addr.bits & mask) | ~mask);
+}
+
+// The in-memory engines read flat, pointer-free tables, so the same bytes can
+// be built from SQLite at startup or mapped from a compiled index file.
+template <typename T>
+struct Table {
+  const T *data = nullptr;
+  size_t count = 0;
+
+  const T *begin() const { return data; }
+  const T *end() const { return data + count; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const T &operator[](size_t i) const { return data[i]; }
+};
+
+constexpr uint32_t kNoLocation = std::numeric_limits<uint32_t>::max();
+constexpr uint32_t kNullString = std::numeric_limits<uint32_t>::max();
+
+// A string in the index string pool; kNullString marks a NULL column.
+struct PoolString {
+  uint32_t offset = kNullString;
+  uint32_t length = 0;
+};
+
+// Dictionary entries. Values that always appear together (a code and its
+// name) share one entry; an entry may hold NULLs like any other value.
+struct NamedCode {
+  PoolString code;
+  PoolString name;
+};
+
+struct CityName {
+  PoolString name;
+  PoolString metro_code;
+};
+
+// Stored records are columns of fixed-width ids into the dictionaries and
+// integers narrowed to the range the data uses. The largest value of an
+// integer type marks a NULL column. Nullable booleans take two bits of a
+// flags byte (0 is NULL, 1 false, 2 true) at the shifts below; any other
+// value is stored as kExactFlag and kept exactly in the exact flag table.
+enum StoredFlag {
+  kEuropeanUnionFlag = 0,
+  kAnonymousProxyFlag = 0,
+  kSatelliteProviderFlag = 2,
+  kAnycastFlag = 4,
+};
+
+constexpr int kExactFlag = 3;
+
+// The tables whose records carry a flags byte.
+enum FlagTable : uint64_t {
+  kCityBlockFlags,
+  kCountryBlockFlags,
+  kCityLocationFlags,
+  kCountryLocationFlags,
+};
+
+// The key of a record's flags byte: its table, the locale of a location
+// table, and its row. A field's key adds its shift.
+inline uint64_t flag_record(FlagTable table, size_t locale, size_t row) {
+  return uint64_t{table} << 56 | uint64_t{locale} << 48 | uint64_t{row} << 8;
+}
+
+// A flag value that is not NULL, 0 or 1. The table is sorted by key.
+struct ExactFlag {
+  uint64_t key;
+  int64_t value;
+};
+
+// Coordinates are stored in units of 1e-4 degrees, the precision of the
+// source data. A value that would not decode to the same double goes to
+// the exact coordinate table, as kExactCoordinate + its position.
+constexpr double kCoordinateScale = 1e4;
+constexpr int32_t kExactCoordinate = 1 << 30;
+constexpr int32_t kNullCoordinate = std::numeric_limits<int32_t>::min();
+
+// Ids and radii are narrowed to the type below. A value outside
+// [0, kExactInt<T>), such as a negative id, goes to the exact integer
+// table, as kExactInt<T> + its position.
+template <typename T>
+constexpr T kExactInt =
+    std::numeric_limits<T>::max() - std::numeric_limits<T>::max() / 4;
+
+struct CityLocation {
+  uint32_t subdivision_1 = 0;
+  uint32_t subdivision_2 = 0;
+  uint32_t city = 0;
+  uint16_t continent = 0;
+  uint16_t country = 0;
+  uint16_t time_zone = 0;
+  uint8_t flags = 0;
+  uint8_t reserved = 0;
+};
+
+struct CityBlock {
+  PoolString network;
+  uint32_t geoname_id = 0;
+  uint32_t registered_country_geoname_id = 0;
+  uint32_t represented_country_geoname_id = 0;
+  uint32_t location = kNoLocation;
+  uint32_t postal_code = 0;
+  int32_t latitude = kNullCoordinate;
+  int32_t longitude = kNullCoordinate;
+  uint16_t accuracy_radius = 0;
+  uint8_t prefix_length = 0;
+  uint8_t ip_version = 0;
+  uint8_t flags = 0;
+  uint8_t reserved[3] = {};
+};
+
+struct CountryLocation {
+  uint16_t continent = 0;
+  uint16_t country = 0;
+  uint8_t flags = 0;
+  uint8_t reserved = 0;
+};
+
+struct CountryBlock {
+  PoolString network;
+  uint32_t geoname_id = 0;
+  uint32_t registered_country_geoname_id = 0;
+  uint32_t represented_country_geoname_id = 0;
+  uint32_t location = kNoLocation;
+  uint8_t prefix_length = 0;
+  uint8_t ip_version = 0;
+  uint8_t flags = 0;
+  uint8_t reserved = 0;
+};
+
+enum AsnNumber : uint8_t { kNoNumber = 0, kNumber = 1, kExactNumber = 2 };
+
+struct AsnBlock {
+  PoolString network;
+  // The "number" and "organization" members, rendered as JSON.
+  PoolString rendered;
+  uint32_t organization = 0;
+  // Any 32-bit value is a valid number, so NULL is a flag. A number
+  // outside 32 bits is the position of its exact integer.
+  uint32_t autonomous_system_number = 0;
+  uint8_t prefix_length = 0;
+  uint8_t ip_version = 0;
+  uint8_t has_number = kNoNumber;
+  uint8_t reserved = 0;
+};
+
+static_assert(sizeof(CityBlock) == 44 && sizeof(CityLocation) == 20 &&
+                  sizeof(CountryBlock) == 28 && sizeof(CountryLocation) == 6 &&
+                  sizeof(AsnBlock) == 28,
+              "stored records have no implicit padding");
+
+constexpr uint32_t kNoRow = std::numeric_limits<uint32_t>::max();
+
+enum BlockTable { kCityTable, kCountryTable, kAsnTable };
+
+// The blocks every key of a range resolves to, one per table. `country` is
+// only set where no city block matches: the fallback is decided when the
+// index is built.
+struct JoinedRow {
+  uint32_t city = kNoRow;
+  uint32_t country = kNoRow;
+  uint32_t asn = kNoRow;
+};
+
+// Disjoint, sorted key ranges for one ip_version, joined over the city,
+// country and ASN tables. Each range points at the blocks the SQL queries
+// would return for any key inside it.
+//
+// Searches run on `tree`, a copy of the starts in Eytzinger (BFS) order:
+// node k has children 2k and 2k + 1, so the top levels share cache lines
+// and the nodes a few levels down are contiguous and can be prefetched.
+// tree[0] is a sentinel below every key; ranks maps a node back to its
+// position in `starts`, and ranks[0] is starts.size().
+struct RangeIndex {
+  Table<int64_t> starts;
+  Table<int64_t> ends;
+  Table<JoinedRow> rows;
+  Table<int64_t> tree;
+  Table<uint32_t> ranks;
+};
+
+// Elementary ranges of a single table, before they are joined.
+struct RangeColumns {
+  std::vector<int64_t> starts;
+  std::vector<int64_t> ends;
+  std::vector<uint32_t> rows;
+};
+
+struct JoinedColumns {
+  std::vector<int64_t> starts;
+  std::vector<int64_t> ends;
+  std::vector<JoinedRow> rows;
+  std::vector<int64_t> tree;
+  std::vector<uint32_t> ranks;
+};
+
+struct RangeEntry {
+  int64_t start;
+  int64_t end;
+  int64_t prefix_length;
+  uint32_t row;
+};
+
+inline int version_slot(int64_t ip_version) {
+  if (ip_version == 4) {
+    return 0;
+  }
+  if (ip_version == 6) {
+    return 1;
+  }
+  return -1;
+}
+
+constexpr size_t kSearchLanes = 16;
+
+constexpr int kDirectBits = 16;
+constexpr int kStride = 6;
+constexpr uint32_t kDirectLeaf = 0x80000000u;
+
+inline uint32_t prefix_chunk(Uint128 bits, int offset, int stride) {
+  return static_cast<uint32_t>((bits << offset) >> (128 - stride));
+}
+
+// Poptrie-style multibit trie: a 2^16 direct-pointing root followed by
+// 6-bit nodes whose children and leaf runs are addressed with popcount.
+// An IPv4 lookup reads at most 3 nodes and an IPv6 lookup at most 19.
+struct PrefixNode {
+  uint64_t vector = 0;
+  uint64_t leafvec = 0;
+  uint32_t base0 = 0;
+  uint32_t base1 = 0;
+};
+
+struct PrefixTrie {
+  Table<uint32_t> direct;
+  Table<PrefixNode> nodes;
+  Table<uint32_t> leaves;
+};
+
+struct PrefixTrieArrays {
+  std::vector<uint32_t> direct;
+  std::vector<PrefixNode> nodes;
+  std::vector<uint32_t> leaves;
+};
+
+struct TriePrefix {
+  Uint128 bits;
+  int length;
+  uint32_t row;
+};
+
+// `depth` receives how many leading bits of `bits` decided the answer.
+inline uint32_t find_prefix(const PrefixTrie &trie, Uint128 bits,
+                            int &depth) {
+  depth = 0;
+  if (trie.direct.empty()) {
+    return kNoRow;
+  }
+  depth = kDirectBits;
+  uint32_t entry = trie.direct[prefix_chunk(bits, 0, kDirectBits)];
+  if (entry & kDirectLeaf) {
+    return trie.leaves[entry & ~kDirectLeaf];
+  }
+  const PrefixNode *node = &trie.nodes[entry];
+  for (int offset = kDirectBits;; offset += kStride) {
+    uint32_t slot = prefix_chunk(bits, offset, kStride);
+    uint64_t upto = slot == 63 ? ~uint64_t{0} : (uint64_t{2} << slot) - 1;
+    depth = std::min(offset + kStride, 128);
+    if (node->vector >> slot & 1) {
+      node = &trie.nodes[node->base1 + __builtin_popcountll(node->vector & upto) - 1];
+      continue;
+    }
+    return trie.leaves[node->base0 + __builtin_popcountll(node->leafvec & upto) - 1];
+  }
+}
+
+// The location tables of one locale, indexed by location id. Their
+// strings live in the shared pool, so a locale only adds what it does not
+// have in common with the others.
+struct LocaleTables {
+  std::string code;
+  // Position in MemoryIndex::locales, for the keys of exact flags.
+  size_t slot = 0;
+  Table<CityLocation> city_locations;
+  Table<CountryLocation> country_locations;
+  // Pre-rendered "geo" objects, indexed like the location tables.
+  Table<PoolString> city_geo;
+  Table<PoolString> country_geo;
+};
+
+// The string dictionaries, shared by every locale.
+struct Dictionaries {
+  Table<NamedCode> continents;
+  Table<NamedCode> countries;
+  Table<NamedCode> subdivisions;
+  Table<CityName> cities;
+  Table<PoolString> time_zones;
+  Table<PoolString> postal_codes;
+  Table<PoolString> organizations;
+};
+
+struct MemoryIndex {
+  Table<char> strings;
+  Dictionaries dictionaries;
+  Table<double> coordinates;
+  Table<int64_t> integers;
+  Table<ExactFlag> exact_flags;
+  Table<CityBlock> city_blocks;
+  Table<CountryBlock> country_blocks;
+  Table<AsnBlock> asn_blocks;
+  // Every locale in the index, then an empty entry that leaves every
+  // location NULL, as the SQL engine does for a locale it lacks.
+  std::vector<LocaleTables> locales;
+  // Ranges answer with SQL semantics; tries match the full 128-bit address.
+  bool prefix_match = false;
+  RangeIndex ranges[2];
+  PrefixTrie tries[3][2];
+  int64_t built_at = 0;
+  // Owns the bytes the tables point into: a heap image or a file mapping.
+  std::shared_ptr<const void> storage;
+};
+
+// Compiled index files; geoip.cpp lays them out.
+constexpr uint32_t kIndexFormatVersion = 7;
+constexpr size_t kMaxIndexLocales = 32;
+
+enum IndexFlags : uint32_t { kIndexHasRanges = 1, kIndexHasTries = 2 };
+
+// A dictionary being collected: entries in id order, and the id of each
+// entry keyed by the pool offsets of its strings.
+template <typename Entry>
+struct DictionaryBuilder {
+  std::vector<Entry> entries;
+  std::unordered_map<uint64_t, uint32_t> ids;
+};
+
+// Tables collected from SQLite before they are laid out as an index image.
+struct IndexBuilder {
+  std::string strings;
+  std::unordered_map<std::string, PoolString> shared_strings;
+  std::vector<std::string> locales;
+  DictionaryBuilder<NamedCode> continents;
+  DictionaryBuilder<NamedCode> countries;
+  DictionaryBuilder<NamedCode> subdivisions;
+  DictionaryBuilder<CityName> cities;
+  DictionaryBuilder<PoolString> time_zones;
+  DictionaryBuilder<PoolString> postal_codes;
+  DictionaryBuilder<PoolString> organizations;
+  std::vector<double> coordinates;
+  std::vector<int64_t> integers;
+  std::vector<ExactFlag> exact_flags;
+  std::vector<CityBlock> city_blocks;
+  std::vector<std::vector<CityLocation>> city_locations;
+  std::vector<CountryBlock> country_blocks;
+  std::vector<std::vector<CountryLocation>> country_locations;
+  std::vector<AsnBlock> asn_blocks;
+  std::vector<std::vector<PoolString>> city_geo;
+  std::vector<std::vector<PoolString>> country_geo;
+  std::vector<RangeEntry> entries[3][2];
+  JoinedColumns ranges[2];
+  PrefixTrieArrays tries[3][2];
+  // Why build_index failed: the first value that does not fit its stored
+  // column, or the query that could not be read.
+  std::string error;
+};
+
+inline std::string_view pool_view(const Table<char> &strings,
+                                  PoolString value) {
+  return std::string_view(strings.data + value.offset, value.length);
+}
+
+bool parse_network(std::string_view network, int64_t prefix_length,
+                   int64_t ip_version, TriePrefix &prefix);
+bool build_index(sqlite3 *db, uint32_t flags, IndexBuilder &builder);
+std::vector<uint64_t> write_index_image(const IndexBuilder &builder,
+                                        uint32_t flags);
+bool attach_index(const char *data, size_t size, bool verify,
+                  MemoryIndex &index, std::string &error);
+bool locale_codes(sqlite3 *db, std::vector<std::string> &locales);
+
+// What `geoip prepare-db` checked and added.
+struct PreparedDatabase {
+  // Blocks found disjoint, by BlockTable.
+  size_t blocks[3] = {};
+  // Indexes created because the database had no equivalent.
+  std::vector<std::string> indexes;
+  // "statement: step; step" per seek statement.
+  std::vector<std::string> plans;
+};
+
+bool prepare_database(sqlite3 *db, PreparedDatabase &prepared,
+                      std::string &error);
+bool load_memory_index(sqlite3 *db, MemoryIndex &index, std::string &error);
+bool map_index(const std::string &path, bool verify, MemoryIndex &index,
+               std::string &error);
+// Maps the compiled index at `index_path` if one is given, otherwise loads
+// the database at `db_path`. index.prefix_match selects the tables built.
+bool load_index(const std::string &db_path, const std::string &index_path,
+                MemoryIndex &index, std::string &error);
+void log_index_tables(std::ostream &log, const MemoryIndex &index);
+
+// Lookups in a loaded index. The blocks are decoded into rows, or rendered
+// straight from the pool.
+const LocaleTables &find_locale(const MemoryIndex &index, std::string_view lang,
+                                const std::string &fallback);
+JoinedRow find_joined(const MemoryIndex &index, const IpAddress &addr,
+                      AddressSpan &span);
+void find_joined(const MemoryIndex &index, const IpAddress *const *addrs,
+                 size_t count, JoinedRow *rows, AddressSpan *spans);
+AsnRow asn_row(const MemoryIndex &index, uint32_t pos);
+CityRow city_row(const MemoryIndex &index, const LocaleTables &locale,
+                 uint32_t pos);
+CountryRow country_row(const MemoryIndex &index, const LocaleTables &locale,
+                       uint32_t pos);
+void append_json_string(std::string &out, const MemoryIndex &index,
+                        PoolString value);
+void append_location(std::string &out, const MemoryIndex &index,
+                     const LocaleTables &locale, const CityBlock &block,
+                     uint32_t fields = kLocationFields);
+void append_location(std::string &out, const MemoryIndex &index,
+                     const LocaleTables &locale, const CountryBlock &block,
+                     uint32_t fields = kLocationFields);
+void append_asn(std::string &out, const MemoryIndex &index,
+                const AsnBlock &block);
+
+// The trie walks are short enough that a call would be a good part of
+// their cost.
+inline uint32_t find_prefix(const MemoryIndex &index, BlockTable table,
+                            int slot, const IpAddress &addr,
+                            AddressSpan &span) {
+  int depth;
+  uint32_t row = find_prefix(index.tries[table][slot], addr.bits, depth);
+  narrow_span(span, addr, depth);
+  return row;
+}
+
+} // namespace geoip::internal
+
+#endif // GEOIP_INTERNAL_H
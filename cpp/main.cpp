@@ -1,690 +1,5812 @@
+#include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
 #include <sqlite3.h>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "geoip_internal.h"
+
+#ifdef __linux__
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+// The io_uring backend issues the raw system calls, so it needs the kernel
+// headers only; it is compiled when they know multishot receive (Linux 6.0).
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define GEOIP_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 namespace {
 
+using namespace geoip::internal;
+
 constexpr const char *kMessage =
     "If you are using this solution, please reference the main project at https://whattimeis.in. This helps us keep the project actively maintained with new blocks and updates.";
 
-struct CityRow {
-  std::string network;
-  int64_t prefix_length;
-  int64_t ip_version;
-  std::optional<int64_t> geoname_id;
-  std::optional<int64_t> registered_country_geoname_id;
-  std::optional<int64_t> represented_country_geoname_id;
-  std::optional<int64_t> is_anonymous_proxy;
-  std::optional<int64_t> is_satellite_provider;
-  std::optional<int64_t> is_anycast;
-  std::optional<std::string> postal_code;
-  std::optional<double> latitude;
-  std::optional<double> longitude;
-  std::optional<int64_t> accuracy_radius;
-  std::optional<std::string> continent_code;
-  std::optional<std::string> continent_name;
-  std::optional<std::string> country_iso_code;
-  std::optional<std::string> country_name;
-  std::optional<std::string> subdivision_1_iso_code;
-  std::optional<std::string> subdivision_1_name;
-  std::optional<std::string> subdivision_2_iso_code;
-  std::optional<std::string> subdivision_2_name;
-  std::optional<std::string> city_name;
-  std::optional<std::string> metro_code;
-  std::optional<std::string> time_zone;
-  std::optional<int64_t> is_in_european_union;
-};
-
-struct CountryRow {
-  std::string network;
-  int64_t prefix_length;
-  int64_t ip_version;
-  std::optional<int64_t> geoname_id;
-  std::optional<int64_t> registered_country_geoname_id;
-  std::optional<int64_t> represented_country_geoname_id;
-  std::optional<int64_t> is_anonymous_proxy;
-  std::optional<int64_t> is_satellite_provider;
-  std::optional<int64_t> is_anycast;
-  std::optional<std::string> continent_code;
-  std::optional<std::string> continent_name;
-  std::optional<std::string> country_iso_code;
-  std::optional<std::string> country_name;
-  std::optional<int64_t> is_in_european_union;
-};
-
-struct AsnRow {
-  std::string network;
-  int64_t prefix_length;
-  int64_t ip_version;
-  std::optional<int64_t> autonomous_system_number;
-  std::optional<std::string> autonomous_system_organization;
+// `body` points at a literal or at the worker's LookupContext::body, and
+// stays valid until the next request is handled.
+struct Response {
+  int status;
+  std::string_view body;
+  const char *content_type = "application/json; charset=utf-8";
 };
 
-std::string default_db_path() {
-  auto base = std::filesystem::path(__FILE__).parent_path().parent_path();
-  return (base / "config" / "database" / "WhatTimeIsIn-geoip.db").string();
-}
+struct alignas(64) ReaderSlot {
+  std::atomic<uint64_t> epoch{0};
+};
+
+// What is being served, for GET /version.
+struct EngineVersion {
+  std::string engine;
+  std::string source;
+  uint64_t generation = 0;
+  int64_t source_modified = 0;
+  // Zero when the engine reads the database directly.
+  int64_t built_at = 0;
+  int64_t loaded_at = 0;
+};
+
+// One publish: the index (null for the sqlite engine) together with the
+// generation it was published as, so a reader never pairs an index with
+// another publish's generation.
+struct PublishedEngine {
+  std::unique_ptr<MemoryIndex> memory;
+  uint64_t generation = 0;
+};
+
+// Engine data published to the workers. Lookups never lock: a reader
+// records the epoch it starts in and loads `current` once, then clears its
+// slot before it blocks again. A reload swaps `current`, advances the epoch
+// and frees the previous index once no reader is left in an older epoch.
+struct EngineState {
+  std::atomic<const PublishedEngine *> current{nullptr};
+  std::atomic<uint64_t> epoch{1};
+  // Advanced by every publish; SQLite readers reopen their connection.
+  std::atomic<uint64_t> generation{0};
+  std::unique_ptr<ReaderSlot[]> readers;
+  size_t reader_count = 0;
+  // Only touched by the thread that publishes.
+  std::unique_ptr<PublishedEngine> owned;
+  std::mutex version_mutex;
+  EngineVersion version;
+
+  explicit EngineState(size_t readers_needed)
+      : readers(new ReaderSlot[readers_needed]), reader_count(readers_needed) {}
+};
 
-std::optional<int64_t> column_int64(sqlite3_stmt *stmt, int idx) {
-  if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
-    return std::nullopt;
+void publish_engine(EngineState &state, std::unique_ptr<MemoryIndex> memory,
+                    EngineVersion version) {
+  auto published = std::make_unique<PublishedEngine>();
+  published->memory = std::move(memory);
+  published->generation = state.generation.fetch_add(1) + 1;
+  version.generation = published->generation;
+  state.current.store(published.get());
+  uint64_t target = state.epoch.fetch_add(1) + 1;
+  {
+    std::lock_guard<std::mutex> lock(state.version_mutex);
+    state.version = std::move(version);
+  }
+  for (size_t i = 0; i < state.reader_count; ++i) {
+    while (true) {
+      uint64_t epoch = state.readers[i].epoch.load();
+      if (epoch == 0 || epoch >= target) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
   }
-  return sqlite3_column_int64(stmt, idx);
+  state.owned = std::move(published);
 }
 
-std::optional<double> column_double(sqlite3_stmt *stmt, int idx) {
-  if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
-    return std::nullopt;
+// Rendered GET /lookup results of the memory engines, keyed by the /24 or
+// /48 an address falls in and the locale it was rendered in. An entry also
+// records the span its answer holds for, so addresses of a network split
+// between blocks never share a wrong answer; they replace the entry
+// instead. Shards lock independently and evict with CLOCK once they exceed
+// their share of the byte budget.
+constexpr int kCacheIpv4Prefix = 24;
+constexpr int kCacheIpv6Prefix = 48;
+constexpr size_t kCacheShardBits = 6;
+constexpr size_t kCacheEntryOverhead = 64;
+
+struct CacheEntry {
+  uint64_t key = 0;
+  uint64_t generation = 0;
+  AddressSpan span;
+  int status = 0;
+  bool used = false;
+  bool referenced = false;
+  // The body after the "ip" member; empty for a 404.
+  std::string tail;
+};
+
+struct alignas(64) CacheShard {
+  std::mutex mutex;
+  std::unordered_map<uint64_t, uint32_t> slots;
+  std::vector<CacheEntry> entries;
+  std::vector<uint32_t> free;
+  size_t hand = 0;
+  size_t bytes = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+};
+
+struct ResultCache {
+  size_t capacity_bytes;
+  size_t shard_bytes;
+  std::unique_ptr<CacheShard[]> shards;
+
+  explicit ResultCache(size_t capacity)
+      : capacity_bytes(capacity), shard_bytes(capacity >> kCacheShardBits),
+        shards(new CacheShard[size_t{1} << kCacheShardBits]) {}
+};
+
+// `locale` is the position of the locale in MemoryIndex::locales.
+uint64_t cache_key(const IpAddress &addr, size_t locale) {
+  uint64_t key = static_cast<uint64_t>(locale) << 56;
+  if (addr.version == 4) {
+    return key | uint64_t{1} << 63 |
+           static_cast<uint64_t>(addr.bits >> (128 - kCacheIpv4Prefix));
   }
-  return sqlite3_column_double(stmt, idx);
+  return key | static_cast<uint64_t>(addr.bits >> (128 - kCacheIpv6Prefix));
 }
 
-std::optional<std::string> column_text(sqlite3_stmt *stmt, int idx) {
-  if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
-    return std::nullopt;
+CacheShard &cache_shard(ResultCache &cache, uint64_t key) {
+  return cache.shards[(key * 0x9E3779B97F4A7C15ull) >> (64 - kCacheShardBits)];
+}
+
+size_t cache_entry_bytes(const CacheEntry &entry) {
+  return sizeof(CacheEntry) + kCacheEntryOverhead + entry.tail.size();
+}
+
+// Copies the cached answer for `addr` into `status` and `tail`.
+bool cache_find(ResultCache &cache, uint64_t generation, const IpAddress &addr,
+                size_t locale, int &status, std::string &tail) {
+  uint64_t key = cache_key(addr, locale);
+  CacheShard &shard = cache_shard(cache, key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.slots.find(key);
+  if (it == shard.slots.end()) {
+    ++shard.misses;
+    return false;
   }
-  const unsigned char *text = sqlite3_column_text(stmt, idx);
-  return std::string(reinterpret_cast<const char *>(text));
+  CacheEntry &entry = shard.entries[it->second];
+  if (entry.generation != generation || addr.bits < entry.span.first ||
+      addr.bits > entry.span.last) {
+    ++shard.misses;
+    return false;
+  }
+  entry.referenced = true;
+  ++shard.hits;
+  status = entry.status;
+  tail.assign(entry.tail);
+  return true;
 }
 
-std::string json_escape(const std::string &input) {
-  std::ostringstream out;
-  for (unsigned char c : input) {
-    switch (c) {
-    case '\"':
-      out << "\\\"";
-      break;
-    case '\\':
-      out << "\\\\";
-      break;
-    case '\b':
-      out << "\\b";
-      break;
-    case '\f':
-      out << "\\f";
-      break;
-    case '\n':
-      out << "\\n";
-      break;
-    case '\r':
-      out << "\\r";
-      break;
-    case '\t':
-      out << "\\t";
-      break;
-    default:
-      if (c < 0x20) {
-        out << "\\u" << std::hex << std::uppercase << std::setw(4)
-            << std::setfill('0') << static_cast<int>(c) << std::dec
-            << std::nouppercase;
-      } else {
-        out << c;
-      }
+void cache_evict(CacheShard &shard, uint32_t slot) {
+  CacheEntry &entry = shard.entries[slot];
+  shard.slots.erase(entry.key);
+  shard.bytes -= cache_entry_bytes(entry);
+  entry.used = false;
+  std::string().swap(entry.tail);
+  shard.free.push_back(slot);
+}
+
+void cache_store(ResultCache &cache, uint64_t generation, const IpAddress &addr,
+                 size_t locale, const AddressSpan &span, int status,
+                 std::string_view tail) {
+  uint64_t key = cache_key(addr, locale);
+  CacheShard &shard = cache_shard(cache, key);
+  size_t bytes = sizeof(CacheEntry) + kCacheEntryOverhead + tail.size();
+  if (bytes > cache.shard_bytes) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.slots.find(key);
+  if (it != shard.slots.end()) {
+    cache_evict(shard, it->second);
+  }
+  // Every full turn of the hand clears the reference bits it passes, so
+  // the loop ends by the second turn.
+  while (shard.bytes + bytes > cache.shard_bytes) {
+    uint32_t slot = static_cast<uint32_t>(shard.hand);
+    shard.hand = (shard.hand + 1) % shard.entries.size();
+    CacheEntry &entry = shard.entries[slot];
+    if (!entry.used) {
+      continue;
+    }
+    if (entry.referenced) {
+      entry.referenced = false;
+      continue;
     }
+    cache_evict(shard, slot);
+    ++shard.evictions;
+  }
+  uint32_t slot;
+  if (!shard.free.empty()) {
+    slot = shard.free.back();
+    shard.free.pop_back();
+  } else {
+    slot = static_cast<uint32_t>(shard.entries.size());
+    shard.entries.emplace_back();
   }
-  return out.str();
+  CacheEntry &entry = shard.entries[slot];
+  entry.key = key;
+  entry.generation = generation;
+  entry.span = span;
+  entry.status = status;
+  entry.used = true;
+  entry.referenced = false;
+  entry.tail.assign(tail);
+  shard.bytes += bytes;
+  shard.slots.emplace(key, slot);
 }
 
-std::string json_string(const std::optional<std::string> &value) {
-  if (!value.has_value()) {
-    return "null";
+void append_cache_stats(std::string &out, ResultCache *cache) {
+  if (!cache) {
+    out += "{\"enabled\":false}";
+    return;
+  }
+  uint64_t bytes = 0, entries = 0, hits = 0, misses = 0, evictions = 0;
+  for (size_t i = 0; i < (size_t{1} << kCacheShardBits); ++i) {
+    CacheShard &shard = cache->shards[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    bytes += shard.bytes;
+    entries += shard.slots.size();
+    hits += shard.hits;
+    misses += shard.misses;
+    evictions += shard.evictions;
   }
-  return "\"" + json_escape(*value) + "\"";
+  out += "{\"enabled\":true,\"capacity_bytes\":";
+  append_int(out, static_cast<int64_t>(cache->capacity_bytes));
+  out += ",\"bytes\":";
+  append_int(out, static_cast<int64_t>(bytes));
+  out += ",\"entries\":";
+  append_int(out, static_cast<int64_t>(entries));
+  out += ",\"hits\":";
+  append_int(out, static_cast<int64_t>(hits));
+  out += ",\"misses\":";
+  append_int(out, static_cast<int64_t>(misses));
+  out += ",\"evictions\":";
+  append_int(out, static_cast<int64_t>(evictions));
+  out += '}';
 }
 
-std::string json_number(const std::optional<int64_t> &value) {
-  if (!value.has_value()) {
-    return "null";
-  }
-  return std::to_string(*value);
+// Request counters and per-stage latency histograms. Each worker owns one
+// WorkerMetrics and is its only writer, so recording is a relaxed load and
+// store with no locked instruction; a scrape sums all workers.
+enum Stage {
+  // From reading a request to starting on it.
+  kStageQueue,
+  kStageParse,
+  kStageParseIp,
+  kStageAsnLookup,
+  kStageCityLookup,
+  kStageCountryFallback,
+  // The memory engine's single search of the joined ranges.
+  kStageJoinedLookup,
+  kStageSerialize,
+  kStageSend,
+  kStageCount,
+};
+
+constexpr const char *kStageNames[kStageCount] = {
+    "queue",       "parse",     "parse_ip", "asn_lookup", "city_lookup",
+    "country_fallback", "joined_lookup", "serialize", "send"};
+constexpr int kCountedStatuses[] = {200, 202, 400, 403, 404, 405,
+                                    413, 429, 500, 503};
+constexpr size_t kStatusCount = sizeof(kCountedStatuses) / sizeof(int);
+// Why a request or connection was turned away without a lookup.
+enum ShedReason { kShedConnections, kShedDeadline, kShedRate, kShedCount };
+
+constexpr const char *kShedNames[kShedCount] = {"connections", "deadline",
+                                                 "rate"};
+// Bucket i counts durations up to 2^(i + 6) ns: 64 ns to 34 ms, then +Inf.
+constexpr int kLatencyBuckets = 20;
+constexpr int kFirstBucketShift = 6;
+
+struct alignas(64) WorkerMetrics {
+  std::atomic<uint64_t> responses[kStatusCount] = {};
+  std::atomic<uint64_t> buckets[kStageCount][kLatencyBuckets + 1] = {};
+  std::atomic<uint64_t> total_ns[kStageCount] = {};
+  std::atomic<int64_t> connections{0};
+  // System calls made by the network loop: readiness waits, accepts,
+  // reads, writes and closes, or io_uring_enter for the io_uring backend.
+  std::atomic<uint64_t> syscalls{0};
+  std::atomic<uint64_t> shed[kShedCount] = {};
+};
+
+template <typename T>
+void bump(std::atomic<T> &counter, T amount = 1) {
+  counter.store(counter.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
 }
 
-std::string json_number(const std::optional<double> &value) {
-  if (!value.has_value()) {
-    return "null";
+void count_response(WorkerMetrics *metrics, int status) {
+  if (!metrics) {
+    return;
+  }
+  for (size_t i = 0; i < kStatusCount; ++i) {
+    if (kCountedStatuses[i] == status) {
+      bump(metrics->responses[i], uint64_t{1});
+    }
   }
-  std::ostringstream out;
-  out << *value;
-  return out.str();
 }
 
-std::string utf8_from_codepoint(int codepoint) {
-  std::string out;
-  if (codepoint <= 0x7F) {
-    out.push_back(static_cast<char>(codepoint));
-  } else if (codepoint <= 0x7FF) {
-    out.push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
-    out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
-  } else if (codepoint <= 0xFFFF) {
-    out.push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
-    out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
-    out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
-  } else {
-    out.push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
-    out.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
-    out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
-    out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+void count_shed(WorkerMetrics *metrics, ShedReason reason) {
+  if (metrics) {
+    bump(metrics->shed[reason], uint64_t{1});
   }
-  return out;
 }
 
-std::optional<std::string> iso_to_flag(const std::optional<std::string> &iso) {
-  if (!iso.has_value() || iso->size() != 2) {
-    return std::nullopt;
-  }
-  std::string upper = *iso;
-  for (auto &ch : upper) {
-    ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
-  }
-  int code1 = 0x1F1E6 + (upper[0] - 'A');
-  int code2 = 0x1F1E6 + (upper[1] - 'A');
-  return utf8_from_codepoint(code1) + utf8_from_codepoint(code2);
-}
-
-std::string format_location(const CityRow &row, const std::string &source) {
-  std::ostringstream out;
-  auto flag = iso_to_flag(row.country_iso_code);
-  out << "{"
-      << "\"source\":\"" << json_escape(source) << "\","
-      << "\"network\":{"
-      << "\"cidr\":\"" << json_escape(row.network) << "\","
-      << "\"prefix_length\":" << row.prefix_length << ","
-      << "\"ip_version\":" << row.ip_version
-      << "},"
-      << "\"geo\":{"
-      << "\"continent\":{"
-      << "\"code\":" << json_string(row.continent_code) << ","
-      << "\"name\":" << json_string(row.continent_name)
-      << "},"
-      << "\"country\":{"
-      << "\"iso_code\":" << json_string(row.country_iso_code) << ","
-      << "\"name\":" << json_string(row.country_name) << ","
-      << "\"flag_emoji\":" << json_string(flag) << ","
-      << "\"is_in_european_union\":" << json_number(row.is_in_european_union)
-      << "},"
-      << "\"subdivision_1\":{"
-      << "\"iso_code\":" << json_string(row.subdivision_1_iso_code) << ","
-      << "\"name\":" << json_string(row.subdivision_1_name)
-      << "},"
-      << "\"subdivision_2\":{"
-      << "\"iso_code\":" << json_string(row.subdivision_2_iso_code) << ","
-      << "\"name\":" << json_string(row.subdivision_2_name)
-      << "},"
-      << "\"city\":{"
-      << "\"name\":" << json_string(row.city_name) << ","
-      << "\"metro_code\":" << json_string(row.metro_code)
-      << "},"
-      << "\"time_zone\":" << json_string(row.time_zone)
-      << "},"
-      << "\"coordinates\":{"
-      << "\"latitude\":" << json_number(row.latitude) << ","
-      << "\"longitude\":" << json_number(row.longitude) << ","
-      << "\"accuracy_radius\":" << json_number(row.accuracy_radius)
-      << "},"
-      << "\"postal_code\":" << json_string(row.postal_code) << ","
-      << "\"traits\":{"
-      << "\"is_anonymous_proxy\":" << json_number(row.is_anonymous_proxy) << ","
-      << "\"is_satellite_provider\":" << json_number(row.is_satellite_provider) << ","
-      << "\"is_anycast\":" << json_number(row.is_anycast)
-      << "},"
-      << "\"geoname_id\":" << json_number(row.geoname_id) << ","
-      << "\"registered_country_geoname_id\":"
-      << json_number(row.registered_country_geoname_id) << ","
-      << "\"represented_country_geoname_id\":"
-      << json_number(row.represented_country_geoname_id)
-      << "}";
-  return out.str();
-}
-
-std::string format_location(const CountryRow &row, const std::string &source) {
-  std::ostringstream out;
-  auto flag = iso_to_flag(row.country_iso_code);
-  out << "{"
-      << "\"source\":\"" << json_escape(source) << "\","
-      << "\"network\":{"
-      << "\"cidr\":\"" << json_escape(row.network) << "\","
-      << "\"prefix_length\":" << row.prefix_length << ","
-      << "\"ip_version\":" << row.ip_version
-      << "},"
-      << "\"geo\":{"
-      << "\"continent\":{"
-      << "\"code\":" << json_string(row.continent_code) << ","
-      << "\"name\":" << json_string(row.continent_name)
-      << "},"
-      << "\"country\":{"
-      << "\"iso_code\":" << json_string(row.country_iso_code) << ","
-      << "\"name\":" << json_string(row.country_name) << ","
-      << "\"flag_emoji\":" << json_string(flag) << ","
-      << "\"is_in_european_union\":" << json_number(row.is_in_european_union)
-      << "},"
-      << "\"subdivision_1\":{"
-      << "\"iso_code\":null,"
-      << "\"name\":null"
-      << "},"
-      << "\"subdivision_2\":{"
-      << "\"iso_code\":null,"
-      << "\"name\":null"
-      << "},"
-      << "\"city\":{"
-      << "\"name\":null,"
-      << "\"metro_code\":null"
-      << "},"
-      << "\"time_zone\":null"
-      << "},"
-      << "\"coordinates\":{"
-      << "\"latitude\":null,"
-      << "\"longitude\":null,"
-      << "\"accuracy_radius\":null"
-      << "},"
-      << "\"postal_code\":null,"
-      << "\"traits\":{"
-      << "\"is_anonymous_proxy\":" << json_number(row.is_anonymous_proxy) << ","
-      << "\"is_satellite_provider\":" << json_number(row.is_satellite_provider) << ","
-      << "\"is_anycast\":" << json_number(row.is_anycast)
-      << "},"
-      << "\"geoname_id\":" << json_number(row.geoname_id) << ","
-      << "\"registered_country_geoname_id\":"
-      << json_number(row.registered_country_geoname_id) << ","
-      << "\"represented_country_geoname_id\":"
-      << json_number(row.represented_country_geoname_id)
-      << "}";
-  return out.str();
-}
-
-std::string format_asn(const std::optional<AsnRow> &row) {
-  if (!row.has_value()) {
-    return "null";
-  }
-  std::ostringstream out;
-  out << "{"
-      << "\"network\":{"
-      << "\"cidr\":\"" << json_escape(row->network) << "\","
-      << "\"prefix_length\":" << row->prefix_length << ","
-      << "\"ip_version\":" << row->ip_version
-      << "},"
-      << "\"number\":" << json_number(row->autonomous_system_number) << ","
-      << "\"organization\":"
-      << json_string(row->autonomous_system_organization)
-      << "}";
-  return out.str();
-}
-
-std::optional<AsnRow> lookup_asn(sqlite3 *db, int64_t ip_version, int64_t ip_key) {
-  const char *sql =
-      "SELECT network, prefix_length, ip_version, "
-      "autonomous_system_number, autonomous_system_organization "
-      "FROM asn_blocks "
-      "WHERE ip_version = ? AND network_start <= ? AND network_end >= ? "
-      "ORDER BY prefix_length DESC LIMIT 1";
-  sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-    return std::nullopt;
-  }
-  sqlite3_bind_int64(stmt, 1, ip_version);
-  sqlite3_bind_int64(stmt, 2, ip_key);
-  sqlite3_bind_int64(stmt, 3, ip_key);
-  AsnRow row;
-  int rc = sqlite3_step(stmt);
-  if (rc == SQLITE_ROW) {
-    row.network = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-    row.prefix_length = sqlite3_column_int64(stmt, 1);
-    row.ip_version = sqlite3_column_int64(stmt, 2);
-    row.autonomous_system_number = column_int64(stmt, 3);
-    row.autonomous_system_organization = column_text(stmt, 4);
-    sqlite3_finalize(stmt);
-    return row;
+void count_syscalls(WorkerMetrics *metrics, uint64_t count = 1) {
+  if (metrics) {
+    bump(metrics->syscalls, count);
   }
-  sqlite3_finalize(stmt);
-  return std::nullopt;
 }
 
-std::optional<CityRow> lookup_city(sqlite3 *db, int64_t ip_version,
-                                   int64_t ip_key,
-                                   const std::string &locale) {
-  const char *sql =
-      "SELECT b.network, b.prefix_length, b.ip_version, b.geoname_id, "
-      "b.registered_country_geoname_id, b.represented_country_geoname_id, "
-      "b.is_anonymous_proxy, b.is_satellite_provider, b.is_anycast, "
-      "b.postal_code, b.latitude, b.longitude, b.accuracy_radius, "
-      "l.continent_code, l.continent_name, l.country_iso_code, l.country_name, "
-      "l.subdivision_1_iso_code, l.subdivision_1_name, "
-      "l.subdivision_2_iso_code, l.subdivision_2_name, l.city_name, "
-      "l.metro_code, l.time_zone, l.is_in_european_union "
-      "FROM city_blocks b "
-      "LEFT JOIN city_locations l ON l.geoname_id = b.geoname_id "
-      "AND l.locale_code = ? "
-      "WHERE b.ip_version = ? AND b.network_start <= ? AND b.network_end >= ? "
-      "ORDER BY b.prefix_length DESC LIMIT 1";
-  sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-    return std::nullopt;
+void record_stage(WorkerMetrics &metrics, Stage stage, uint64_t ns) {
+  int bucket = 0;
+  if (ns > (uint64_t{1} << kFirstBucketShift)) {
+    bucket = std::min(64 - __builtin_clzll(ns - 1) - kFirstBucketShift,
+                      kLatencyBuckets);
   }
-  sqlite3_bind_text(stmt, 1, locale.c_str(), -1, SQLITE_TRANSIENT);
-  sqlite3_bind_int64(stmt, 2, ip_version);
-  sqlite3_bind_int64(stmt, 3, ip_key);
-  sqlite3_bind_int64(stmt, 4, ip_key);
+  bump(metrics.buckets[stage][bucket], uint64_t{1});
+  bump(metrics.total_ns[stage], ns);
+}
 
-  int rc = sqlite3_step(stmt);
-  if (rc != SQLITE_ROW) {
-    sqlite3_finalize(stmt);
-    return std::nullopt;
-  }
-
-  CityRow row;
-  row.network = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-  row.prefix_length = sqlite3_column_int64(stmt, 1);
-  row.ip_version = sqlite3_column_int64(stmt, 2);
-  row.geoname_id = column_int64(stmt, 3);
-  row.registered_country_geoname_id = column_int64(stmt, 4);
-  row.represented_country_geoname_id = column_int64(stmt, 5);
-  row.is_anonymous_proxy = column_int64(stmt, 6);
-  row.is_satellite_provider = column_int64(stmt, 7);
-  row.is_anycast = column_int64(stmt, 8);
-  row.postal_code = column_text(stmt, 9);
-  row.latitude = column_double(stmt, 10);
-  row.longitude = column_double(stmt, 11);
-  row.accuracy_radius = column_int64(stmt, 12);
-  row.continent_code = column_text(stmt, 13);
-  row.continent_name = column_text(stmt, 14);
-  row.country_iso_code = column_text(stmt, 15);
-  row.country_name = column_text(stmt, 16);
-  row.subdivision_1_iso_code = column_text(stmt, 17);
-  row.subdivision_1_name = column_text(stmt, 18);
-  row.subdivision_2_iso_code = column_text(stmt, 19);
-  row.subdivision_2_name = column_text(stmt, 20);
-  row.city_name = column_text(stmt, 21);
-  row.metro_code = column_text(stmt, 22);
-  row.time_zone = column_text(stmt, 23);
-  row.is_in_european_union = column_int64(stmt, 24);
+struct LookupService {
+  std::string db_path;
+  std::string locale;
+  EngineState *engine = nullptr;
+  // Enables POST /admin/reload for requests bearing this token.
+  std::string admin_token;
+  // Only used with the memory engines.
+  ResultCache *cache = nullptr;
+  // One per worker; unset outside the server.
+  WorkerMetrics *metrics = nullptr;
+  size_t metrics_count = 0;
+  std::vector<int> listeners;
+};
 
-  sqlite3_finalize(stmt);
-  return row;
-}
-
-std::optional<CountryRow> lookup_country(sqlite3 *db, int64_t ip_version,
-                                         int64_t ip_key,
-                                         const std::string &locale) {
-  const char *sql =
-      "SELECT b.network, b.prefix_length, b.ip_version, b.geoname_id, "
-      "b.registered_country_geoname_id, b.represented_country_geoname_id, "
-      "b.is_anonymous_proxy, b.is_satellite_provider, b.is_anycast, "
-      "l.continent_code, l.continent_name, l.country_iso_code, l.country_name, "
-      "l.is_in_european_union "
-      "FROM country_blocks b "
-      "LEFT JOIN country_locations l ON l.geoname_id = b.geoname_id "
-      "AND l.locale_code = ? "
-      "WHERE b.ip_version = ? AND b.network_start <= ? AND b.network_end >= ? "
-      "ORDER BY b.prefix_length DESC LIMIT 1";
-  sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-    return std::nullopt;
-  }
-  sqlite3_bind_text(stmt, 1, locale.c_str(), -1, SQLITE_TRANSIENT);
-  sqlite3_bind_int64(stmt, 2, ip_version);
-  sqlite3_bind_int64(stmt, 3, ip_key);
-  sqlite3_bind_int64(stmt, 4, ip_key);
+// Per-worker lookup state. Nothing in it is shared between threads.
+struct LookupContext {
+  const LookupService &service;
+  size_t reader;
+  SqliteContext sqlite;
+  uint64_t generation = 0;
+  // Set between enter_read and leave_read.
+  const MemoryIndex *memory = nullptr;
+  // Locale requested for the current lookups; empty or unknown selects
+  // LookupService::locale.
+  std::string lang;
+  // Members the current lookups render; tables no member needs are skipped.
+  uint32_t fields = kAllFields;
+  // Response bodies are rendered here; the capacity is kept between them.
+  std::string body;
+  std::string cached;
+  WorkerMetrics *metrics = nullptr;
+  // Start of the stage being timed.
+  std::chrono::steady_clock::time_point lap_start;
 
-  int rc = sqlite3_step(stmt);
-  if (rc != SQLITE_ROW) {
-    sqlite3_finalize(stmt);
-    return std::nullopt;
-  }
-
-  CountryRow row;
-  row.network = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-  row.prefix_length = sqlite3_column_int64(stmt, 1);
-  row.ip_version = sqlite3_column_int64(stmt, 2);
-  row.geoname_id = column_int64(stmt, 3);
-  row.registered_country_geoname_id = column_int64(stmt, 4);
-  row.represented_country_geoname_id = column_int64(stmt, 5);
-  row.is_anonymous_proxy = column_int64(stmt, 6);
-  row.is_satellite_provider = column_int64(stmt, 7);
-  row.is_anycast = column_int64(stmt, 8);
-  row.continent_code = column_text(stmt, 9);
-  row.continent_name = column_text(stmt, 10);
-  row.country_iso_code = column_text(stmt, 11);
-  row.country_name = column_text(stmt, 12);
-  row.is_in_european_union = column_int64(stmt, 13);
+  LookupContext(const LookupService &lookup_service, size_t reader_slot)
+      : service(lookup_service), reader(reader_slot) {}
+};
 
-  sqlite3_finalize(stmt);
-  return row;
+// Starts a read section. Everything looked up inside it stays valid until
+// leave_read, even if a reload publishes a new index meanwhile.
+void enter_read(LookupContext &context) {
+  EngineState &state = *context.service.engine;
+  state.readers[context.reader].epoch.store(state.epoch.load());
+  const PublishedEngine *published = state.current.load();
+  context.memory = published ? published->memory.get() : nullptr;
+  uint64_t generation = published ? published->generation : 0;
+  if (generation != context.generation) {
+    context.sqlite.close_sqlite();
+    context.generation = generation;
+  }
 }
 
-bool parse_ip(const std::string &ip, int64_t &version, int64_t &key) {
-  in_addr ipv4_addr{};
-  if (inet_pton(AF_INET, ip.c_str(), &ipv4_addr) == 1) {
-    version = 4;
-    uint32_t value = ntohl(ipv4_addr.s_addr);
-    key = static_cast<int64_t>(value);
-    return true;
+void start_lap(LookupContext &context) {
+  if (context.metrics) {
+    context.lap_start = std::chrono::steady_clock::now();
   }
+}
 
-  in6_addr ipv6_addr{};
-  if (inet_pton(AF_INET6, ip.c_str(), &ipv6_addr) == 1) {
-    version = 6;
-    const uint8_t *bytes = ipv6_addr.s6_addr;
-    uint64_t high = 0;
-    for (int i = 0; i < 8; ++i) {
-      high = (high << 8) | bytes[i];
-    }
-    if (high > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
-      return false;
-    }
-    key = static_cast<int64_t>(high);
-    return true;
+// Records the time since the previous lap as `stage`.
+void lap(LookupContext &context, Stage stage) {
+  if (!context.metrics) {
+    return;
   }
-  return false;
+  auto now = std::chrono::steady_clock::now();
+  record_stage(*context.metrics, stage,
+               static_cast<uint64_t>(
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       now - context.lap_start)
+                       .count()));
+  context.lap_start = now;
 }
 
-} // namespace
-
-int main() {
-  std::string db_path = std::getenv("GEOIP_DB_PATH")
-                            ? std::getenv("GEOIP_DB_PATH")
-                            : default_db_path();
-  int port = 5022;
-  if (const char *port_env = std::getenv("GEOIP_PORT")) {
-    port = std::atoi(port_env);
+// Records the time since the previous lap as `count` observations of
+// `stage`, each an equal share.
+void lap(LookupContext &context, Stage stage, size_t count) {
+  if (!context.metrics || count == 0) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  uint64_t ns = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now -
+                                                           context.lap_start)
+          .count());
+  for (size_t i = 0; i < count; ++i) {
+    record_stage(*context.metrics, stage, ns / count);
   }
+  context.lap_start = now;
+}
 
-  auto send_response = [](int client_fd, int status,
-                          const std::string &body) {
-    std::string reason = "OK";
-    if (status == 400)
-      reason = "Bad Request";
-    else if (status == 404)
-      reason = "Not Found";
-    else if (status == 405)
-      reason = "Method Not Allowed";
-    else if (status == 500)
-      reason = "Internal Server Error";
-
-    std::ostringstream out;
-    out << "HTTP/1.1 " << status << " " << reason << "\r\n"
-        << "Content-Type: application/json; charset=utf-8\r\n"
-        << "Content-Length: " << body.size() << "\r\n"
-        << "Connection: close\r\n\r\n"
-        << body;
-    std::string response = out.str();
-    send(client_fd, response.c_str(), response.size(), 0);
-  };
+void leave_read(LookupContext &context) {
+  context.memory = nullptr;
+  context.service.engine->readers[context.reader].epoch.store(
+      0, std::memory_order_release);
+}
 
-  std::cout << "GeoIP API running on http://localhost:" << port << std::endl;
-  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
-    std::cerr << "Failed to create socket." << std::endl;
-    return 1;
+// Lookup body encodings, chosen by the Accept header.
+enum class Encoding { kJson, kMsgpack, kCbor, kRecord };
+
+struct HttpRequest {
+  std::string method;
+  std::string target;
+  std::string body;
+  bool http11 = true;
+  bool keep_alive = true;
+  bool expect_continue = false;
+  std::string authorization;
+  Encoding encoding = Encoding::kJson;
+};
+
+constexpr const char *kInvalidIpAddress =
+    "{\"status\":400,\"detail\":\"Invalid IP address\"}";
+
+std::string_view request_path(const HttpRequest &request) {
+  std::string_view target(request.target);
+  return target.substr(0, target.find('?'));
+}
+
+// The value of the first `key=value` pair in the query string of `target`.
+std::string query_value(std::string_view target, std::string_view key) {
+  size_t qpos = target.find('?');
+  if (qpos == std::string_view::npos) {
+    return {};
   }
+  std::string_view query = target.substr(qpos + 1);
+  while (!query.empty()) {
+    size_t end = std::min(query.find('&'), query.size());
+    std::string_view pair = query.substr(0, end);
+    query.remove_prefix(std::min(end + 1, query.size()));
+    size_t pos = pair.find('=');
+    if (pos != std::string_view::npos && pair.substr(0, pos) == key) {
+      return std::string(pair.substr(pos + 1));
+    }
+  }
+  return {};
+}
 
-  int opt = 1;
-  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+struct FieldName {
+  const char *name;
+  uint32_t fields;
+};
 
-  sockaddr_in addr{};
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons(static_cast<uint16_t>(port));
+constexpr FieldName kFieldNames[] = {
+    {"location", kLocationFields},
+    {"network", kFieldNetwork},
+    {"geo", kGeoFields},
+    {"continent", kFieldContinent},
+    {"country", kFieldCountry},
+    {"subdivision_1", kFieldSubdivision1},
+    {"subdivision_2", kFieldSubdivision2},
+    {"city", kFieldCity},
+    {"time_zone", kFieldTimeZone},
+    {"coordinates", kFieldCoordinates},
+    {"postal_code", kFieldPostalCode},
+    {"traits", kFieldTraits},
+    {"geoname_id", kFieldGeonameIds},
+    {"asn", kFieldAsn},
+};
 
-  if (bind(server_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
-    std::cerr << "Failed to bind socket." << std::endl;
-    close(server_fd);
-    return 1;
+// Parses a comma-separated fields= value; an empty one selects everything.
+bool parse_fields(std::string_view value, uint32_t &fields) {
+  if (value.empty()) {
+    fields = kAllFields;
+    return true;
   }
+  fields = 0;
+  while (true) {
+    size_t end = std::min(value.find(','), value.size());
+    std::string_view name = value.substr(0, end);
+    const FieldName *known = std::find_if(
+        std::begin(kFieldNames), std::end(kFieldNames),
+        [&](const FieldName &field) { return name == field.name; });
+    if (known == std::end(kFieldNames)) {
+      return false;
+    }
+    fields |= known->fields;
+    if (end == value.size()) {
+      return true;
+    }
+    value.remove_prefix(end + 1);
+  }
+}
 
-  if (listen(server_fd, 10) < 0) {
-    std::cerr << "Failed to listen on socket." << std::endl;
-    close(server_fd);
-    return 1;
+constexpr const char *kInvalidFields =
+    "{\"status\":400,\"detail\":\"Invalid fields parameter\"}";
+
+constexpr const char *kNotFound =
+    "{\"status\":404,\"detail\":\"IP not found in ranges\"}";
+
+// Rows matched for one address. `error` holds the response body when the
+// database could not be used. The memory engines only record block
+// positions in `index`; load_rows fills the rows when they are needed.
+struct LookupResult {
+  const char *error = nullptr;
+  const MemoryIndex *index = nullptr;
+  const LocaleTables *locale = nullptr;
+  // Without a location member the city and country blocks are still
+  // searched, so a projection never turns a 404 into a 200.
+  uint32_t fields = kAllFields;
+  uint32_t asn_block = kNoRow;
+  uint32_t city_block = kNoRow;
+  uint32_t country_block = kNoRow;
+  // Set instead of any row for an address in a reserved range.
+  const ReservedRange *reserved = nullptr;
+  AddressSpan span;
+  std::optional<AsnRow> asn;
+  std::optional<CityRow> city;
+  std::optional<CountryRow> country;
+
+  bool found() const {
+    return reserved || city.has_value() || country.has_value() ||
+           city_block != kNoRow || country_block != kNoRow;
   }
+};
 
-  while (true) {
-    int client_fd = accept(server_fd, nullptr, nullptr);
-    if (client_fd < 0) {
-      continue;
+LookupResult lookup_rows(LookupContext &context, const IpAddress &addr) {
+  const LookupService &service = context.service;
+  LookupResult result;
+  result.fields = context.fields;
+  if ((result.reserved = find_reserved(addr))) {
+    return result;
+  }
+  bool need_asn = result.fields & kFieldAsn;
+  if (context.memory) {
+    const MemoryIndex &index = *context.memory;
+    result.index = &index;
+    result.locale = &find_locale(index, context.lang, service.locale);
+    if (index.prefix_match) {
+      int slot = version_slot(addr.version);
+      if (slot < 0) {
+        return result;
+      }
+      if (need_asn) {
+        result.asn_block =
+            find_prefix(index, kAsnTable, slot, addr, result.span);
+        lap(context, kStageAsnLookup);
+      }
+      result.city_block =
+          find_prefix(index, kCityTable, slot, addr, result.span);
+      lap(context, kStageCityLookup);
+      if (result.city_block == kNoRow) {
+        result.country_block =
+            find_prefix(index, kCountryTable, slot, addr, result.span);
+        lap(context, kStageCountryFallback);
+      }
+      return result;
     }
-    char buffer[8192];
-    ssize_t received = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-    if (received <= 0) {
-      close(client_fd);
-      continue;
+    JoinedRow rows = find_joined(index, addr, result.span);
+    result.asn_block = rows.asn;
+    result.city_block = rows.city;
+    result.country_block = rows.country;
+    lap(context, kStageJoinedLookup);
+  } else if (auto ip_key = range_key(addr)) {
+    OpenResult opened = open_sqlite(context.sqlite, service.db_path);
+    if (opened == OpenResult::kMissing) {
+      result.error = "{\"status\":500,\"detail\":\"Database file not found\"}";
+      return result;
     }
-    buffer[received] = '\0';
-    std::string request(buffer);
-    auto line_end = request.find("\r\n");
-    if (line_end == std::string::npos) {
-      send_response(client_fd, 400,
-                    "{\"status\":400,\"detail\":\"Invalid request\"}");
-      close(client_fd);
-      continue;
+    if (opened == OpenResult::kFailed) {
+      result.error = "{\"status\":500,\"detail\":\"Database open failed\"}";
+      return result;
     }
-    std::string request_line = request.substr(0, line_end);
-    std::istringstream line_stream(request_line);
-    std::string method;
-    std::string target;
-    line_stream >> method >> target;
+    bind_locale(context.sqlite, context.lang, service.locale);
 
-    std::string path = target;
-    std::string query;
-    auto qpos = target.find('?');
-    if (qpos != std::string::npos) {
-      path = target.substr(0, qpos);
-      query = target.substr(qpos + 1);
+    if (need_asn) {
+      result.asn = lookup_asn(context.sqlite.asn, addr.version, *ip_key);
+      lap(context, kStageAsnLookup);
     }
-
-    if (path != "/lookup") {
-      send_response(client_fd, 404,
-                    "{\"status\":404,\"detail\":\"Route not found\"}");
-      close(client_fd);
-      continue;
+    result.city = lookup_city((result.fields & kGeoFields)
+                                  ? context.sqlite.city
+                                  : context.sqlite.city_block,
+                              addr.version, *ip_key);
+    lap(context, kStageCityLookup);
+    if (!result.city.has_value()) {
+      result.country =
+          lookup_country(context.sqlite.country, addr.version, *ip_key);
+      lap(context, kStageCountryFallback);
     }
+  }
+  return result;
+}
 
-    if (method != "GET") {
-      send_response(client_fd, 405,
-                    "{\"status\":405,\"detail\":\"Method not allowed\"}");
-      close(client_fd);
-      continue;
+// lookup_rows for addrs[i], i in `order`. With the joined ranges, runs of
+// up to kSearchLanes addresses of one ip_version are searched together.
+void lookup_rows(LookupContext &context, const std::vector<IpAddress> &addrs,
+                 const std::vector<size_t> &order,
+                 std::vector<LookupResult> &results) {
+  const MemoryIndex *index = context.memory;
+  if (!index || index->prefix_match) {
+    for (size_t i : order) {
+      start_lap(context);
+      results[i] = lookup_rows(context, addrs[i]);
     }
-
-    std::string ip;
-    std::istringstream qstream(query);
-    std::string pair;
-    while (std::getline(qstream, pair, '&')) {
-      auto pos = pair.find('=');
-      if (pos == std::string::npos) {
-        continue;
-      }
-      auto key = pair.substr(0, pos);
-      auto value = pair.substr(pos + 1);
-      if (key == "ip") {
-        ip = value;
+    return;
+  }
+  start_lap(context);
+  const LocaleTables &locale =
+      find_locale(*index, context.lang, context.service.locale);
+  const IpAddress *lanes[kSearchLanes];
+  JoinedRow rows[kSearchLanes];
+  AddressSpan spans[kSearchLanes];
+  for (size_t pos = 0; pos < order.size();) {
+    size_t count = 0;
+    while (count < kSearchLanes && pos + count < order.size()) {
+      const IpAddress &addr = addrs[order[pos + count]];
+      if (version_slot(addr.version) < 0 || !range_key(addr) ||
+          find_reserved(addr) ||
+          (count > 0 && addr.version != lanes[0]->version)) {
         break;
       }
+      lanes[count] = &addr;
+      spans[count] = AddressSpan();
+      ++count;
     }
-    if (ip.empty()) {
-      send_response(client_fd, 400,
-                    "{\"status\":400,\"detail\":\"Missing ip parameter\"}");
-      close(client_fd);
-      continue;
+    if (count == 0) {
+      const IpAddress &addr = addrs[order[pos]];
+      if (const ReservedRange *range = find_reserved(addr)) {
+        LookupResult &result = results[order[pos]];
+        result = LookupResult();
+        result.fields = context.fields;
+        result.reserved = range;
+        ++pos;
+        continue;
+      }
+      lanes[0] = &addr;
+      spans[0] = AddressSpan();
+      rows[0] = find_joined(*index, addr, spans[0]);
+      count = 1;
+    } else {
+      find_joined(*index, lanes, count, rows, spans);
     }
-
-    int64_t ip_version = 0;
-    int64_t ip_key = 0;
-    if (!parse_ip(ip, ip_version, ip_key)) {
-      send_response(client_fd, 400,
-                    "{\"status\":400,\"detail\":\"Invalid IP address\"}");
-      close(client_fd);
-      continue;
+    for (size_t lane = 0; lane < count; ++lane) {
+      LookupResult &result = results[order[pos + lane]];
+      result = LookupResult();
+      result.index = index;
+      result.locale = &locale;
+      result.fields = context.fields;
+      result.asn_block = rows[lane].asn;
+      result.city_block = rows[lane].city;
+      result.country_block = rows[lane].country;
+      result.span = spans[lane];
     }
+    pos += count;
+  }
+  lap(context, kStageJoinedLookup, order.size());
+}
 
-    if (!std::filesystem::exists(db_path)) {
-      send_response(client_fd, 500,
-                    "{\"status\":500,\"detail\":\"Database file not found\"}");
-      close(client_fd);
-      continue;
+// Loads only the rows the selected members need; the joined ranges find
+// the blocks of every table at once.
+void load_rows(LookupResult &result) {
+  if (!result.index) {
+    return;
+  }
+  if (result.asn_block != kNoRow && (result.fields & kFieldAsn)) {
+    result.asn = asn_row(*result.index, result.asn_block);
+  }
+  if (!(result.fields & kLocationFields)) {
+    return;
+  }
+  if (result.city_block != kNoRow) {
+    result.city = city_row(*result.index, *result.locale, result.city_block);
+  }
+  if (result.country_block != kNoRow) {
+    result.country =
+        country_row(*result.index, *result.locale, result.country_block);
+  }
+}
+
+constexpr const char *kLookupHead = "{\"status\":200,\"ip\":\"";
+
+void append_location(std::string &out, const LookupResult &result) {
+  uint32_t fields = result.fields;
+  if (result.index) {
+    const MemoryIndex &index = *result.index;
+    if (result.city_block != kNoRow) {
+      append_location(out, index, *result.locale,
+                      index.city_blocks[result.city_block], fields);
+    } else {
+      append_location(out, index, *result.locale,
+                      index.country_blocks[result.country_block], fields);
     }
+  } else if (result.city.has_value()) {
+    append_location(out, *result.city, "city", fields);
+  } else {
+    append_location(out, *result.country, "country", fields);
+  }
+}
 
-    sqlite3 *db = nullptr;
-    if (sqlite3_open(db_path.c_str(), &db) != SQLITE_OK) {
-      if (db) {
-        sqlite3_close(db);
-      }
-      send_response(client_fd, 500,
-                    "{\"status\":500,\"detail\":\"Database open failed\"}");
-      close(client_fd);
-      continue;
+void append_asn(std::string &out, const LookupResult &result) {
+  if (!result.index) {
+    append_asn(out, result.asn);
+  } else if (result.asn_block != kNoRow) {
+    append_asn(out, *result.index,
+               result.index->asn_blocks[result.asn_block]);
+  } else {
+    out += "null";
+  }
+}
+
+// A reserved range has no location data; its location names the range.
+void append_reserved_location(std::string &out, const ReservedRange &range,
+                              uint32_t fields) {
+  out += "{\"source\":\"reserved\"";
+  if (fields & kFieldNetwork) {
+    out += ',';
+    append_network(out, range.network, range.prefix_length, range.ip_version);
+  }
+  out += ",\"range\":{\"name\":\"";
+  append_escaped(out, range.name);
+  out += "\",\"rfc\":\"";
+  append_escaped(out, range.rfc);
+  out += "\"}}";
+}
+
+// Everything after the "ip" member, which is all that depends on the result.
+void append_lookup_tail(std::string &out, const IpAddress &addr,
+                        const LookupResult &result) {
+  out += "\",\"ip_version\":";
+  append_int(out, addr.version);
+  if (result.reserved && (result.fields & kLocationFields)) {
+    out += ",\"location\":";
+    append_reserved_location(out, *result.reserved, result.fields);
+  } else if (result.fields & kLocationFields) {
+    out += ",\"location\":";
+    append_location(out, result);
+  }
+  if (result.fields & kFieldAsn) {
+    out += ",\"asn\":";
+    append_asn(out, result);
+  }
+  out += ",\"message\":\"";
+  append_escaped(out, kMessage);
+  out += "\"}";
+}
+
+void append_lookup(std::string &out, std::string_view ip, const IpAddress &addr,
+                   const LookupResult &result) {
+  out += kLookupHead;
+  append_escaped(out, ip);
+  append_lookup_tail(out, addr, result);
+}
+
+// Appends the body GET /lookup returns for `result` and returns its status.
+int append_result(std::string &out, std::string_view ip, const IpAddress &addr,
+                  const LookupResult &result) {
+  if (result.error) {
+    out += result.error;
+    return 500;
+  }
+  if (!result.found()) {
+    out += kNotFound;
+    return 404;
+  }
+  append_lookup(out, ip, addr, result);
+  return 200;
+}
+
+// The body after the "ip" member for each of kReservedRanges, rendered once.
+std::vector<std::string> render_reserved_tails() {
+  std::vector<std::string> tails;
+  for (const ReservedRange &range : kReservedRanges) {
+    IpAddress addr;
+    addr.version = range.ip_version;
+    LookupResult result;
+    result.reserved = &range;
+    append_lookup_tail(tails.emplace_back(), addr, result);
+  }
+  return tails;
+}
+
+const std::vector<std::string> reserved_tails = render_reserved_tails();
+
+// MessagePack and CBOR share JSON's data model and differ only in how each
+// value is framed, so one encoder serves both.
+void append_big_endian(std::string &out, uint64_t value, int bytes) {
+  for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+    out += static_cast<char>(value >> shift);
+  }
+}
+
+void append_little_endian(std::string &out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out += static_cast<char>(value >> (i * 8));
+  }
+}
+
+uint64_t double_bits(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+struct MsgpackWriter {
+  std::string &out;
+
+  void map(size_t size) {
+    if (size < 16) {
+      out += static_cast<char>(0x80 | size);
+    } else {
+      out += '\xde';
+      append_big_endian(out, size, 2);
     }
+  }
+  void string(std::string_view value) {
+    size_t size = value.size();
+    if (size < 32) {
+      out += static_cast<char>(0xa0 | size);
+    } else if (size < 0x100) {
+      out += '\xd9';
+      append_big_endian(out, size, 1);
+    } else if (size < 0x10000) {
+      out += '\xda';
+      append_big_endian(out, size, 2);
+    } else {
+      out += '\xdb';
+      append_big_endian(out, size, 4);
+    }
+    out += value;
+  }
+  void integer(int64_t value) {
+    if (value >= -32 && value < 128) {
+      out += static_cast<char>(value);
+    } else if (value >= 0) {
+      int bytes = value < 0x100 ? 1 : value < 0x10000 ? 2 : value < 0x100000000 ? 4 : 8;
+      out += static_cast<char>(bytes == 1   ? 0xcc
+                               : bytes == 2 ? 0xcd
+                               : bytes == 4 ? 0xce
+                                            : 0xcf);
+      append_big_endian(out, static_cast<uint64_t>(value), bytes);
+    } else {
+      out += '\xd3';
+      append_big_endian(out, static_cast<uint64_t>(value), 8);
+    }
+  }
+  void real(double value) {
+    out += '\xcb';
+    append_big_endian(out, double_bits(value), 8);
+  }
+  void null() { out += '\xc0'; }
+};
 
-    std::string locale = std::getenv("GEOIP_LOCALE") ? std::getenv("GEOIP_LOCALE") : "en";
-    auto asn = lookup_asn(db, ip_version, ip_key);
-    auto city = lookup_city(db, ip_version, ip_key, locale);
-    if (city.has_value()) {
-      std::ostringstream out;
-      out << "{"
-          << "\"status\":200,"
-          << "\"ip\":\"" << json_escape(ip) << "\","
-          << "\"ip_version\":" << ip_version << ","
-          << "\"location\":" << format_location(*city, "city") << ","
-          << "\"asn\":" << format_asn(asn) << ","
-          << "\"message\":\"" << json_escape(kMessage) << "\""
-          << "}";
-      send_response(client_fd, 200, out.str());
-      sqlite3_close(db);
-      close(client_fd);
-      continue;
+struct CborWriter {
+  std::string &out;
+
+  void head(int major, uint64_t value) {
+    char type = static_cast<char>(major << 5);
+    if (value < 24) {
+      out += static_cast<char>(type | value);
+    } else if (value < 0x100) {
+      out += static_cast<char>(type | 24);
+      append_big_endian(out, value, 1);
+    } else if (value < 0x10000) {
+      out += static_cast<char>(type | 25);
+      append_big_endian(out, value, 2);
+    } else if (value < 0x100000000) {
+      out += static_cast<char>(type | 26);
+      append_big_endian(out, value, 4);
+    } else {
+      out += static_cast<char>(type | 27);
+      append_big_endian(out, value, 8);
+    }
+  }
+  void map(size_t size) { head(5, size); }
+  void string(std::string_view value) {
+    head(3, value.size());
+    out += value;
+  }
+  void integer(int64_t value) {
+    if (value >= 0) {
+      head(0, static_cast<uint64_t>(value));
+    } else {
+      head(1, static_cast<uint64_t>(-1 - value));
     }
+  }
+  void real(double value) {
+    out += '\xfb';
+    append_big_endian(out, double_bits(value), 8);
+  }
+  void null() { out += '\xf6'; }
+};
 
-    auto country = lookup_country(db, ip_version, ip_key, locale);
-    if (country.has_value()) {
-      std::ostringstream out;
-      out << "{"
-          << "\"status\":200,"
-          << "\"ip\":\"" << json_escape(ip) << "\","
-          << "\"ip_version\":" << ip_version << ","
-          << "\"location\":" << format_location(*country, "country") << ","
-          << "\"asn\":" << format_asn(asn) << ","
-          << "\"message\":\"" << json_escape(kMessage) << "\""
-          << "}";
-      send_response(client_fd, 200, out.str());
-      sqlite3_close(db);
-      close(client_fd);
-      continue;
+template <typename Writer>
+void encode_value(Writer &writer, const std::optional<std::string> &value) {
+  value.has_value() ? writer.string(*value) : writer.null();
+}
+
+template <typename Writer>
+void encode_value(Writer &writer, const std::optional<int64_t> &value) {
+  value.has_value() ? writer.integer(*value) : writer.null();
+}
+
+template <typename Writer>
+void encode_value(Writer &writer, const std::optional<double> &value) {
+  value.has_value() ? writer.real(*value) : writer.null();
+}
+
+template <typename Writer>
+void encode_network(Writer &writer, std::string_view cidr,
+                    int64_t prefix_length, int64_t ip_version) {
+  writer.string("network");
+  writer.map(3);
+  writer.string("cidr");
+  writer.string(cidr);
+  writer.string("prefix_length");
+  writer.integer(prefix_length);
+  writer.string("ip_version");
+  writer.integer(ip_version);
+}
+
+template <typename Writer>
+void encode_code_name(Writer &writer, const char *member,
+                      const std::optional<std::string> &code,
+                      const char *code_key,
+                      const std::optional<std::string> &name,
+                      const char *name_key) {
+  writer.string(member);
+  writer.map(2);
+  writer.string(code_key);
+  encode_value(writer, code);
+  writer.string(name_key);
+  encode_value(writer, name);
+}
+
+// The "geo" members selected by `fields`, in append_geo's order. A country
+// row has no subdivisions, city or time zone and encodes them as null.
+template <typename Writer, typename Row>
+void encode_geo(Writer &writer, const Row &row, uint32_t fields) {
+  CityRow none;
+  const CityRow *city = &none;
+  if constexpr (std::is_same_v<Row, CityRow>) {
+    city = &row;
+  }
+  writer.string("geo");
+  writer.map(__builtin_popcount(fields & kGeoFields));
+  if (fields & kFieldContinent) {
+    encode_code_name(writer, "continent", row.continent_code, "code",
+                     row.continent_name, "name");
+  }
+  if (fields & kFieldCountry) {
+    writer.string("country");
+    writer.map(4);
+    writer.string("iso_code");
+    encode_value(writer, row.country_iso_code);
+    writer.string("name");
+    encode_value(writer, row.country_name);
+    writer.string("flag_emoji");
+    encode_value(writer, iso_to_flag(row.country_iso_code));
+    writer.string("is_in_european_union");
+    encode_value(writer, row.is_in_european_union);
+  }
+  if (fields & kFieldSubdivision1) {
+    encode_code_name(writer, "subdivision_1", city->subdivision_1_iso_code,
+                     "iso_code", city->subdivision_1_name, "name");
+  }
+  if (fields & kFieldSubdivision2) {
+    encode_code_name(writer, "subdivision_2", city->subdivision_2_iso_code,
+                     "iso_code", city->subdivision_2_name, "name");
+  }
+  if (fields & kFieldCity) {
+    encode_code_name(writer, "city", city->city_name, "name",
+                     city->metro_code, "metro_code");
+  }
+  if (fields & kFieldTimeZone) {
+    writer.string("time_zone");
+    encode_value(writer, city->time_zone);
+  }
+}
+
+template <typename Writer, typename Row>
+void encode_location(Writer &writer, const Row &row, const char *source,
+                     uint32_t fields) {
+  CityRow none;
+  const CityRow *city = &none;
+  if constexpr (std::is_same_v<Row, CityRow>) {
+    city = &row;
+  }
+  size_t members = 1 + ((fields & kFieldNetwork) != 0) +
+                   ((fields & kGeoFields) != 0) +
+                   ((fields & kFieldCoordinates) != 0) +
+                   ((fields & kFieldPostalCode) != 0) +
+                   ((fields & kFieldTraits) != 0) +
+                   ((fields & kFieldGeonameIds) != 0) * 3;
+  writer.string("location");
+  writer.map(members);
+  writer.string("source");
+  writer.string(source);
+  if (fields & kFieldNetwork) {
+    encode_network(writer, row.network, row.prefix_length, row.ip_version);
+  }
+  if (fields & kGeoFields) {
+    encode_geo(writer, row, fields);
+  }
+  if (fields & kFieldCoordinates) {
+    writer.string("coordinates");
+    writer.map(3);
+    writer.string("latitude");
+    encode_value(writer, city->latitude);
+    writer.string("longitude");
+    encode_value(writer, city->longitude);
+    writer.string("accuracy_radius");
+    encode_value(writer, city->accuracy_radius);
+  }
+  if (fields & kFieldPostalCode) {
+    writer.string("postal_code");
+    encode_value(writer, city->postal_code);
+  }
+  if (fields & kFieldTraits) {
+    writer.string("traits");
+    writer.map(3);
+    writer.string("is_anonymous_proxy");
+    encode_value(writer, row.is_anonymous_proxy);
+    writer.string("is_satellite_provider");
+    encode_value(writer, row.is_satellite_provider);
+    writer.string("is_anycast");
+    encode_value(writer, row.is_anycast);
+  }
+  if (fields & kFieldGeonameIds) {
+    writer.string("geoname_id");
+    encode_value(writer, row.geoname_id);
+    writer.string("registered_country_geoname_id");
+    encode_value(writer, row.registered_country_geoname_id);
+    writer.string("represented_country_geoname_id");
+    encode_value(writer, row.represented_country_geoname_id);
+  }
+}
+
+template <typename Writer>
+void encode_reserved_location(Writer &writer, const ReservedRange &range,
+                              uint32_t fields) {
+  writer.string("location");
+  writer.map(2 + ((fields & kFieldNetwork) != 0));
+  writer.string("source");
+  writer.string("reserved");
+  if (fields & kFieldNetwork) {
+    encode_network(writer, range.network, range.prefix_length,
+                   range.ip_version);
+  }
+  writer.string("range");
+  writer.map(2);
+  writer.string("name");
+  writer.string(range.name);
+  writer.string("rfc");
+  writer.string(range.rfc);
+}
+
+// The GET /lookup body as a map; `result` must hold rows (see load_rows).
+template <typename Writer>
+void encode_lookup(Writer &writer, std::string_view ip, const IpAddress &addr,
+                   const LookupResult &result) {
+  uint32_t fields = result.fields;
+  writer.map(4 + ((fields & kLocationFields) != 0) +
+             ((fields & kFieldAsn) != 0));
+  writer.string("status");
+  writer.integer(200);
+  writer.string("ip");
+  writer.string(ip);
+  writer.string("ip_version");
+  writer.integer(addr.version);
+  if (fields & kLocationFields) {
+    if (result.reserved) {
+      encode_reserved_location(writer, *result.reserved, fields);
+    } else if (result.city.has_value()) {
+      encode_location(writer, *result.city, "city", fields);
+    } else {
+      encode_location(writer, *result.country, "country", fields);
+    }
+  }
+  if (fields & kFieldAsn) {
+    writer.string("asn");
+    if (result.asn.has_value()) {
+      const AsnRow &asn = *result.asn;
+      writer.map(3);
+      encode_network(writer, asn.network, asn.prefix_length, asn.ip_version);
+      writer.string("number");
+      encode_value(writer, asn.autonomous_system_number);
+      writer.string("organization");
+      encode_value(writer, asn.autonomous_system_organization);
+    } else {
+      writer.null();
     }
+  }
+  writer.string("message");
+  writer.string(kMessage);
+}
 
-    sqlite3_close(db);
-    send_response(client_fd, 404,
-                  "{\"status\":404,\"detail\":\"IP not found in ranges\"}");
-    close(client_fd);
+// The "detail" of one of the constant JSON error bodies in this file.
+std::string_view error_detail(std::string_view body) {
+  constexpr std::string_view key = "\"detail\":\"";
+  size_t begin = body.find(key);
+  if (begin == std::string_view::npos) {
+    return {};
+  }
+  begin += key.size();
+  return body.substr(begin, body.find('"', begin) - begin);
+}
+
+template <typename Writer>
+void encode_error(Writer &writer, int status, std::string_view body) {
+  writer.map(2);
+  writer.string("status");
+  writer.integer(status);
+  writer.string("detail");
+  writer.string(error_detail(body));
+}
+
+// The fixed-layout record: a 16-byte header, then for a 200 every value
+// slot in RecordSlot order. Integers and doubles take 8 bytes each, and
+// strings a 2-byte offset from the start of the record and a 2-byte length
+// into the string bytes at the end. Null slots have their bit set in the
+// header's null mask. All values are little-endian.
+enum RecordSlot {
+  kRecordLocationPrefixLength,
+  kRecordLocationIpVersion,
+  kRecordIsInEuropeanUnion,
+  kRecordLatitude,
+  kRecordLongitude,
+  kRecordAccuracyRadius,
+  kRecordIsAnonymousProxy,
+  kRecordIsSatelliteProvider,
+  kRecordIsAnycast,
+  kRecordGeonameId,
+  kRecordRegisteredCountryGeonameId,
+  kRecordRepresentedCountryGeonameId,
+  kRecordAsnPrefixLength,
+  kRecordAsnIpVersion,
+  kRecordAsnNumber,
+  kRecordNumberSlots,
+  kRecordIp = kRecordNumberSlots,
+  kRecordLocationCidr,
+  kRecordContinentCode,
+  kRecordContinentName,
+  kRecordCountryIsoCode,
+  kRecordCountryName,
+  kRecordFlagEmoji,
+  kRecordSubdivision1IsoCode,
+  kRecordSubdivision1Name,
+  kRecordSubdivision2IsoCode,
+  kRecordSubdivision2Name,
+  kRecordCityName,
+  kRecordMetroCode,
+  kRecordTimeZone,
+  kRecordPostalCode,
+  kRecordAsnCidr,
+  kRecordAsnOrganization,
+  kRecordSlotCount,
+};
+
+static_assert(kRecordSlotCount <= 32, "record null mask is 32 bits");
+
+constexpr uint16_t kRecordVersion = 1;
+constexpr size_t kRecordHeaderBytes = 16;
+constexpr size_t kRecordStringsOffset =
+    kRecordHeaderBytes + kRecordNumberSlots * 8 +
+    (kRecordSlotCount - kRecordNumberSlots) * 4;
+
+enum RecordSource : uint8_t {
+  kRecordNoLocation,
+  kRecordCity,
+  kRecordCountry,
+  kRecordReserved,
+};
+
+struct RecordBuilder {
+  uint32_t nulls = ~0u >> (32 - kRecordSlotCount);
+  uint64_t numbers[kRecordNumberSlots] = {};
+  std::string_view strings[kRecordSlotCount - kRecordNumberSlots];
+  // Owns the flag, which is derived rather than stored in a row.
+  std::optional<std::string> flag;
+
+  void set(RecordSlot slot, int64_t value) {
+    numbers[slot] = static_cast<uint64_t>(value);
+    nulls &= ~(1u << slot);
+  }
+  void set(RecordSlot slot, std::string_view value) {
+    strings[slot - kRecordNumberSlots] = value;
+    nulls &= ~(1u << slot);
+  }
+  void set(RecordSlot slot, const std::optional<int64_t> &value) {
+    if (value.has_value()) {
+      set(slot, *value);
+    }
+  }
+  void set(RecordSlot slot, const std::optional<double> &value) {
+    if (value.has_value()) {
+      numbers[slot] = double_bits(*value);
+      nulls &= ~(1u << slot);
+    }
+  }
+  void set(RecordSlot slot, const std::optional<std::string> &value) {
+    if (value.has_value()) {
+      set(slot, std::string_view(*value));
+    }
+  }
+};
+
+void append_record_header(std::string &out, size_t size, int status,
+                          int ip_version, RecordSource source, bool has_asn,
+                          uint32_t nulls) {
+  append_little_endian(out, size, 4);
+  append_little_endian(out, kRecordVersion, 2);
+  append_little_endian(out, static_cast<uint64_t>(status), 2);
+  out += static_cast<char>(ip_version);
+  out += static_cast<char>(source);
+  out += static_cast<char>(has_asn);
+  out += '\0';
+  append_little_endian(out, nulls, 4);
+}
+
+// Sets the location slots selected by `fields`.
+template <typename Row>
+void fill_record(RecordBuilder &record, const Row &row, uint32_t fields) {
+  CityRow none;
+  const CityRow *city = &none;
+  if constexpr (std::is_same_v<Row, CityRow>) {
+    city = &row;
+  }
+  auto set = [&](uint32_t field, RecordSlot slot, const auto &value) {
+    if (fields & field) {
+      record.set(slot, value);
+    }
+  };
+  set(kFieldNetwork, kRecordLocationCidr, std::string_view(row.network));
+  set(kFieldNetwork, kRecordLocationPrefixLength, row.prefix_length);
+  set(kFieldNetwork, kRecordLocationIpVersion, row.ip_version);
+  set(kFieldContinent, kRecordContinentCode, row.continent_code);
+  set(kFieldContinent, kRecordContinentName, row.continent_name);
+  set(kFieldCountry, kRecordCountryIsoCode, row.country_iso_code);
+  set(kFieldCountry, kRecordCountryName, row.country_name);
+  record.flag = iso_to_flag(row.country_iso_code);
+  set(kFieldCountry, kRecordFlagEmoji, record.flag);
+  set(kFieldCountry, kRecordIsInEuropeanUnion, row.is_in_european_union);
+  set(kFieldSubdivision1, kRecordSubdivision1IsoCode,
+      city->subdivision_1_iso_code);
+  set(kFieldSubdivision1, kRecordSubdivision1Name, city->subdivision_1_name);
+  set(kFieldSubdivision2, kRecordSubdivision2IsoCode,
+      city->subdivision_2_iso_code);
+  set(kFieldSubdivision2, kRecordSubdivision2Name, city->subdivision_2_name);
+  set(kFieldCity, kRecordCityName, city->city_name);
+  set(kFieldCity, kRecordMetroCode, city->metro_code);
+  set(kFieldTimeZone, kRecordTimeZone, city->time_zone);
+  set(kFieldCoordinates, kRecordLatitude, city->latitude);
+  set(kFieldCoordinates, kRecordLongitude, city->longitude);
+  set(kFieldCoordinates, kRecordAccuracyRadius, city->accuracy_radius);
+  set(kFieldPostalCode, kRecordPostalCode, city->postal_code);
+  set(kFieldTraits, kRecordIsAnonymousProxy, row.is_anonymous_proxy);
+  set(kFieldTraits, kRecordIsSatelliteProvider, row.is_satellite_provider);
+  set(kFieldTraits, kRecordIsAnycast, row.is_anycast);
+  set(kFieldGeonameIds, kRecordGeonameId, row.geoname_id);
+  set(kFieldGeonameIds, kRecordRegisteredCountryGeonameId,
+      row.registered_country_geoname_id);
+  set(kFieldGeonameIds, kRecordRepresentedCountryGeonameId,
+      row.represented_country_geoname_id);
+}
+
+// Slots left out by `fields` are null. The message never changes and is
+// left out.
+void encode_record(std::string &out, std::string_view ip,
+                   const IpAddress &addr, const LookupResult &result) {
+  RecordBuilder record;
+  RecordSource source = kRecordNoLocation;
+  record.set(kRecordIp, ip);
+  if (result.fields & kLocationFields) {
+    if (const ReservedRange *range = result.reserved) {
+      // Only the network; the range name has no slot.
+      source = kRecordReserved;
+      if (result.fields & kFieldNetwork) {
+        record.set(kRecordLocationCidr, std::string_view(range->network));
+        record.set(kRecordLocationPrefixLength, int64_t{range->prefix_length});
+        record.set(kRecordLocationIpVersion, range->ip_version);
+      }
+    } else if (result.city.has_value()) {
+      source = kRecordCity;
+      fill_record(record, *result.city, result.fields);
+    } else {
+      source = kRecordCountry;
+      fill_record(record, *result.country, result.fields);
+    }
+  }
+  bool has_asn = (result.fields & kFieldAsn) && result.asn.has_value();
+  if (has_asn) {
+    const AsnRow &asn = *result.asn;
+    record.set(kRecordAsnCidr, std::string_view(asn.network));
+    record.set(kRecordAsnPrefixLength, asn.prefix_length);
+    record.set(kRecordAsnIpVersion, asn.ip_version);
+    record.set(kRecordAsnNumber, asn.autonomous_system_number);
+    record.set(kRecordAsnOrganization, asn.autonomous_system_organization);
+  }
+
+  size_t size = kRecordStringsOffset;
+  for (std::string_view value : record.strings) {
+    size += value.size();
+  }
+  append_record_header(out, size, 200, addr.version, source, has_asn,
+                       record.nulls);
+  for (uint64_t value : record.numbers) {
+    append_little_endian(out, value, 8);
+  }
+  size_t offset = kRecordStringsOffset;
+  for (std::string_view value : record.strings) {
+    append_little_endian(out, offset, 2);
+    append_little_endian(out, value.size(), 2);
+    offset += value.size();
+  }
+  for (std::string_view value : record.strings) {
+    out += value;
+  }
+}
+
+// Non-200 entries are {status, detail} maps, or a bare record header.
+void encode_error(std::string &out, Encoding encoding, int status,
+                  std::string_view body) {
+  if (encoding == Encoding::kMsgpack) {
+    MsgpackWriter writer{out};
+    encode_error(writer, status, body);
+  } else if (encoding == Encoding::kCbor) {
+    CborWriter writer{out};
+    encode_error(writer, status, body);
+  } else if (encoding == Encoding::kRecord) {
+    append_record_header(out, kRecordHeaderBytes, status, 0,
+                         kRecordNoLocation, false, RecordBuilder().nulls);
+  } else {
+    out += body;
+  }
+}
+
+// Appends `result` in `encoding` and returns its status.
+int encode_result(std::string &out, Encoding encoding, std::string_view ip,
+                  const IpAddress &addr, LookupResult &result) {
+  if (encoding == Encoding::kJson) {
+    return append_result(out, ip, addr, result);
+  }
+  int status = 200;
+  const char *error = nullptr;
+  if (result.error) {
+    status = 500;
+    error = result.error;
+  } else if (!result.found()) {
+    status = 404;
+    error = kNotFound;
+  }
+  if (error) {
+    encode_error(out, encoding, status, error);
+    return status;
+  }
+  load_rows(result);
+  if (encoding == Encoding::kMsgpack) {
+    MsgpackWriter writer{out};
+    encode_lookup(writer, ip, addr, result);
+  } else if (encoding == Encoding::kCbor) {
+    CborWriter writer{out};
+    encode_lookup(writer, ip, addr, result);
+  } else {
+    encode_record(out, ip, addr, result);
+  }
+  return 200;
+}
+
+struct MediaType {
+  const char *name;
+  Encoding encoding;
+};
+
+// The first type of each encoding is what it is sent as.
+constexpr MediaType kMediaTypes[] = {
+    {"application/json", Encoding::kJson},
+    {"application/msgpack", Encoding::kMsgpack},
+    {"application/cbor", Encoding::kCbor},
+    {"application/vnd.geoip.record", Encoding::kRecord},
+    {"application/x-msgpack", Encoding::kMsgpack},
+    {"application/vnd.msgpack", Encoding::kMsgpack},
+    {"application/cbor-seq", Encoding::kCbor},
+    {"application/x-ndjson", Encoding::kJson},
+    {"application/*", Encoding::kJson},
+    {"*/*", Encoding::kJson},
+};
+
+const char *content_type(Encoding encoding) {
+  if (encoding == Encoding::kJson) {
+    return "application/json; charset=utf-8";
+  }
+  for (const MediaType &type : kMediaTypes) {
+    if (type.encoding == encoding) {
+      return type.name;
+    }
+  }
+  return "application/octet-stream";
+}
+
+// Batches stream one entry after another: NDJSON lines, concatenated
+// MessagePack objects or records, or a CBOR sequence (RFC 8742).
+const char *batch_content_type(Encoding encoding) {
+  switch (encoding) {
+  case Encoding::kJson:
+    return "application/x-ndjson";
+  case Encoding::kCbor:
+    return "application/cbor-seq";
+  default:
+    return content_type(encoding);
+  }
+}
+
+// An error body in `encoding`, rendered into `out` unless it is JSON.
+Response encoded_error(std::string &out, Encoding encoding, int status,
+                       std::string_view body) {
+  if (encoding == Encoding::kJson) {
+    return {status, body};
+  }
+  out.clear();
+  encode_error(out, encoding, status, body);
+  return {status, out, content_type(encoding)};
+}
+
+// The body is sent in `encoding`, errors included.
+Response lookup_address(LookupContext &context, const std::string &ip,
+                        const IpAddress &addr,
+                        Encoding encoding = Encoding::kJson) {
+  std::string &out = context.body;
+  out.clear();
+  const ReservedRange *reserved = find_reserved(addr);
+  if (reserved && encoding == Encoding::kJson &&
+      context.fields == kAllFields) {
+    out += kLookupHead;
+    append_escaped(out, ip);
+    out += reserved_tails[reserved - kReservedRanges];
+    return {200, out};
+  }
+  if (encoding != Encoding::kJson) {
+    LookupResult result = lookup_rows(context, addr);
+    int status = encode_result(out, encoding, ip, addr, result);
+    return {status, out, content_type(encoding)};
+  }
+  ResultCache *cache = context.service.cache;
+  // The cache holds full bodies only.
+  if (!cache || !context.memory || context.fields != kAllFields) {
+    int status = append_result(out, ip, addr, lookup_rows(context, addr));
+    return {status, out};
+  }
+
+  const MemoryIndex &index = *context.memory;
+  size_t locale =
+      &find_locale(index, context.lang, context.service.locale) -
+      index.locales.data();
+  int status;
+  if (cache_find(*cache, context.generation, addr, locale, status,
+                 context.cached)) {
+    if (status != 200) {
+      return {status, kNotFound};
+    }
+    out += kLookupHead;
+    append_escaped(out, ip);
+    out += context.cached;
+    return {200, out};
+  }
+  LookupResult result = lookup_rows(context, addr);
+  if (!result.found()) {
+    cache_store(*cache, context.generation, addr, locale, result.span, 404,
+                {});
+    return {404, kNotFound};
+  }
+  out += kLookupHead;
+  append_escaped(out, ip);
+  size_t tail = out.size();
+  append_lookup_tail(out, addr, result);
+  cache_store(*cache, context.generation, addr, locale, result.span, 200,
+              std::string_view(out).substr(tail));
+  return {200, out};
+}
+
+void sort_by_address(std::vector<size_t> &order,
+                     const std::vector<IpAddress> &addrs) {
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (addrs[a].version != addrs[b].version) {
+      return addrs[a].version < addrs[b].version;
+    }
+    return addrs[a].bits < addrs[b].bits;
+  });
+}
+
+std::string format_utc(int64_t seconds) {
+  std::time_t time = static_cast<std::time_t>(seconds);
+  std::tm parts{};
+  gmtime_r(&time, &parts);
+  char text[32];
+  std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &parts);
+  return text;
+}
+
+int64_t file_modified(const std::string &path) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    return 0;
+  }
+  return static_cast<int64_t>(info.st_mtime);
+}
+
+void append_version(std::string &out, EngineState &engine) {
+  EngineVersion version;
+  {
+    std::lock_guard<std::mutex> lock(engine.version_mutex);
+    version = engine.version;
+  }
+  std::optional<std::string> built_at;
+  if (version.built_at != 0) {
+    built_at = format_utc(version.built_at);
+  }
+  out += "{\"status\":200,\"engine\":\"";
+  append_escaped(out, version.engine);
+  out += "\",\"generation\":";
+  append_int(out, static_cast<int64_t>(version.generation));
+  out += ",\"source\":\"";
+  append_escaped(out, version.source);
+  out += "\",\"source_modified\":\"";
+  out += format_utc(version.source_modified);
+  out += "\",\"built_at\":";
+  append_json_string(out, built_at);
+  out += ",\"loaded_at\":\"";
+  out += format_utc(version.loaded_at);
+  out += "\"}";
+}
+
+// Compares in time independent of where the strings first differ.
+bool token_matches(const std::string &given, const std::string &expected) {
+  unsigned char diff = given.size() == expected.size() ? 0 : 1;
+  for (size_t i = 0; i < given.size() && i < expected.size(); ++i) {
+    diff |= static_cast<unsigned char>(given[i] ^ expected[i]);
+  }
+  return diff == 0;
+}
+
+void append_metric(std::string &out, const char *name, std::string_view labels,
+                   double value) {
+  char text[32];
+  int length = std::snprintf(text, sizeof(text), " %.9g\n", value);
+  out += name;
+  out += labels;
+  out.append(text, static_cast<size_t>(length));
+}
+
+void append_metric_help(std::string &out, const char *name, const char *type,
+                        const char *help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+// Connections waiting in the kernel to be accepted, summed over listeners.
+int64_t accept_queue_depth(const std::vector<int> &listeners) {
+  int64_t depth = 0;
+#ifdef __linux__
+  for (int fd : listeners) {
+    tcp_info info{};
+    socklen_t size = sizeof(info);
+    // For a listening socket, tcpi_unacked is the accept queue length.
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) == 0) {
+      depth += info.tcpi_unacked;
+    }
+  }
+#else
+  (void)listeners;
+#endif
+  return depth;
+}
+
+// Renders the Prometheus text exposition format.
+void append_metrics(std::string &out, const LookupService &service) {
+  auto load = [](const std::atomic<uint64_t> &value) {
+    return value.load(std::memory_order_relaxed);
+  };
+  append_metric_help(out, "geoip_responses_total", "counter",
+                     "HTTP responses sent, by status code.");
+  for (size_t i = 0; i < kStatusCount; ++i) {
+    uint64_t total = 0;
+    for (size_t w = 0; w < service.metrics_count; ++w) {
+      total += load(service.metrics[w].responses[i]);
+    }
+    append_metric(out, "geoip_responses_total",
+                  "{status=\"" + std::to_string(kCountedStatuses[i]) + "\"}",
+                  static_cast<double>(total));
+  }
+
+  append_metric_help(out, "geoip_stage_duration_seconds", "histogram",
+                     "Time spent in each stage of a request.");
+  for (int stage = 0; stage < kStageCount; ++stage) {
+    std::string name = std::string("{stage=\"") + kStageNames[stage] + "\"";
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    for (int bucket = 0; bucket <= kLatencyBuckets; ++bucket) {
+      for (size_t w = 0; w < service.metrics_count; ++w) {
+        count += load(service.metrics[w].buckets[stage][bucket]);
+      }
+      char bound[32];
+      if (bucket < kLatencyBuckets) {
+        std::snprintf(bound, sizeof(bound), "%g",
+                      static_cast<double>(uint64_t{1}
+                                          << (bucket + kFirstBucketShift)) /
+                          1e9);
+      } else {
+        std::snprintf(bound, sizeof(bound), "+Inf");
+      }
+      append_metric(out, "geoip_stage_duration_seconds_bucket",
+                    name + ",le=\"" + bound + "\"}", static_cast<double>(count));
+    }
+    for (size_t w = 0; w < service.metrics_count; ++w) {
+      total_ns += load(service.metrics[w].total_ns[stage]);
+    }
+    append_metric(out, "geoip_stage_duration_seconds_sum", name + "}",
+                  static_cast<double>(total_ns) / 1e9);
+    append_metric(out, "geoip_stage_duration_seconds_count", name + "}",
+                  static_cast<double>(count));
+  }
+
+  int64_t connections = 0;
+  for (size_t w = 0; w < service.metrics_count; ++w) {
+    connections += service.metrics[w].connections.load(std::memory_order_relaxed);
+  }
+  append_metric_help(out, "geoip_connections_open", "gauge",
+                     "Client connections currently open.");
+  append_metric(out, "geoip_connections_open", "",
+                static_cast<double>(connections));
+  uint64_t syscalls = 0;
+  for (size_t w = 0; w < service.metrics_count; ++w) {
+    syscalls += load(service.metrics[w].syscalls);
+  }
+  append_metric_help(out, "geoip_io_syscalls_total", "counter",
+                     "System calls made by the network loops.");
+  append_metric(out, "geoip_io_syscalls_total", "",
+                static_cast<double>(syscalls));
+  append_metric_help(out, "geoip_shed_total", "counter",
+                     "Requests and connections turned away, by reason.");
+  for (int reason = 0; reason < kShedCount; ++reason) {
+    uint64_t total = 0;
+    for (size_t w = 0; w < service.metrics_count; ++w) {
+      total += load(service.metrics[w].shed[reason]);
+    }
+    append_metric(out, "geoip_shed_total",
+                  std::string("{reason=\"") + kShedNames[reason] + "\"}",
+                  static_cast<double>(total));
+  }
+  append_metric_help(out, "geoip_accept_queue_depth", "gauge",
+                     "Connections waiting to be accepted (Linux only).");
+  append_metric(out, "geoip_accept_queue_depth", "",
+                static_cast<double>(accept_queue_depth(service.listeners)));
+  append_metric_help(out, "geoip_engine_generation", "gauge",
+                     "Number of times the engine data has been loaded.");
+  append_metric(out, "geoip_engine_generation", "",
+                static_cast<double>(service.engine->generation.load()));
+
+  if (ResultCache *cache = service.cache) {
+    uint64_t bytes = 0, hits = 0, misses = 0, evictions = 0;
+    for (size_t i = 0; i < (size_t{1} << kCacheShardBits); ++i) {
+      CacheShard &shard = cache->shards[i];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      bytes += shard.bytes;
+      hits += shard.hits;
+      misses += shard.misses;
+      evictions += shard.evictions;
+    }
+    append_metric_help(out, "geoip_cache_hits_total", "counter",
+                       "Lookups answered from the result cache.");
+    append_metric(out, "geoip_cache_hits_total", "", static_cast<double>(hits));
+    append_metric_help(out, "geoip_cache_misses_total", "counter",
+                       "Lookups the result cache could not answer.");
+    append_metric(out, "geoip_cache_misses_total", "",
+                  static_cast<double>(misses));
+    append_metric_help(out, "geoip_cache_evictions_total", "counter",
+                       "Entries evicted from the result cache.");
+    append_metric(out, "geoip_cache_evictions_total", "",
+                  static_cast<double>(evictions));
+    append_metric_help(out, "geoip_cache_bytes", "gauge",
+                       "Memory held by result cache entries.");
+    append_metric(out, "geoip_cache_bytes", "", static_cast<double>(bytes));
+  }
+}
+
+Response handle_request(LookupContext &context, const HttpRequest &request) {
+  std::string_view path = request_path(request);
+
+  if (path == "/lookup/batch") {
+    return {405, "{\"status\":405,\"detail\":\"Method not allowed\"}"};
+  }
+
+  if (path == "/version") {
+    if (request.method != "GET") {
+      return {405, "{\"status\":405,\"detail\":\"Method not allowed\"}"};
+    }
+    context.body.clear();
+    append_version(context.body, *context.service.engine);
+    return {200, context.body};
+  }
+
+  if (path == "/metrics") {
+    if (request.method != "GET") {
+      return {405, "{\"status\":405,\"detail\":\"Method not allowed\"}"};
+    }
+    context.body.clear();
+    append_metrics(context.body, context.service);
+    return {200, context.body, "text/plain; version=0.0.4; charset=utf-8"};
+  }
+
+  if (path == "/cache") {
+    if (request.method != "GET") {
+      return {405, "{\"status\":405,\"detail\":\"Method not allowed\"}"};
+    }
+    context.body.clear();
+    append_cache_stats(context.body, context.service.cache);
+    return {200, context.body};
+  }
+
+  if (path == "/admin/reload" && !context.service.admin_token.empty()) {
+    if (request.method != "POST") {
+      return {405, "{\"status\":405,\"detail\":\"Method not allowed\"}"};
+    }
+    if (!token_matches(request.authorization,
+                       "Bearer " + context.service.admin_token)) {
+      return {403, "{\"status\":403,\"detail\":\"Forbidden\"}"};
+    }
+    // The reloader thread waits for SIGHUP; raising it queues one reload.
+    kill(getpid(), SIGHUP);
+    return {202, "{\"status\":202,\"detail\":\"Reload started\"}"};
+  }
+
+  if (path != "/lookup") {
+    return {404, "{\"status\":404,\"detail\":\"Route not found\"}"};
+  }
+
+  if (request.method != "GET") {
+    return {405, "{\"status\":405,\"detail\":\"Method not allowed\"}"};
+  }
+
+  std::string ip = query_value(request.target, "ip");
+  context.lang = query_value(request.target, "lang");
+  if (ip.empty()) {
+    return encoded_error(
+        context.body, request.encoding, 400,
+        "{\"status\":400,\"detail\":\"Missing ip parameter\"}");
+  }
+  if (!parse_fields(query_value(request.target, "fields"), context.fields)) {
+    return encoded_error(context.body, request.encoding, 400, kInvalidFields);
+  }
+
+  IpAddress addr;
+  start_lap(context);
+  bool valid = parse_ip(ip, addr);
+  lap(context, kStageParseIp);
+  if (!valid) {
+    return encoded_error(context.body, request.encoding, 400,
+                         kInvalidIpAddress);
+  }
+  Response response = lookup_address(context, ip, addr, request.encoding);
+  lap(context, kStageSerialize);
+  return response;
+}
+
+constexpr size_t kMaxResponseHead = 192;
+
+// The longest head: the longest reason, the metrics media type, a 20-digit
+// length, Retry-After and keep-alive. A head cut off by snprintf would go
+// out without its blank line.
+static_assert(sizeof("HTTP/1.1 500 Internal Server Error\r\n"
+                     "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                     "Content-Length: 18446744073709551615\r\n"
+                     "Retry-After: 1\r\n"
+                     "Connection: keep-alive\r\n\r\n") <= kMaxResponseHead,
+              "the longest response head fits its buffer");
+
+// Writes the status line and headers for a body of `length` bytes into
+// `head`, which holds kMaxResponseHead bytes.
+size_t format_response_head(char *head, int status, const char *content_type,
+                            size_t length, bool keep_alive) {
+  const char *reason = "OK";
+  if (status == 202)
+    reason = "Accepted";
+  else if (status == 400)
+    reason = "Bad Request";
+  else if (status == 403)
+    reason = "Forbidden";
+  else if (status == 404)
+    reason = "Not Found";
+  else if (status == 405)
+    reason = "Method Not Allowed";
+  else if (status == 413)
+    reason = "Payload Too Large";
+  else if (status == 429)
+    reason = "Too Many Requests";
+  else if (status == 500)
+    reason = "Internal Server Error";
+  else if (status == 503)
+    reason = "Service Unavailable";
+
+  int written = std::snprintf(
+      head, kMaxResponseHead,
+      "HTTP/1.1 %d %s\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Length: %zu\r\n"
+      "%s"
+      "Connection: %s\r\n\r\n",
+      status, reason, content_type, length,
+      status == 429 || status == 503 ? "Retry-After: 1\r\n" : "",
+      keep_alive ? "keep-alive" : "close");
+  return static_cast<size_t>(written);
+}
+
+void append_response(std::string &out, const Response &response,
+                     bool keep_alive) {
+  char head[kMaxResponseHead];
+  out.append(head, format_response_head(head, response.status,
+                                        response.content_type,
+                                        response.body.size(), keep_alive));
+  out.append(response.body);
+}
+
+struct PollEvent {
+  int fd;
+  bool readable;
+  bool writable;
+  bool closed;
+};
+
+// Level-triggered readiness over epoll, or poll() where epoll is missing.
+// Every system call it makes is counted in `metrics`.
+class Poller {
+public:
+#ifdef __linux__
+  explicit Poller(WorkerMetrics *metrics)
+      : metrics_(metrics), epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+  ~Poller() { close(epoll_fd_); }
+
+  bool valid() const { return epoll_fd_ >= 0; }
+
+  void add(int fd, bool want_read, bool want_write) {
+    control(EPOLL_CTL_ADD, fd, want_read, want_write);
+  }
+  void modify(int fd, bool want_read, bool want_write) {
+    control(EPOLL_CTL_MOD, fd, want_read, want_write);
+  }
+  void remove(int fd) {
+    count_syscalls(metrics_);
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+
+  void wait(std::vector<PollEvent> &events, int timeout_ms) {
+    epoll_event ready[256];
+    count_syscalls(metrics_);
+    int count = epoll_wait(epoll_fd_, ready, 256, timeout_ms);
+    events.clear();
+    for (int i = 0; i < count; ++i) {
+      events.push_back({ready[i].data.fd, (ready[i].events & EPOLLIN) != 0,
+                        (ready[i].events & EPOLLOUT) != 0,
+                        (ready[i].events & (EPOLLERR | EPOLLHUP)) != 0});
+    }
+  }
+
+private:
+  void control(int op, int fd, bool want_read, bool want_write) {
+    epoll_event event{};
+    event.events = (want_read ? EPOLLIN : 0u) | (want_write ? EPOLLOUT : 0u);
+    event.data.fd = fd;
+    count_syscalls(metrics_);
+    epoll_ctl(epoll_fd_, op, fd, &event);
+  }
+
+  WorkerMetrics *metrics_;
+  int epoll_fd_;
+#else
+  explicit Poller(WorkerMetrics *metrics) : metrics_(metrics) {}
+
+  bool valid() const { return true; }
+
+  void add(int fd, bool want_read, bool want_write) {
+    slots_[fd] = fds_.size();
+    fds_.push_back({fd, interest(want_read, want_write), 0});
+  }
+  void modify(int fd, bool want_read, bool want_write) {
+    fds_[slots_[fd]].events = interest(want_read, want_write);
+  }
+  void remove(int fd) {
+    auto it = slots_.find(fd);
+    if (it == slots_.end()) {
+      return;
+    }
+    size_t pos = it->second;
+    slots_.erase(it);
+    if (pos + 1 != fds_.size()) {
+      fds_[pos] = fds_.back();
+      slots_[fds_[pos].fd] = pos;
+    }
+    fds_.pop_back();
+  }
+
+  void wait(std::vector<PollEvent> &events, int timeout_ms) {
+    events.clear();
+    count_syscalls(metrics_);
+    if (::poll(fds_.data(), fds_.size(), timeout_ms) <= 0) {
+      return;
+    }
+    for (const auto &entry : fds_) {
+      if (entry.revents) {
+        events.push_back({entry.fd, (entry.revents & POLLIN) != 0,
+                          (entry.revents & POLLOUT) != 0,
+                          (entry.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0});
+      }
+    }
+  }
+
+private:
+  static short interest(bool want_read, bool want_write) {
+    return static_cast<short>((want_read ? POLLIN : 0) |
+                              (want_write ? POLLOUT : 0));
+  }
+
+  WorkerMetrics *metrics_;
+  std::vector<pollfd> fds_;
+  std::unordered_map<int, size_t> slots_;
+#endif
+};
+
+constexpr size_t kMaxHeaderBytes = 8192;
+constexpr size_t kMaxPendingOutput = 1 << 20;
+constexpr const char *kInvalidRequest =
+    "{\"status\":400,\"detail\":\"Invalid request\"}";
+
+constexpr const char *kOverloaded =
+    "{\"status\":503,\"detail\":\"Server overloaded\"}";
+constexpr const char *kRateLimited =
+    "{\"status\":429,\"detail\":\"Too many requests\"}";
+
+// Limits the request rate of each client with GCRA, which behaves like a
+// token bucket of `burst` tokens refilled at `rate` per second but keeps a
+// single timestamp per bucket. Clients hash into a fixed table of buckets
+// shared by all workers; clients that share a bucket share its rate.
+class RateLimiter {
+public:
+  RateLimiter(double rate, double burst)
+      : interval_ns_(static_cast<int64_t>(1e9 / rate)),
+        tolerance_ns_(static_cast<int64_t>((burst - 1) * 1e9 / rate)),
+        buckets_(new std::atomic<int64_t>[kBuckets]) {
+    for (size_t i = 0; i < kBuckets; ++i) {
+      buckets_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Takes a token from the bucket of `client`; false if it has none left.
+  bool admit(uint64_t client, int64_t now_ns) {
+    client ^= client >> 33;
+    client *= 0xff51afd7ed558ccdull;
+    client ^= client >> 33;
+    std::atomic<int64_t> &due = buckets_[client & (kBuckets - 1)];
+    int64_t current = due.load(std::memory_order_relaxed);
+    while (true) {
+      int64_t start = std::max(current, now_ns);
+      if (start - now_ns > tolerance_ns_) {
+        return false;
+      }
+      if (due.compare_exchange_weak(current, start + interval_ns_,
+                                    std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+
+private:
+  static constexpr size_t kBuckets = size_t{1} << 16;
+  int64_t interval_ns_;
+  int64_t tolerance_ns_;
+  std::unique_ptr<std::atomic<int64_t>[]> buckets_;
+};
+
+struct ServerOptions {
+  int idle_timeout_ms = 5000;
+  size_t max_batch = 10000;
+  size_t max_body_bytes = 1 << 20;
+  // Admission control; zero or null turns each limit off.
+  size_t max_connections = 0;
+  int deadline_ms = 0;
+  RateLimiter *rate_limiter = nullptr;
+};
+
+struct BatchJob;
+
+struct Connection {
+  std::string in;
+  size_t parsed = 0;
+  size_t scanned = 0;
+  std::string out;
+  size_t sent = 0;
+  bool read_closed = false;
+  bool closing = false;
+  bool want_read = true;
+  bool want_write = false;
+  bool continue_sent = false;
+  std::unique_ptr<BatchJob> batch;
+  std::chrono::steady_clock::time_point last_active;
+  std::list<int>::iterator idle_pos;
+  // When the worker last read from the connection, the start of the queue
+  // wait of the requests it holds.
+  std::chrono::steady_clock::time_point received;
+  // Rate limit key of the peer; 0 when no limit applies.
+  uint64_t client = 0;
+  // io_uring backend only. `sending` belongs to the send in flight, and
+  // `out` collects the responses that follow it.
+  std::string sending;
+  size_t sending_done = 0;
+  // Submitted operations whose last completion has not arrived yet; the
+  // connection is only freed when this drops to zero.
+  int operations = 0;
+  bool recv_armed = false;
+  bool recv_cancelled = false;
+  bool failed = false;
+  bool finishing = false;
+};
+
+bool iequals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (std::tolower(static_cast<unsigned char>(a[i])) !=
+        std::tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string_view trim(std::string_view value) {
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+    value.remove_prefix(1);
+  }
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+    value.remove_suffix(1);
+  }
+  return value;
+}
+
+std::string_view next_token(std::string_view &line) {
+  size_t start = line.find_first_not_of(" \t");
+  if (start == std::string_view::npos) {
+    line = {};
+    return {};
+  }
+  line.remove_prefix(start);
+  size_t end = std::min(line.find_first_of(" \t"), line.size());
+  std::string_view token = line.substr(0, end);
+  line.remove_prefix(end);
+  return token;
+}
+
+enum class ParseResult { kIncomplete, kComplete, kInvalid };
+
+// The encoding of the acceptable media range with the highest quality,
+// the earliest on a tie; JSON when none is known.
+Encoding negotiate_encoding(std::string_view accept) {
+  Encoding best = Encoding::kJson;
+  double best_quality = 0;
+  while (!accept.empty()) {
+    size_t end = std::min(accept.find(','), accept.size());
+    std::string_view range = accept.substr(0, end);
+    accept.remove_prefix(std::min(end + 1, accept.size()));
+    size_t semicolon = std::min(range.find(';'), range.size());
+    std::string_view type = trim(range.substr(0, semicolon));
+    double quality = 1;
+    while (semicolon < range.size()) {
+      range.remove_prefix(semicolon + 1);
+      semicolon = std::min(range.find(';'), range.size());
+      std::string_view param = trim(range.substr(0, semicolon));
+      if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') &&
+          param[1] == '=') {
+        quality = std::atof(std::string(param.substr(2)).c_str());
+      }
+    }
+    for (const MediaType &known : kMediaTypes) {
+      if (iequals(type, known.name)) {
+        if (quality > best_quality) {
+          best = known.encoding;
+          best_quality = quality;
+        }
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+// Parses the request at the front of `data`. `scanned` records how far the
+// search for the end of the headers got, so a request that arrives in many
+// segments is only scanned once.
+ParseResult parse_request(std::string_view data, size_t &scanned,
+                          size_t max_body_bytes, HttpRequest &request,
+                          size_t &consumed) {
+  size_t header_end = data.find("\r\n\r\n", scanned >= 3 ? scanned - 3 : 0);
+  if (header_end == std::string_view::npos) {
+    scanned = data.size();
+    return data.size() > kMaxHeaderBytes ? ParseResult::kInvalid
+                                         : ParseResult::kIncomplete;
+  }
+  scanned = header_end;
+  if (header_end + 4 > kMaxHeaderBytes) {
+    return ParseResult::kInvalid;
+  }
+
+  std::string_view head = data.substr(0, header_end);
+  size_t line_end = std::min(head.find("\r\n"), head.size());
+  std::string_view request_line = head.substr(0, line_end);
+  request.method = std::string(next_token(request_line));
+  request.target = std::string(next_token(request_line));
+  std::string_view version = next_token(request_line);
+  request.http11 = version == "HTTP/1.1";
+  request.keep_alive = request.http11;
+
+  size_t content_length = 0;
+  std::string_view headers =
+      line_end < head.size() ? head.substr(line_end + 2) : std::string_view{};
+  while (!headers.empty()) {
+    size_t end = std::min(headers.find("\r\n"), headers.size());
+    std::string_view line = headers.substr(0, end);
+    headers.remove_prefix(std::min(end + 2, headers.size()));
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      continue;
+    }
+    std::string_view name = trim(line.substr(0, colon));
+    std::string_view value = trim(line.substr(colon + 1));
+    if (iequals(name, "Connection")) {
+      if (iequals(value, "close")) {
+        request.keep_alive = false;
+      } else if (iequals(value, "keep-alive")) {
+        request.keep_alive = true;
+      }
+    } else if (iequals(name, "Content-Length")) {
+      if (value.empty() || value.size() > 9 ||
+          value.find_first_not_of("0123456789") != std::string_view::npos) {
+        return ParseResult::kInvalid;
+      }
+      content_length = std::stoul(std::string(value));
+    } else if (iequals(name, "Authorization")) {
+      request.authorization = std::string(value);
+    } else if (iequals(name, "Expect")) {
+      request.expect_continue = iequals(value, "100-continue");
+    } else if (iequals(name, "Accept")) {
+      request.encoding = negotiate_encoding(value);
+    } else if (iequals(name, "Transfer-Encoding")) {
+      return ParseResult::kInvalid;
+    }
+  }
+  if (content_length > max_body_bytes) {
+    return ParseResult::kInvalid;
+  }
+  size_t total = header_end + 4 + content_length;
+  if (data.size() < total) {
+    return ParseResult::kIncomplete;
+  }
+  request.body = std::string(data.substr(header_end + 4, content_length));
+  consumed = total;
+  return ParseResult::kComplete;
+}
+
+int open_listener(int port, int backlog) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#endif
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, backlog) < 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+size_t pending_output(const Connection &conn) {
+  return conn.out.size() - conn.sent + conn.sending.size() - conn.sending_done;
+}
+
+// Returns false if the peer reset the connection.
+bool read_connection(int fd, Connection &conn, const ServerOptions &options,
+                     WorkerMetrics *metrics) {
+  char buffer[16384];
+  while (conn.in.size() - conn.parsed <
+         kMaxHeaderBytes + options.max_body_bytes) {
+    count_syscalls(metrics);
+    ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+    if (received > 0) {
+      conn.in.append(buffer, static_cast<size_t>(received));
+      continue;
+    }
+    if (received == 0) {
+      conn.read_closed = true;
+      return true;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  return true;
+}
+
+constexpr size_t kBatchWindow = 512;
+
+struct BatchJob {
+  std::vector<std::string> ips;
+  // The `lang` and `fields` query parameters, applied to every window.
+  std::string lang;
+  uint32_t fields = kAllFields;
+  Encoding encoding = Encoding::kJson;
+  size_t next = 0;
+  bool chunked = true;
+  bool keep_alive = true;
+  // Per-window scratch, kept so later windows reuse the storage.
+  std::vector<IpAddress> addrs;
+  std::vector<char> valid;
+  std::vector<size_t> order;
+  std::vector<LookupResult> results;
+};
+
+bool parse_json_string(std::string_view body, size_t &pos, std::string &out) {
+  if (pos >= body.size() || body[pos] != '"') {
+    return false;
+  }
+  ++pos;
+  while (pos < body.size()) {
+    char c = body[pos++];
+    if (c == '"') {
+      return true;
+    }
+    if (static_cast<unsigned char>(c) < 0x20) {
+      return false;
+    }
+    if (c != '\\') {
+      out.push_back(c);
+      continue;
+    }
+    if (pos >= body.size()) {
+      return false;
+    }
+    switch (body[pos++]) {
+    case '"':
+      out.push_back('"');
+      break;
+    case '\\':
+      out.push_back('\\');
+      break;
+    case '/':
+      out.push_back('/');
+      break;
+    case 'u': {
+      // Addresses are ASCII; anything wider cannot parse as an IP anyway.
+      if (pos + 4 > body.size()) {
+        return false;
+      }
+      std::string hex(body.substr(pos, 4));
+      if (hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+        return false;
+      }
+      long code = std::strtol(hex.c_str(), nullptr, 16);
+      out.push_back(code < 0x80 ? static_cast<char>(code) : '?');
+      pos += 4;
+      break;
+    }
+    default:
+      out.push_back('?');
+    }
+  }
+  return false;
+}
+
+size_t skip_space(std::string_view body, size_t pos) {
+  while (pos < body.size() && std::isspace(static_cast<unsigned char>(body[pos]))) {
+    ++pos;
+  }
+  return pos;
+}
+
+// Accepts a JSON array of strings or one address per line.
+std::optional<Response> parse_batch(std::string_view body, size_t max_items,
+                                    std::vector<std::string> &ips) {
+  const Response too_many{
+      413, "{\"status\":413,\"detail\":\"Too many IP addresses\"}"};
+  const Response invalid{400,
+                         "{\"status\":400,\"detail\":\"Invalid batch body\"}"};
+  size_t pos = skip_space(body, 0);
+  if (pos < body.size() && body[pos] == '[') {
+    pos = skip_space(body, pos + 1);
+    if (pos < body.size() && body[pos] == ']') {
+      ++pos;
+    } else {
+      while (true) {
+        std::string ip;
+        if (!parse_json_string(body, pos, ip)) {
+          return invalid;
+        }
+        if (ips.size() == max_items) {
+          return too_many;
+        }
+        ips.push_back(std::move(ip));
+        pos = skip_space(body, pos);
+        if (pos < body.size() && body[pos] == ',') {
+          pos = skip_space(body, pos + 1);
+          continue;
+        }
+        if (pos < body.size() && body[pos] == ']') {
+          ++pos;
+          break;
+        }
+        return invalid;
+      }
+    }
+    if (skip_space(body, pos) != body.size()) {
+      return invalid;
+    }
+  } else {
+    while (!body.empty()) {
+      size_t end = std::min(body.find('\n'), body.size());
+      std::string_view line = body.substr(0, end);
+      body.remove_prefix(std::min(end + 1, body.size()));
+      while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+        line.remove_suffix(1);
+      }
+      line = line.substr(std::min(line.find_first_not_of(" \t"), line.size()));
+      if (line.empty()) {
+        continue;
+      }
+      if (ips.size() == max_items) {
+        return too_many;
+      }
+      ips.emplace_back(line);
+    }
+  }
+  if (ips.empty()) {
+    return Response{400, "{\"status\":400,\"detail\":\"Empty batch\"}"};
+  }
+  return std::nullopt;
+}
+
+void append_chunk(std::string &out, std::string_view data, bool chunked) {
+  if (data.empty()) {
+    return;
+  }
+  if (chunked) {
+    char size[20];
+    int length = std::snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    out.append(size, static_cast<size_t>(length));
+  }
+  out.append(data);
+  if (chunked) {
+    out.append("\r\n");
+  }
+}
+
+// Looks up the next window of a batch in address order, so neighbouring
+// addresses walk the same part of the index, then emits it in input order.
+void run_batch_window(Connection &conn, LookupContext &context) {
+  BatchJob &job = *conn.batch;
+  size_t begin = job.next;
+  size_t count = std::min(kBatchWindow, job.ips.size() - begin);
+  job.addrs.resize(count);
+  job.valid.assign(count, 0);
+  job.results.resize(count);
+  job.order.clear();
+  for (size_t i = 0; i < count; ++i) {
+    if (parse_ip(job.ips[begin + i], job.addrs[i])) {
+      job.valid[i] = 1;
+      job.order.push_back(i);
+    }
+  }
+  sort_by_address(job.order, job.addrs);
+  context.lang = job.lang;
+  context.fields = job.fields;
+  lookup_rows(context, job.addrs, job.order, job.results);
+
+  std::string &chunk = context.body;
+  chunk.clear();
+  bool json = job.encoding == Encoding::kJson;
+  for (size_t i = 0; i < count; ++i) {
+    if (job.valid[i]) {
+      encode_result(chunk, job.encoding, job.ips[begin + i], job.addrs[i],
+                    job.results[i]);
+    } else {
+      encode_error(chunk, job.encoding, 400, kInvalidIpAddress);
+    }
+    if (json) {
+      chunk += '\n';
+    }
+  }
+  append_chunk(conn.out, chunk, job.chunked);
+  job.next = begin + count;
+  if (job.next == job.ips.size()) {
+    if (job.chunked) {
+      conn.out += "0\r\n\r\n";
+    }
+    if (!job.keep_alive) {
+      conn.closing = true;
+    }
+    conn.batch.reset();
+  }
+}
+
+void start_batch(Connection &conn, const HttpRequest &request,
+                 const ServerOptions &options, WorkerMetrics *metrics) {
+  auto job = std::make_unique<BatchJob>();
+  std::optional<Response> error;
+  if (!parse_fields(query_value(request.target, "fields"), job->fields)) {
+    error = Response{400, kInvalidFields};
+  } else {
+    error = parse_batch(request.body, options.max_batch, job->ips);
+  }
+  if (error) {
+    count_response(metrics, error->status);
+    std::string body;
+    append_response(conn.out,
+                    encoded_error(body, request.encoding, error->status,
+                                  error->body),
+                    request.keep_alive);
+    if (!request.keep_alive) {
+      conn.closing = true;
+    }
+    return;
+  }
+  job->lang = query_value(request.target, "lang");
+  job->encoding = request.encoding;
+  // HTTP/1.0 clients get a close-delimited stream instead of chunks.
+  job->chunked = request.http11;
+  job->keep_alive = request.keep_alive && request.http11;
+  count_response(metrics, 200);
+  conn.out += "HTTP/1.1 200 OK\r\nContent-Type: ";
+  conn.out += batch_content_type(job->encoding);
+  conn.out += "\r\n";
+  conn.out += job->chunked ? "Transfer-Encoding: chunked\r\n" : "";
+  conn.out += job->keep_alive ? "Connection: keep-alive\r\n\r\n"
+                              : "Connection: close\r\n\r\n";
+  conn.batch = std::move(job);
+}
+
+// Sends head and body with one gather write, straight from the render
+// buffer, when nothing is queued ahead of them. Whatever the socket does
+// not take is queued in conn.out.
+void send_response(int fd, Connection &conn, const Response &response,
+                   bool keep_alive, bool send_now, WorkerMetrics *metrics) {
+  char head[kMaxResponseHead];
+  size_t head_size =
+      format_response_head(head, response.status, response.content_type,
+                           response.body.size(), keep_alive);
+  size_t done = 0;
+  if (send_now && pending_output(conn) == 0) {
+    iovec parts[2] = {{head, head_size},
+                      {const_cast<char *>(response.body.data()),
+                       response.body.size()}};
+    msghdr message{};
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    ssize_t written;
+    do {
+      count_syscalls(metrics);
+      written = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (written < 0 && errno == EINTR);
+    done = written > 0 ? static_cast<size_t>(written) : 0;
+  }
+  if (done < head_size) {
+    conn.out.append(head + done, head_size - done);
+  }
+  conn.out.append(response.body.substr(done > head_size ? done - head_size : 0));
+}
+
+int64_t open_connections(const LookupService &service) {
+  int64_t open = 0;
+  for (size_t w = 0; w < service.metrics_count; ++w) {
+    open += service.metrics[w].connections.load(std::memory_order_relaxed);
+  }
+  return open;
+}
+
+// The rate limit key of the peer: its IPv4 address, or the /64 of an IPv6
+// address, since one client usually holds a whole /64.
+uint64_t client_key(int fd, WorkerMetrics *metrics) {
+  sockaddr_storage addr{};
+  socklen_t length = sizeof(addr);
+  count_syscalls(metrics);
+  if (getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &length) != 0) {
+    return 0;
+  }
+  if (addr.ss_family == AF_INET) {
+    const auto &v4 = reinterpret_cast<const sockaddr_in &>(addr);
+    return uint64_t{0xffff} << 32 | ntohl(v4.sin_addr.s_addr);
+  }
+  if (addr.ss_family != AF_INET6) {
+    return 0;
+  }
+  const auto &v6 = reinterpret_cast<const sockaddr_in6 &>(addr);
+  const uint8_t *bytes = v6.sin6_addr.s6_addr;
+  uint64_t key = 0;
+  if (IN6_IS_ADDR_V4MAPPED(&v6.sin6_addr)) {
+    for (int i = 10; i < 16; ++i) {
+      key = key << 8 | bytes[i];
+    }
+    return key;
+  }
+  for (int i = 0; i < 8; ++i) {
+    key = key << 8 | bytes[i];
+  }
+  return key;
+}
+
+// Turns a connection the worker just accepted away with a 503 when
+// GEOIP_MAX_CONNECTIONS are open. Whatever the client already sent is read
+// first so that closing does not reset the connection.
+bool admit_connection(int fd, const LookupService &service,
+                      const ServerOptions &options, WorkerMetrics *metrics) {
+  if (options.max_connections > 0 &&
+      open_connections(service) >=
+          static_cast<int64_t>(options.max_connections)) {
+    std::string out;
+    append_response(out, {503, kOverloaded}, false);
+    char discard[4096];
+    count_syscalls(metrics, 3);
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+      count_syscalls(metrics);
+    }
+    send(fd, out.data(), out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+    count_response(metrics, 503);
+    count_shed(metrics, kShedConnections);
+    return false;
+  }
+  return true;
+}
+
+// The answer to a request that waited past GEOIP_DEADLINE_MS or whose
+// client is over GEOIP_RATE_LIMIT, if any; `started` is when the worker got
+// to it. GET /metrics is always answered, so overload stays visible.
+const Response *shed_request(const Connection &conn,
+                             const HttpRequest &request,
+                             std::chrono::steady_clock::time_point started,
+                             const ServerOptions &options,
+                             WorkerMetrics *metrics) {
+  static const Response overloaded{503, kOverloaded};
+  static const Response rate_limited{429, kRateLimited};
+  if (request_path(request) == "/metrics") {
+    return nullptr;
+  }
+  if (options.deadline_ms > 0 &&
+      started - conn.received >
+          std::chrono::milliseconds(options.deadline_ms)) {
+    count_shed(metrics, kShedDeadline);
+    return &overloaded;
+  }
+  if (options.rate_limiter && conn.client != 0 &&
+      !options.rate_limiter->admit(
+          conn.client,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              started.time_since_epoch())
+              .count())) {
+    count_shed(metrics, kShedRate);
+    return &rate_limited;
+  }
+  return nullptr;
+}
+
+// Answers every complete request in the input buffer, in order, until the
+// output buffer is full enough to apply backpressure. Without `direct_send`
+// every response is queued in conn.out for the caller to send.
+void process_requests(int fd, Connection &conn, LookupContext &context,
+                      const ServerOptions &options, bool direct_send) {
+  while (!conn.closing && pending_output(conn) < kMaxPendingOutput) {
+    if (conn.batch) {
+      // One window per turn keeps a large batch from starving other
+      // connections on this worker.
+      run_batch_window(conn, context);
+      if (conn.batch) {
+        break;
+      }
+      continue;
+    }
+    std::string_view data(conn.in);
+    data.remove_prefix(conn.parsed);
+    if (data.empty()) {
+      break;
+    }
+    HttpRequest request;
+    size_t consumed = 0;
+    start_lap(context);
+    ParseResult result = parse_request(data, conn.scanned,
+                                       options.max_body_bytes, request,
+                                       consumed);
+    if (result == ParseResult::kIncomplete && !conn.read_closed) {
+      if (request.expect_continue && !conn.continue_sent) {
+        conn.out += "HTTP/1.1 100 Continue\r\n\r\n";
+        conn.continue_sent = true;
+      }
+      break;
+    }
+    if (result != ParseResult::kComplete) {
+      count_response(context.metrics, 400);
+      append_response(conn.out, {400, kInvalidRequest}, false);
+      conn.closing = true;
+      break;
+    }
+    conn.parsed += consumed;
+    conn.scanned = 0;
+    conn.continue_sent = false;
+    auto started = context.metrics ? context.lap_start
+                                   : std::chrono::steady_clock::now();
+    if (context.metrics) {
+      record_stage(*context.metrics, kStageQueue,
+                   static_cast<uint64_t>(std::max<int64_t>(
+                       std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           started - conn.received)
+                           .count(),
+                       0)));
+    }
+    lap(context, kStageParse);
+    if (const Response *shed =
+            shed_request(conn, request, started, options, context.metrics)) {
+      count_response(context.metrics, shed->status);
+      send_response(fd, conn, *shed, request.keep_alive,
+                    direct_send && conn.parsed == conn.in.size(),
+                    context.metrics);
+      if (!request.keep_alive) {
+        conn.closing = true;
+      }
+      continue;
+    }
+    if (request.method == "POST" && request_path(request) == "/lookup/batch") {
+      start_batch(conn, request, options, context.metrics);
+      continue;
+    }
+    Response response = handle_request(context, request);
+    count_response(context.metrics, response.status);
+    // Only a request with nothing pipelined behind it is sent right away;
+    // pipelined responses are queued and leave together.
+    start_lap(context);
+    send_response(fd, conn, response, request.keep_alive,
+                  direct_send && conn.parsed == conn.in.size(),
+                  context.metrics);
+    lap(context, kStageSend);
+    if (!request.keep_alive) {
+      conn.closing = true;
+    }
+  }
+  if (conn.parsed > 0) {
+    conn.in.erase(0, conn.parsed);
+    conn.parsed = 0;
+  }
+  if (conn.read_closed && conn.in.empty() && !conn.batch) {
+    conn.closing = true;
+  }
+}
+
+// Returns false if the peer is gone.
+bool flush_connection(int fd, Connection &conn, WorkerMetrics *metrics) {
+  while (conn.sent < conn.out.size()) {
+    count_syscalls(metrics);
+    ssize_t written = send(fd, conn.out.data() + conn.sent,
+                           conn.out.size() - conn.sent, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    conn.sent += static_cast<size_t>(written);
+  }
+  conn.out.clear();
+  conn.sent = 0;
+  return true;
+}
+
+void run_worker(int listen_fd, size_t reader, const LookupService &service,
+                const ServerOptions &options) {
+  using Clock = std::chrono::steady_clock;
+  LookupContext context(service, reader);
+  context.metrics = &service.metrics[reader];
+  Poller poller(context.metrics);
+  if (!poller.valid()) {
+    std::cerr << "Failed to create event loop." << std::endl;
+    return;
+  }
+  poller.add(listen_fd, true, false);
+  std::unordered_map<int, Connection> connections;
+  // Connections ordered by last activity, oldest first.
+  std::list<int> idle;
+  std::vector<PollEvent> events;
+  auto idle_timeout = std::chrono::milliseconds(options.idle_timeout_ms);
+
+  auto finish = [&](int fd) {
+    auto it = connections.find(fd);
+    if (it != connections.end()) {
+      idle.erase(it->second.idle_pos);
+      connections.erase(it);
+      bump(context.metrics->connections, int64_t{-1});
+    }
+    poller.remove(fd);
+    count_syscalls(context.metrics);
+    close(fd);
+  };
+
+  while (true) {
+    int timeout_ms = -1;
+    if (!idle.empty()) {
+      auto deadline = connections[idle.front()].last_active + idle_timeout;
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - Clock::now());
+      timeout_ms = static_cast<int>(std::max<int64_t>(wait.count(), 0) + 1);
+    }
+    poller.wait(events, timeout_ms);
+    auto now = Clock::now();
+    enter_read(context);
+
+    for (const auto &event : events) {
+      if (event.fd == listen_fd) {
+        while (true) {
+          count_syscalls(context.metrics);
+          int client_fd = accept(listen_fd, nullptr, nullptr);
+          if (client_fd < 0) {
+            break;
+          }
+          if (!admit_connection(client_fd, service, options,
+                                context.metrics)) {
+            continue;
+          }
+          count_syscalls(context.metrics, 2);
+          fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+          Connection &conn = connections[client_fd];
+          bump(context.metrics->connections, int64_t{1});
+          if (options.rate_limiter) {
+            conn.client = client_key(client_fd, context.metrics);
+          }
+          conn.last_active = now;
+          conn.idle_pos = idle.insert(idle.end(), client_fd);
+          poller.add(client_fd, true, false);
+        }
+        continue;
+      }
+
+      auto it = connections.find(event.fd);
+      if (it == connections.end()) {
+        continue;
+      }
+      Connection &conn = it->second;
+      bool alive = true;
+      if (conn.want_read && (event.readable || event.closed)) {
+        size_t before = conn.in.size();
+        alive = read_connection(event.fd, conn, options, context.metrics);
+        if (conn.in.size() > before) {
+          conn.received = now;
+        }
+      }
+      // Requests held back by a full output buffer are answered as soon as
+      // it drains, without waiting for more input.
+      while (alive) {
+        process_requests(event.fd, conn, context, options, true);
+        if (pending_output(conn) == 0) {
+          break;
+        }
+        alive = flush_connection(event.fd, conn, context.metrics);
+        if (pending_output(conn) > 0 || conn.closing || conn.batch) {
+          break;
+        }
+      }
+      if (!alive || (conn.closing && pending_output(conn) == 0)) {
+        finish(event.fd);
+        continue;
+      }
+
+      conn.last_active = Clock::now();
+      idle.splice(idle.end(), idle, conn.idle_pos);
+      bool want_read = !conn.closing && !conn.read_closed &&
+                       pending_output(conn) < kMaxPendingOutput;
+      bool want_write = pending_output(conn) > 0 || conn.batch != nullptr;
+      if (want_read != conn.want_read || want_write != conn.want_write) {
+        conn.want_read = want_read;
+        conn.want_write = want_write;
+        poller.modify(event.fd, want_read, want_write);
+      }
+    }
+
+    leave_read(context);
+
+    now = Clock::now();
+    while (!idle.empty() &&
+           now - connections[idle.front()].last_active >= idle_timeout) {
+      finish(idle.front());
+    }
+  }
+}
+
+#ifdef GEOIP_IO_URING
+constexpr unsigned kRingEntries = 1024;
+constexpr unsigned kRecvBuffers = 128;
+constexpr unsigned kRecvBufferSize = 16384;
+constexpr uint16_t kRecvBufferGroup = 0;
+
+// A submission and completion queue pair shared with the kernel, set up with
+// the raw system calls, plus a group of provided receive buffers the kernel
+// picks from as data arrives. Only the thread that created it may submit.
+class IoUring {
+public:
+  IoUring() = default;
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+  ~IoUring() {
+    if (sqes_) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (rings_) {
+      munmap(rings_, rings_size_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // Fails when the kernel lacks io_uring, has it disabled, or misses a
+  // feature the server loop relies on.
+  bool init(unsigned entries, std::string &error) {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                   IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = entries * 4;
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0 && errno == EINVAL) {
+      params = io_uring_params{};
+      params.flags = IORING_SETUP_CQSIZE;
+      params.cq_entries = entries * 4;
+      fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    }
+    if (fd_ < 0) {
+      error = std::string("io_uring_setup: ") + std::strerror(errno);
+      return false;
+    }
+    unsigned needed =
+        IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed) {
+      error = "kernel too old";
+      return false;
+    }
+    rings_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                           params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    rings_ = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (rings_ == MAP_FAILED) {
+      rings_ = nullptr;
+      error = std::string("mmap: ") + std::strerror(errno);
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      error = std::string("mmap: ") + std::strerror(errno);
+      return false;
+    }
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+    char *base = static_cast<char *>(rings_);
+    sq_head_ = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    unsigned *array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) {
+      array[i] = i;
+    }
+    tail_ = *sq_tail_;
+    cq_head_ = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+    return setup_buffers(error);
+  }
+
+  // Returns a zeroed submission entry, first handing the queued ones to the
+  // kernel if the queue is full.
+  io_uring_sqe *next_sqe() {
+    if (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+      enter(0, -1);
+    }
+    io_uring_sqe *sqe = &sqes_[tail_ & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ++tail_;
+    return sqe;
+  }
+
+  // Submits everything queued and waits for `wait_for` completions or
+  // `timeout_ms` (-1 waits without a limit), in one system call.
+  void enter(unsigned wait_for, int timeout_ms) {
+    __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+    unsigned submit = tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    io_uring_getevents_arg arg{};
+    __kernel_timespec timeout{};
+    if (timeout_ms >= 0) {
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+      arg.ts = reinterpret_cast<uint64_t>(&timeout);
+    }
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (wait_for > 0) {
+      flags |= IORING_ENTER_GETEVENTS;
+    }
+    ++syscalls;
+    syscall(__NR_io_uring_enter, fd_, submit, wait_for, flags, &arg,
+            sizeof(arg));
+  }
+
+  // Calls `handle` for every completion posted so far, except those of the
+  // buffer hand-backs.
+  template <typename Handler>
+  void drain(Handler &&handle) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      if (cqe.user_data != kProvideTag) {
+        handle(cqe);
+      }
+    }
+  }
+
+  std::string_view buffer(uint16_t id, size_t size) const {
+    return {buffers_.data() + size_t{id} * kRecvBufferSize, size};
+  }
+
+  // Hands a provided buffer back to the kernel once its data is copied out.
+  // The hand-back is queued with the next submission.
+  void recycle(uint16_t id) { provide(id, 1); }
+
+  // io_uring_enter calls made so far.
+  uint64_t syscalls = 0;
+
+private:
+  static constexpr uint64_t kProvideTag = ~uint64_t{0};
+
+  void provide(uint16_t first, unsigned count) {
+    io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int>(count);
+    sqe->addr = reinterpret_cast<uint64_t>(buffers_.data() +
+                                           size_t{first} * kRecvBufferSize);
+    sqe->len = kRecvBufferSize;
+    sqe->off = first;
+    sqe->buf_group = kRecvBufferGroup;
+    sqe->user_data = kProvideTag;
+  }
+
+  // Ring-mapped buffer groups (IORING_REGISTER_PBUF_RING) would save the
+  // hand-back entries, but some kernels accept the registration and then
+  // never pick from the ring, so the classic provide operation is used.
+  bool setup_buffers(std::string &error) {
+    buffers_.resize(size_t{kRecvBuffers} * kRecvBufferSize);
+    provide(0, kRecvBuffers);
+    enter(1, -1);
+    io_uring_cqe &cqe = cqes_[*cq_head_ & cq_mask_];
+    if (*cq_head_ == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) ||
+        cqe.res < 0) {
+      error = std::string("provided buffers: ") +
+              std::strerror(*cq_head_ == *cq_tail_ ? EIO : -cqe.res);
+      return false;
+    }
+    __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  int fd_ = -1;
+  void *rings_ = nullptr;
+  size_t rings_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  // Submissions queued locally, published to the kernel by enter().
+  unsigned tail_ = 0;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+  std::vector<char> buffers_;
+};
+
+// Completions carry the connection's descriptor and the operation kind.
+enum RingOperation : uint64_t {
+  kRingAccept,
+  kRingRecv,
+  kRingSend,
+  kRingCancel,
+  kRingShutdown,
+  kRingClose,
+};
+
+uint64_t ring_tag(int fd, RingOperation operation) {
+  return static_cast<uint64_t>(fd) << 8 | operation;
+}
+
+// The same server loop as run_worker, driven by completions instead of
+// readiness: one multishot accept per listener, one multishot receive per
+// connection filling kernel-picked buffers, and sends queued as entries.
+// Everything queued while handling a batch of completions is submitted with
+// the next wait, so a busy worker makes one system call per loop turn.
+// Returns false, before serving anything, when io_uring cannot be set up.
+bool run_uring_worker(int listen_fd, size_t reader,
+                      const LookupService &service,
+                      const ServerOptions &options) {
+  using Clock = std::chrono::steady_clock;
+  IoUring ring;
+  std::string error;
+  if (!ring.init(kRingEntries, error)) {
+    std::cerr << "io_uring unavailable (" << error << "), worker " << reader
+              << " uses epoll." << std::endl;
+    return false;
+  }
+  LookupContext context(service, reader);
+  context.metrics = &service.metrics[reader];
+  std::unordered_map<int, Connection> connections;
+  // Connections ordered by last activity, oldest first.
+  std::list<int> idle;
+  // Connections with completions to act on in this turn.
+  std::vector<int> touched;
+  Clock::time_point turn;
+  auto idle_timeout = std::chrono::milliseconds(options.idle_timeout_ms);
+  size_t read_limit = kMaxHeaderBytes + options.max_body_bytes;
+
+  auto arm_accept = [&] {
+    io_uring_sqe *sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ring_tag(listen_fd, kRingAccept);
+  };
+  auto arm_recv = [&](int fd, Connection &conn) {
+    io_uring_sqe *sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kRecvBufferGroup;
+    sqe->user_data = ring_tag(fd, kRingRecv);
+    conn.recv_armed = true;
+    conn.recv_cancelled = false;
+    ++conn.operations;
+  };
+  auto submit_send = [&](int fd, Connection &conn) {
+    io_uring_sqe *sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(conn.sending.data() + conn.sending_done);
+    sqe->len = static_cast<uint32_t>(conn.sending.size() - conn.sending_done);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ring_tag(fd, kRingSend);
+    ++conn.operations;
+  };
+  // Stops the connection; it is closed once every operation on it is over.
+  auto finish = [&](int fd, Connection &conn) {
+    if (conn.finishing) {
+      return;
+    }
+    conn.finishing = true;
+    idle.erase(conn.idle_pos);
+    if (conn.operations > 0) {
+      io_uring_sqe *sqe = ring.next_sqe();
+      sqe->opcode = IORING_OP_SHUTDOWN;
+      sqe->fd = fd;
+      sqe->len = SHUT_RDWR;
+      sqe->user_data = ring_tag(fd, kRingShutdown);
+      ++conn.operations;
+    }
+  };
+  auto release = [&](int fd) {
+    io_uring_sqe *sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = ring_tag(fd, kRingClose);
+    connections.erase(fd);
+    bump(context.metrics->connections, int64_t{-1});
+  };
+
+  auto handle = [&](const io_uring_cqe &cqe) {
+    int fd = static_cast<int>(cqe.user_data >> 8);
+    auto operation = static_cast<RingOperation>(cqe.user_data & 0xff);
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (operation == kRingAccept) {
+      if (cqe.res >= 0 &&
+          admit_connection(cqe.res, service, options, context.metrics)) {
+        Connection &conn = connections[cqe.res];
+        bump(context.metrics->connections, int64_t{1});
+        if (options.rate_limiter) {
+          conn.client = client_key(cqe.res, context.metrics);
+        }
+        conn.last_active = Clock::now();
+        conn.idle_pos = idle.insert(idle.end(), cqe.res);
+        arm_recv(cqe.res, conn);
+      }
+      if (!more) {
+        arm_accept();
+      }
+      return;
+    }
+    if (operation == kRingClose) {
+      return;
+    }
+    auto it = connections.find(fd);
+    if (it == connections.end()) {
+      return;
+    }
+    Connection &conn = it->second;
+    if (operation == kRingRecv) {
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe.res > 0 && !conn.finishing) {
+          conn.in.append(ring.buffer(id, static_cast<size_t>(cqe.res)));
+          conn.received = turn;
+        }
+        ring.recycle(id);
+      }
+      if (cqe.res == 0) {
+        conn.read_closed = true;
+      } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+        conn.failed = true;
+      }
+      if (!more) {
+        conn.recv_armed = false;
+        --conn.operations;
+      }
+    } else if (operation == kRingSend) {
+      --conn.operations;
+      if (cqe.res < 0) {
+        conn.failed = true;
+      } else {
+        conn.sending_done += static_cast<size_t>(cqe.res);
+        if (conn.sending_done == conn.sending.size()) {
+          conn.sending.clear();
+          conn.sending_done = 0;
+        } else if (!conn.finishing) {
+          submit_send(fd, conn);
+        }
+      }
+    } else {
+      --conn.operations;
+    }
+    if (touched.empty() || touched.back() != fd) {
+      touched.push_back(fd);
+    }
+  };
+
+  // Answers what a connection received and queues the next send, like one
+  // pass of run_worker's event handling.
+  auto serve = [&](int fd, Connection &conn) {
+    if (!conn.finishing && !conn.failed) {
+      process_requests(fd, conn, context, options, false);
+      if (conn.sending.empty() && !conn.out.empty()) {
+        conn.out.erase(0, conn.sent);
+        conn.sent = 0;
+        std::swap(conn.sending, conn.out);
+        submit_send(fd, conn);
+      }
+    }
+    if (conn.failed || (conn.closing && pending_output(conn) == 0)) {
+      finish(fd, conn);
+    }
+    if (conn.finishing) {
+      if (conn.operations == 0) {
+        release(fd);
+      }
+      return;
+    }
+    conn.last_active = Clock::now();
+    idle.splice(idle.end(), idle, conn.idle_pos);
+    bool want_read = !conn.closing && !conn.read_closed &&
+                     pending_output(conn) < kMaxPendingOutput &&
+                     conn.in.size() < read_limit;
+    if (want_read && !conn.recv_armed) {
+      arm_recv(fd, conn);
+    } else if (!want_read && conn.recv_armed && !conn.recv_cancelled) {
+      io_uring_sqe *sqe = ring.next_sqe();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = ring_tag(fd, kRingRecv);
+      sqe->user_data = ring_tag(fd, kRingCancel);
+      conn.recv_cancelled = true;
+      ++conn.operations;
+    }
+  };
+
+  arm_accept();
+  while (true) {
+    int timeout_ms = -1;
+    if (!idle.empty()) {
+      auto deadline = connections[idle.front()].last_active + idle_timeout;
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - Clock::now());
+      timeout_ms = static_cast<int>(std::max<int64_t>(wait.count(), 0) + 1);
+    }
+    uint64_t before = ring.syscalls;
+    ring.enter(1, timeout_ms);
+    turn = Clock::now();
+    enter_read(context);
+    touched.clear();
+    ring.drain(handle);
+    for (int fd : touched) {
+      auto it = connections.find(fd);
+      if (it != connections.end()) {
+        serve(fd, it->second);
+      }
+    }
+    leave_read(context);
+
+    auto now = Clock::now();
+    while (!idle.empty() &&
+           now - connections[idle.front()].last_active >= idle_timeout) {
+      int fd = idle.front();
+      Connection &conn = connections[fd];
+      finish(fd, conn);
+      if (conn.operations == 0) {
+        release(fd);
+      }
+    }
+    count_syscalls(context.metrics, ring.syscalls - before);
+  }
+}
+
+bool io_uring_supported(std::string &error) {
+  IoUring ring;
+  return ring.init(8, error);
+}
+#endif
+
+struct EngineConfig {
+  std::string db_path;
+  // Compiled index mapped by the memory and lpm engines instead of loading
+  // the database.
+  std::string index_path;
+  std::string engine;
+  std::string locale;
+};
+
+// The database of the checkout the server was built in.
+std::string default_db_path() {
+  auto base = std::filesystem::path(__FILE__).parent_path().parent_path();
+  return (base / "config" / "database" / "WhatTimeIsIn-geoip.db").string();
+}
+
+EngineConfig engine_config() {
+  EngineConfig config;
+  config.db_path = std::getenv("GEOIP_DB_PATH") ? std::getenv("GEOIP_DB_PATH")
+                                                : default_db_path();
+  config.index_path =
+      std::getenv("GEOIP_INDEX_PATH") ? std::getenv("GEOIP_INDEX_PATH") : "";
+  std::string fallback = config.index_path.empty() ? "sqlite" : "memory";
+  config.engine = std::getenv("GEOIP_ENGINE") ? std::getenv("GEOIP_ENGINE") : fallback;
+  config.locale = std::getenv("GEOIP_LOCALE") ? std::getenv("GEOIP_LOCALE") : "en";
+  return config;
+}
+
+int default_threads() {
+  int threads = static_cast<int>(std::thread::hardware_concurrency());
+  if (const char *threads_env = std::getenv("GEOIP_THREADS")) {
+    threads = std::atoi(threads_env);
+  }
+  return std::max(threads, 1);
+}
+
+// Loads the in-memory index unless the SQLite engine is selected. Progress
+// goes to `log`, which is stderr when stdout carries data.
+bool load_engine(const EngineConfig &config,
+                 std::unique_ptr<MemoryIndex> &memory, EngineVersion &version,
+                 std::ostream &log) {
+  if (config.engine != "sqlite" && config.engine != "memory" &&
+      config.engine != "lpm") {
+    std::cerr << "Unknown GEOIP_ENGINE: " << config.engine << std::endl;
+    return false;
+  }
+  bool mapped = config.engine != "sqlite" && !config.index_path.empty();
+  version.engine = config.engine;
+  version.source = mapped ? config.index_path : config.db_path;
+  version.source_modified = file_modified(version.source);
+  version.loaded_at = static_cast<int64_t>(std::time(nullptr));
+  if (config.engine == "sqlite") {
+    SqliteContext probe;
+    if (open_sqlite(probe, config.db_path) == OpenResult::kOk && !probe.seek) {
+      log << "Lookups scan ranges; `geoip prepare-db` writes a copy of the "
+             "database they can seek in."
+          << std::endl;
+    }
+    return true;
+  }
+  auto started = std::chrono::steady_clock::now();
+  memory = std::make_unique<MemoryIndex>();
+  memory->prefix_match = config.engine == "lpm";
+  std::string error;
+  if (!load_index(config.db_path, config.index_path, *memory, error)) {
+    std::cerr << error << std::endl;
+    return false;
+  }
+  if (mapped) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started);
+    version.built_at = memory->built_at;
+    log << "Mapped index " << config.index_path << " built "
+        << format_utc(memory->built_at) << " with " << memory->city_blocks.size() << " city, "
+        << memory->country_blocks.size() << " country and "
+        << memory->asn_blocks.size() << " ASN blocks, "
+        << memory->locales.size() - 1 << " locale(s) in " << elapsed.count()
+        << " ms" << std::endl;
+    log_index_tables(log, *memory);
+    return true;
+  }
+  version.built_at = memory->built_at;
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - started);
+  log << "Loaded " << memory->city_blocks.size() << " city, "
+      << memory->country_blocks.size() << " country and "
+      << memory->asn_blocks.size() << " ASN blocks, "
+      << memory->locales.size() - 1 << " locale(s) and "
+      << memory->strings.size() / 1024 << " KiB of strings in "
+      << elapsed.count() << " ms" << std::endl;
+  log_index_tables(log, *memory);
+  return true;
+}
+
+// Rebuilds the engine on SIGHUP (POST /admin/reload raises it too) and
+// publishes it without pausing the workers. Signals that arrive during a
+// reload collapse into one more reload.
+void run_reloader(EngineConfig config, EngineState &engine,
+                  sigset_t signals) {
+  while (true) {
+    int signal = 0;
+    if (sigwait(&signals, &signal) != 0) {
+      continue;
+    }
+    std::cout << "Reloading " << config.engine << " engine..." << std::endl;
+    if (config.engine == "sqlite" && !std::filesystem::exists(config.db_path)) {
+      std::cerr << "Reload failed, database not found: " << config.db_path
+                << std::endl;
+      continue;
+    }
+    std::unique_ptr<MemoryIndex> memory;
+    EngineVersion version;
+    if (!load_engine(config, memory, version, std::cout)) {
+      std::cerr << "Reload failed, still serving the previous data."
+                << std::endl;
+      continue;
+    }
+    publish_engine(engine, std::move(memory), std::move(version));
+    std::cout << "Reload complete, generation " << engine.generation.load()
+              << std::endl;
+  }
+}
+
+int run_server() {
+  EngineConfig config = engine_config();
+  int port = 5022;
+  if (const char *port_env = std::getenv("GEOIP_PORT")) {
+    port = std::atoi(port_env);
+  }
+  int threads = default_threads();
+  int backlog = SOMAXCONN;
+  if (const char *backlog_env = std::getenv("GEOIP_BACKLOG")) {
+    backlog = std::max(std::atoi(backlog_env), 1);
+  }
+  ServerOptions options;
+  if (const char *batch_env = std::getenv("GEOIP_BATCH_MAX")) {
+    options.max_batch = static_cast<size_t>(std::max(std::atoi(batch_env), 1));
+  }
+  options.max_body_bytes = std::max(options.max_body_bytes, options.max_batch * 64);
+  if (const char *timeout_env = std::getenv("GEOIP_KEEPALIVE_TIMEOUT")) {
+    options.idle_timeout_ms = std::max(std::atoi(timeout_env), 1) * 1000;
+  }
+  if (const char *connections_env = std::getenv("GEOIP_MAX_CONNECTIONS")) {
+    options.max_connections =
+        static_cast<size_t>(std::max(std::atol(connections_env), 0L));
+  }
+  if (const char *deadline_env = std::getenv("GEOIP_DEADLINE_MS")) {
+    options.deadline_ms = std::max(std::atoi(deadline_env), 0);
+  }
+  std::unique_ptr<RateLimiter> rate_limiter;
+  if (const char *rate_env = std::getenv("GEOIP_RATE_LIMIT")) {
+    double rate = std::atof(rate_env);
+    double burst = rate;
+    if (const char *burst_env = std::getenv("GEOIP_RATE_BURST")) {
+      burst = std::atof(burst_env);
+    }
+    if (rate > 0) {
+      rate_limiter = std::make_unique<RateLimiter>(rate, std::max(burst, 1.0));
+      options.rate_limiter = rate_limiter.get();
+    }
+  }
+  std::string io = std::getenv("GEOIP_IO") ? std::getenv("GEOIP_IO") : "epoll";
+  if (io != "epoll" && io != "io_uring") {
+    std::cerr << "Unknown GEOIP_IO: " << io << std::endl;
+    return 1;
+  }
+  if (io == "io_uring") {
+#ifdef GEOIP_IO_URING
+    std::string error;
+    if (!io_uring_supported(error)) {
+      std::cout << "io_uring unavailable (" << error << "), using epoll."
+                << std::endl;
+      io = "epoll";
+    }
+#else
+    std::cout << "io_uring is not supported by this build, using epoll."
+              << std::endl;
+    io = "epoll";
+#endif
+  }
+  std::signal(SIGPIPE, SIG_IGN);
+
+  std::unique_ptr<MemoryIndex> memory;
+  EngineVersion version;
+  if (!load_engine(config, memory, version, std::cout)) {
+    return 1;
+  }
+  EngineState engine(static_cast<size_t>(threads));
+  publish_engine(engine, std::move(memory), std::move(version));
+
+  LookupService service;
+  service.db_path = config.db_path;
+  service.locale = config.locale;
+  service.engine = &engine;
+  if (const char *token_env = std::getenv("GEOIP_ADMIN_TOKEN")) {
+    service.admin_token = token_env;
+  }
+  std::unique_ptr<WorkerMetrics[]> metrics(new WorkerMetrics[threads]);
+  service.metrics = metrics.get();
+  service.metrics_count = static_cast<size_t>(threads);
+  std::unique_ptr<ResultCache> cache;
+  if (const char *cache_env = std::getenv("GEOIP_CACHE_MB")) {
+    long megabytes = std::atol(cache_env);
+    if (megabytes > 0 && config.engine == "sqlite") {
+      std::cout << "GEOIP_CACHE_MB is ignored by the sqlite engine."
+                << std::endl;
+    } else if (megabytes > 0) {
+      cache = std::make_unique<ResultCache>(static_cast<size_t>(megabytes)
+                                            << 20);
+      service.cache = cache.get();
+    }
+  }
+
+  // Linux balances connections across SO_REUSEPORT listeners; elsewhere the
+  // workers share a single listener.
+  std::vector<int> listeners;
+#ifdef __linux__
+  int listener_count = threads;
+#else
+  int listener_count = 1;
+#endif
+  for (int i = 0; i < listener_count; ++i) {
+    int fd = open_listener(port, backlog);
+    if (fd < 0) {
+      std::cerr << "Failed to bind socket." << std::endl;
+      for (int open_fd : listeners) {
+        close(open_fd);
+      }
+      return 1;
+    }
+    listeners.push_back(fd);
+  }
+  service.listeners = listeners;
+
+  // Only the reloader receives SIGHUP; the other threads inherit the mask.
+  sigset_t reload_signals;
+  sigemptyset(&reload_signals);
+  sigaddset(&reload_signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &reload_signals, nullptr);
+  std::thread reloader(run_reloader, config, std::ref(engine), reload_signals);
+
+  std::cout << "GeoIP API running on http://localhost:" << port << " with "
+            << threads << " worker thread(s) on " << io << std::endl;
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    size_t slot = static_cast<size_t>(i);
+    int listen_fd = listeners[slot % listeners.size()];
+    workers.emplace_back([&service, &options, &io, listen_fd, slot] {
+#ifdef GEOIP_IO_URING
+      if (io == "io_uring" &&
+          run_uring_worker(listen_fd, slot, service, options)) {
+        return;
+      }
+#endif
+      (void)io;
+      run_worker(listen_fd, slot, service, options);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  reloader.join();
+  return 1;
+}
+
+constexpr size_t kEnrichChunkLines = 8192;
+constexpr const char *kCsvColumns =
+    "status,ip_version,source,network,prefix_length,continent_code,"
+    "continent_name,country_iso_code,country_name,flag_emoji,"
+    "is_in_european_union,subdivision_1_iso_code,subdivision_1_name,"
+    "subdivision_2_iso_code,subdivision_2_name,city_name,metro_code,time_zone,"
+    "latitude,longitude,accuracy_radius,postal_code,is_anonymous_proxy,"
+    "is_satellite_provider,is_anycast,geoname_id,"
+    "registered_country_geoname_id,represented_country_geoname_id,"
+    "asn_network,asn_prefix_length,asn_number,asn_organization";
+
+struct EnrichOptions {
+  bool csv_output = false;
+  // Zero-based CSV column holding the address; -1 reads a bare list.
+  int column = -1;
+  std::string column_name;
+  bool header = false;
+  int threads = 1;
+};
+
+// Extracts field `index` of a CSV line, unquoting it. Quoted fields may not
+// span lines.
+bool csv_field(std::string_view line, int index, std::string &out) {
+  int current = 0;
+  size_t pos = 0;
+  while (true) {
+    out.clear();
+    if (pos < line.size() && line[pos] == '"') {
+      ++pos;
+      while (pos < line.size()) {
+        if (line[pos] == '"') {
+          if (pos + 1 < line.size() && line[pos + 1] == '"') {
+            out.push_back('"');
+            pos += 2;
+            continue;
+          }
+          ++pos;
+          break;
+        }
+        out.push_back(line[pos++]);
+      }
+      pos = std::min(line.find(',', pos), line.size());
+    } else {
+      size_t end = std::min(line.find(',', pos), line.size());
+      out.assign(line.substr(pos, end - pos));
+      pos = end;
+    }
+    if (current == index) {
+      return true;
+    }
+    if (pos >= line.size()) {
+      return false;
+    }
+    ++pos;
+    ++current;
+  }
+}
+
+void append_csv_value(std::string &out, std::string_view value) {
+  if (value.find_first_of(",\"\r\n") == std::string_view::npos) {
+    out += value;
+    return;
+  }
+  out += '"';
+  for (char c : value) {
+    if (c == '"') {
+      out += '"';
+    }
+    out += c;
+  }
+  out += '"';
+}
+
+void append_csv(std::string &out, const std::optional<std::string> &value) {
+  out += ',';
+  if (value.has_value()) {
+    append_csv_value(out, *value);
+  }
+}
+
+void append_csv(std::string &out, const std::optional<int64_t> &value) {
+  out += ',';
+  if (value.has_value()) {
+    out += std::to_string(*value);
+  }
+}
+
+void append_csv(std::string &out, const std::optional<double> &value) {
+  out += ',';
+  if (value.has_value()) {
+    append_json_number(out, value);
+  }
+}
+
+// Appends the network and country-level columns shared by city and country
+// rows.
+template <typename Row>
+void append_csv_country(std::string &out, const Row &row) {
+  append_csv(out, std::optional<std::string>(row.network));
+  append_csv(out, std::optional<int64_t>(row.prefix_length));
+  append_csv(out, row.continent_code);
+  append_csv(out, row.continent_name);
+  append_csv(out, row.country_iso_code);
+  append_csv(out, row.country_name);
+  append_csv(out, iso_to_flag(row.country_iso_code));
+  append_csv(out, row.is_in_european_union);
+}
+
+template <typename Row>
+void append_csv_traits(std::string &out, const Row &row) {
+  append_csv(out, row.is_anonymous_proxy);
+  append_csv(out, row.is_satellite_provider);
+  append_csv(out, row.is_anycast);
+  append_csv(out, row.geoname_id);
+  append_csv(out, row.registered_country_geoname_id);
+  append_csv(out, row.represented_country_geoname_id);
+}
+
+// Appends the kCsvColumns fields for one input line, leaving columns that
+// do not apply empty.
+void append_csv_result(std::string &out, int status, const IpAddress &addr,
+                       const LookupResult &result) {
+  out += std::to_string(status);
+  if (status == 400) {
+    out.append(31, ',');
+    return;
+  }
+  out += ',' + std::to_string(addr.version);
+  if (status != 200) {
+    out.append(30, ',');
+    return;
+  }
+  if (const ReservedRange *range = result.reserved) {
+    out += ",reserved";
+    append_csv(out, std::optional<std::string>(range->network));
+    append_csv(out, std::optional<int64_t>(range->prefix_length));
+    out.append(23, ',');
+  } else if (result.city.has_value()) {
+    const CityRow &row = *result.city;
+    out += ",city";
+    append_csv_country(out, row);
+    append_csv(out, row.subdivision_1_iso_code);
+    append_csv(out, row.subdivision_1_name);
+    append_csv(out, row.subdivision_2_iso_code);
+    append_csv(out, row.subdivision_2_name);
+    append_csv(out, row.city_name);
+    append_csv(out, row.metro_code);
+    append_csv(out, row.time_zone);
+    append_csv(out, row.latitude);
+    append_csv(out, row.longitude);
+    append_csv(out, row.accuracy_radius);
+    append_csv(out, row.postal_code);
+    append_csv_traits(out, row);
+  } else {
+    out += ",country";
+    append_csv_country(out, *result.country);
+    out.append(11, ',');
+    append_csv_traits(out, *result.country);
+  }
+  if (result.asn.has_value()) {
+    append_csv(out, std::optional<std::string>(result.asn->network));
+    append_csv(out, std::optional<int64_t>(result.asn->prefix_length));
+    append_csv(out, result.asn->autonomous_system_number);
+    append_csv(out, result.asn->autonomous_system_organization);
+  } else {
+    out.append(4, ',');
+  }
+}
+
+// Enriches one chunk of input lines. Lookups run in address order; output
+// keeps the input order.
+std::string enrich_chunk(LookupContext &context, const EnrichOptions &options,
+                         const std::vector<std::string> &lines) {
+  size_t count = lines.size();
+  std::vector<std::string> ips(count);
+  std::vector<IpAddress> addrs(count);
+  std::vector<int> statuses(count, 400);
+  std::vector<size_t> order;
+  order.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    if (options.column < 0) {
+      ips[i] = std::string(trim(lines[i]));
+    } else {
+      csv_field(lines[i], options.column, ips[i]);
+    }
+    if (parse_ip(ips[i], addrs[i])) {
+      order.push_back(i);
+    }
+  }
+  sort_by_address(order, addrs);
+  std::vector<LookupResult> results(count);
+  lookup_rows(context, addrs, order, results);
+  for (size_t i : order) {
+    if (options.csv_output) {
+      load_rows(results[i]);
+    }
+    statuses[i] = results[i].error ? 500 : results[i].found() ? 200 : 404;
+  }
+
+  std::string out;
+  for (size_t i = 0; i < count; ++i) {
+    if (!options.csv_output) {
+      switch (statuses[i]) {
+      case 200:
+        append_lookup(out, ips[i], addrs[i], results[i]);
+        break;
+      case 404:
+        out += kNotFound;
+        break;
+      case 500:
+        out += results[i].error;
+        break;
+      default:
+        out += kInvalidIpAddress;
+      }
+    } else {
+      if (options.column < 0) {
+        append_csv_value(out, ips[i]);
+      } else {
+        out += lines[i];
+      }
+      out += ',';
+      append_csv_result(out, statuses[i], addrs[i], results[i]);
+    }
+    out += '\n';
+  }
+  return out;
+}
+
+// Hands input chunks to the enrich workers and collects their output so the
+// reader can write it back in input order.
+struct EnrichQueue {
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::pair<size_t, std::vector<std::string>>> pending;
+  std::map<size_t, std::string> done;
+  bool finished = false;
+};
+
+void run_enrich_worker(EnrichQueue &queue, size_t reader,
+                       const LookupService &service,
+                       const EnrichOptions &options) {
+  LookupContext context(service, reader);
+  while (true) {
+    std::pair<size_t, std::vector<std::string>> chunk;
+    {
+      std::unique_lock<std::mutex> lock(queue.mutex);
+      queue.ready.wait(lock, [&] { return queue.finished || !queue.pending.empty(); });
+      if (queue.pending.empty()) {
+        return;
+      }
+      chunk = std::move(queue.pending.front());
+      queue.pending.pop_front();
+    }
+    enter_read(context);
+    std::string out = enrich_chunk(context, options, chunk.second);
+    leave_read(context);
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.done.emplace(chunk.first, std::move(out));
+    }
+    queue.ready.notify_all();
+  }
+}
+
+int enrich_usage() {
+  std::cerr << "Usage: geoip enrich [--format ndjson|csv] [--column N|NAME] "
+               "[--header] [--threads N] [--engine sqlite|memory|lpm] "
+               "[--lang CODE] [FILE]"
+            << std::endl;
+  return 2;
+}
+
+// Reads addresses (one per line, or one CSV column) from FILE or stdin and
+// writes one enriched record per input line to stdout, in input order.
+int run_enrich(int argc, char **argv) {
+  EngineConfig config = engine_config();
+  if (!std::getenv("GEOIP_ENGINE")) {
+    config.engine = "memory";
+  }
+  EnrichOptions options;
+  options.threads = default_threads();
+  std::string path = "-";
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--format" && has_value) {
+      std::string format = argv[++i];
+      if (format != "ndjson" && format != "csv") {
+        return enrich_usage();
+      }
+      options.csv_output = format == "csv";
+    } else if (arg == "--column" && has_value) {
+      std::string column = argv[++i];
+      if (!column.empty() &&
+          column.find_first_not_of("0123456789") == std::string::npos) {
+        options.column = std::atoi(column.c_str());
+      } else {
+        options.column_name = column;
+        options.header = true;
+      }
+    } else if (arg == "--header") {
+      options.header = true;
+    } else if (arg == "--threads" && has_value) {
+      options.threads = std::max(std::atoi(argv[++i]), 1);
+    } else if (arg == "--engine" && has_value) {
+      config.engine = argv[++i];
+    } else if (arg == "--lang" && has_value) {
+      config.locale = argv[++i];
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      return enrich_usage();
+    } else {
+      path = arg;
+    }
+  }
+  if (options.header && options.column < 0 && options.column_name.empty()) {
+    options.column = 0;
+  }
+
+  std::ifstream file;
+  if (path != "-") {
+    file.open(path);
+    if (!file) {
+      std::cerr << "Failed to open input: " << path << std::endl;
+      return 1;
+    }
+  }
+  std::istream &input = path == "-" ? std::cin : file;
+
+  std::string line;
+  if (options.header) {
+    while (std::getline(input, line) && trim(line).empty()) {
+    }
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!options.column_name.empty()) {
+      std::string field;
+      for (int index = 0; csv_field(line, index, field); ++index) {
+        if (field == options.column_name) {
+          options.column = index;
+          break;
+        }
+      }
+      if (options.column < 0) {
+        std::cerr << "Column not found in header: " << options.column_name
+                  << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  std::unique_ptr<MemoryIndex> memory;
+  EngineVersion version;
+  if (!load_engine(config, memory, version, std::cerr)) {
+    return 1;
+  }
+  if (!memory && !std::filesystem::exists(config.db_path)) {
+    std::cerr << "Failed to open database: " << config.db_path << std::endl;
+    return 1;
+  }
+  EngineState engine(static_cast<size_t>(options.threads));
+  publish_engine(engine, std::move(memory), std::move(version));
+  LookupService service;
+  service.db_path = config.db_path;
+  service.locale = config.locale;
+  service.engine = &engine;
+
+  if (options.csv_output && (options.column < 0 || options.header)) {
+    std::string header = options.column < 0 ? "ip" : line;
+    header += ',';
+    header += kCsvColumns;
+    header += '\n';
+    std::fwrite(header.data(), 1, header.size(), stdout);
+  }
+
+  EnrichQueue queue;
+  std::vector<std::thread> workers;
+  for (int i = 0; i < options.threads; ++i) {
+    workers.emplace_back(run_enrich_worker, std::ref(queue),
+                         static_cast<size_t>(i), std::cref(service),
+                         std::cref(options));
+  }
+
+  // Bound the chunks in flight so memory stays flat on large inputs.
+  size_t max_in_flight = static_cast<size_t>(options.threads) * 2;
+  size_t next_read = 0;
+  size_t next_write = 0;
+  auto write_ready = [&](bool wait_for_one) {
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    while (true) {
+      auto it = queue.done.find(next_write);
+      if (it == queue.done.end()) {
+        if (!wait_for_one || next_write == next_read) {
+          return;
+        }
+        queue.ready.wait(lock);
+        continue;
+      }
+      std::string out = std::move(it->second);
+      queue.done.erase(it);
+      ++next_write;
+      wait_for_one = false;
+      lock.unlock();
+      std::fwrite(out.data(), 1, out.size(), stdout);
+      lock.lock();
+    }
+  };
+
+  std::vector<std::string> chunk;
+  chunk.reserve(kEnrichChunkLines);
+  auto submit = [&] {
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.pending.emplace_back(next_read++, std::move(chunk));
+    }
+    queue.ready.notify_all();
+    chunk = {};
+    chunk.reserve(kEnrichChunkLines);
+    write_ready(next_read - next_write > max_in_flight);
+  };
+  while (std::getline(input, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (trim(line).empty()) {
+      continue;
+    }
+    chunk.push_back(std::move(line));
+    if (chunk.size() == kEnrichChunkLines) {
+      submit();
+    }
+  }
+  if (!chunk.empty()) {
+    submit();
+  }
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.finished = true;
+  }
+  queue.ready.notify_all();
+  while (next_write < next_read) {
+    write_ready(true);
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  std::fflush(stdout);
+  return 0;
+}
+
+std::string default_index_path(const EngineConfig &config) {
+  if (!config.index_path.empty()) {
+    return config.index_path;
+  }
+  return std::filesystem::path(config.db_path).replace_extension(".idx").string();
+}
+
+// Compiles the database into an index file holding every locale. The file
+// is written next to the target and renamed over it, so processes that
+// still map the old file keep reading consistent pages.
+int run_compile(int argc, char **argv) {
+  EngineConfig config = engine_config();
+  std::string output = default_index_path(config);
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--output" && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      std::cerr << "Usage: geoip compile [--output FILE]" << std::endl;
+      return 2;
+    }
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  sqlite3 *db = nullptr;
+  if (!std::filesystem::exists(config.db_path) ||
+      sqlite3_open_v2(config.db_path.c_str(), &db, SQLITE_OPEN_READONLY,
+                      nullptr) != SQLITE_OK) {
+    std::cerr << "Failed to open database: " << config.db_path << std::endl;
+    sqlite3_close(db);
+    return 1;
+  }
+  uint32_t flags = kIndexHasRanges | kIndexHasTries;
+  IndexBuilder builder;
+  bool built = locale_codes(db, builder.locales);
+  if (!built) {
+    builder.error = std::string("Failed to read locales: ") + sqlite3_errmsg(db);
+  }
+  if (built && builder.locales.size() > kMaxIndexLocales) {
+    std::cerr << "Too many locales: " << builder.locales.size() << " (max "
+              << kMaxIndexLocales << ")" << std::endl;
+    sqlite3_close(db);
+    return 1;
+  }
+  built = built && build_index(db, flags, builder);
+  sqlite3_close(db);
+  if (!built) {
+    std::cerr << "Failed to read database " << config.db_path << ": "
+              << builder.error << std::endl;
+    return 1;
+  }
+  std::vector<uint64_t> image = write_index_image(builder, flags);
+
+  std::string temp = output + ".tmp";
+  {
+    std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(image.data()),
+               static_cast<std::streamsize>(image.size() * 8));
+    if (!file) {
+      std::cerr << "Failed to write index: " << temp << std::endl;
+      return 1;
+    }
+  }
+  std::error_code renamed;
+  std::filesystem::rename(temp, output, renamed);
+  if (renamed) {
+    std::cerr << "Failed to replace " << output << ": " << renamed.message()
+              << std::endl;
+    return 1;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - started);
+  std::cout << "Compiled " << output << ": " << image.size() * 8 << " bytes, "
+            << builder.locales.size() << " locale(s), "
+            << builder.city_blocks.size() << " city, "
+            << builder.country_blocks.size() << " country and "
+            << builder.asn_blocks.size() << " ASN blocks in " << elapsed.count()
+            << " ms" << std::endl;
+  MemoryIndex index;
+  std::string error;
+  if (attach_index(reinterpret_cast<const char *>(image.data()),
+                   image.size() * 8, false, index, error)) {
+    log_index_tables(std::cout, index);
+  }
+  return 0;
+}
+
+// Checks the full checksum of a compiled index, e.g. after copying it.
+int run_verify(int argc, char **argv) {
+  EngineConfig config = engine_config();
+  if (argc > 1) {
+    std::cerr << "Usage: geoip verify [FILE]" << std::endl;
+    return 2;
+  }
+  std::string path = argc == 1 ? argv[0] : default_index_path(config);
+  MemoryIndex index;
+  std::string error;
+  if (!map_index(path, true, index, error)) {
+    std::cerr << path << ": " << error << std::endl;
+    return 1;
+  }
+  std::cout << path << ": OK, format " << kIndexFormatVersion << ", built "
+            << format_utc(index.built_at) << std::endl;
+  return 0;
+}
+
+// Writes a copy of the database that the sqlite engine searches with
+// index seeks instead of range scans (see prepare_database()). The source
+// is left as it is; point GEOIP_DB_PATH at the copy to use it.
+int run_prepare_db(int argc, char **argv) {
+  EngineConfig config = engine_config();
+  std::string output = std::filesystem::path(config.db_path)
+                           .replace_extension(".prepared.db")
+                           .string();
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--output" && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      std::cerr << "Usage: geoip prepare-db [--output FILE]" << std::endl;
+      return 2;
+    }
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  std::string temp = output + ".tmp";
+  std::error_code removed;
+  std::filesystem::remove(temp, removed);
+  sqlite3 *db = nullptr;
+  if (!std::filesystem::exists(config.db_path) ||
+      sqlite3_open_v2(config.db_path.c_str(), &db, SQLITE_OPEN_READONLY,
+                      nullptr) != SQLITE_OK) {
+    std::cerr << "Failed to open database: " << config.db_path << std::endl;
+    sqlite3_close(db);
+    return 1;
+  }
+  sqlite3_stmt *stmt = nullptr;
+  bool copied =
+      sqlite3_prepare_v2(db, "VACUUM INTO ?", -1, &stmt, nullptr) ==
+          SQLITE_OK &&
+      sqlite3_bind_text(stmt, 1, temp.c_str(), -1, SQLITE_STATIC) ==
+          SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_DONE;
+  sqlite3_finalize(stmt);
+  if (!copied) {
+    std::cerr << "Failed to copy database to " << temp << ": "
+              << sqlite3_errmsg(db) << std::endl;
+    sqlite3_close(db);
+    std::filesystem::remove(temp, removed);
+    return 1;
+  }
+  sqlite3_close(db);
+
+  db = nullptr;
+  PreparedDatabase prepared;
+  std::string error;
+  if (sqlite3_open(temp.c_str(), &db) != SQLITE_OK) {
+    error = "Failed to open " + temp;
+  } else {
+    prepare_database(db, prepared, error);
+  }
+  sqlite3_close(db);
+  if (!error.empty()) {
+    std::cerr << error << std::endl;
+    std::filesystem::remove(temp, removed);
+    return 1;
+  }
+  std::error_code renamed;
+  std::filesystem::rename(temp, output, renamed);
+  if (renamed) {
+    std::cerr << "Failed to replace " << output << ": " << renamed.message()
+              << std::endl;
+    return 1;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - started);
+  std::cout << "Prepared " << output << " in " << elapsed.count() << " ms: "
+            << prepared.blocks[kCityTable] << " city, "
+            << prepared.blocks[kCountryTable] << " country and "
+            << prepared.blocks[kAsnTable] << " ASN blocks are disjoint"
+            << std::endl;
+  for (const std::string &index : prepared.indexes) {
+    std::cout << "  created index " << index << std::endl;
+  }
+  for (const std::string &plan : prepared.plans) {
+    std::cout << "  plan " << plan << std::endl;
+  }
+  return 0;
+}
+
+std::string format_address(const IpAddress &addr) {
+  char text[INET6_ADDRSTRLEN] = "";
+  if (addr.version == 4) {
+    in_addr ipv4_addr{};
+    ipv4_addr.s_addr = htonl(static_cast<uint32_t>(addr.bits >> 96));
+    inet_ntop(AF_INET, &ipv4_addr, text, sizeof(text));
+  } else {
+    in6_addr ipv6_addr{};
+    for (int i = 0; i < 16; ++i) {
+      ipv6_addr.s6_addr[i] = static_cast<uint8_t>(addr.bits >> (120 - 8 * i));
+    }
+    inet_ntop(AF_INET6, &ipv6_addr, text, sizeof(text));
+  }
+  return text;
+}
+
+// Bits of IpAddress::bits below a prefix of `length`.
+Uint128 host_mask(int64_t ip_version, int length) {
+  Uint128 mask = length >= 128 ? 0 : ~Uint128{0} >> length;
+  return ip_version == 4 ? mask & (~Uint128{0} << 96) : mask;
+}
+
+// An address drawn uniformly from `prefix`.
+IpAddress random_address(std::mt19937_64 &rng, int64_t ip_version,
+                         const TriePrefix &prefix) {
+  IpAddress addr;
+  addr.version = ip_version;
+  Uint128 noise = (static_cast<Uint128>(rng()) << 64) | rng();
+  addr.bits = prefix.bits | (noise & host_mask(ip_version, prefix.length));
+  return addr;
+}
+
+// Reads the addresses to replay: one per line, or JSON object lines from
+// which the "ip" member is taken.
+bool read_ip_list(const std::string &path, std::vector<std::string> &ips) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    std::string_view value = trim(line);
+    if (value.empty()) {
+      continue;
+    }
+    if (value.front() != '{') {
+      ips.emplace_back(value);
+      continue;
+    }
+    size_t pos = value.find("\"ip\"");
+    if (pos == std::string_view::npos) {
+      continue;
+    }
+    pos = skip_space(value, pos + 4);
+    if (pos >= value.size() || value[pos] != ':') {
+      continue;
+    }
+    pos = skip_space(value, pos + 1);
+    std::string ip;
+    if (parse_json_string(value, pos, ip)) {
+      ips.push_back(std::move(ip));
+    }
+  }
+  return true;
+}
+
+// Synthetic database with the schema the lookups read. Blocks are laid out
+// like the real data: disjoint, aligned networks of mixed sizes with gaps
+// between them, country blocks covering the city blocks and more, and ASN
+// blocks following their own, coarser layout.
+constexpr const char *kFixtureSchema =
+    "CREATE TABLE city_blocks(network TEXT, network_start INTEGER, "
+    "network_end INTEGER, prefix_length INTEGER, ip_version INTEGER, "
+    "geoname_id INTEGER, registered_country_geoname_id INTEGER, "
+    "represented_country_geoname_id INTEGER, is_anonymous_proxy INTEGER, "
+    "is_satellite_provider INTEGER, is_anycast INTEGER, postal_code TEXT, "
+    "latitude REAL, longitude REAL, accuracy_radius INTEGER);"
+    "CREATE TABLE city_locations(geoname_id INTEGER, locale_code TEXT, "
+    "continent_code TEXT, continent_name TEXT, country_iso_code TEXT, "
+    "country_name TEXT, subdivision_1_iso_code TEXT, subdivision_1_name TEXT, "
+    "subdivision_2_iso_code TEXT, subdivision_2_name TEXT, city_name TEXT, "
+    "metro_code TEXT, time_zone TEXT, is_in_european_union INTEGER);"
+    "CREATE TABLE country_blocks(network TEXT, network_start INTEGER, "
+    "network_end INTEGER, prefix_length INTEGER, ip_version INTEGER, "
+    "geoname_id INTEGER, registered_country_geoname_id INTEGER, "
+    "represented_country_geoname_id INTEGER, is_anonymous_proxy INTEGER, "
+    "is_satellite_provider INTEGER, is_anycast INTEGER);"
+    "CREATE TABLE country_locations(geoname_id INTEGER, locale_code TEXT, "
+    "continent_code TEXT, continent_name TEXT, country_iso_code TEXT, "
+    "country_name TEXT, is_in_european_union INTEGER);"
+    "CREATE TABLE asn_blocks(network TEXT, network_start INTEGER, "
+    "network_end INTEGER, prefix_length INTEGER, ip_version INTEGER, "
+    "autonomous_system_number INTEGER, autonomous_system_organization TEXT);"
+    "CREATE INDEX city_blocks_range ON "
+    "city_blocks(ip_version, network_start, network_end);"
+    "CREATE INDEX country_blocks_range ON "
+    "country_blocks(ip_version, network_start, network_end);"
+    "CREATE INDEX asn_blocks_range ON "
+    "asn_blocks(ip_version, network_start, network_end);"
+    "CREATE INDEX city_locations_id ON city_locations(geoname_id, locale_code);"
+    "CREATE INDEX country_locations_id ON "
+    "country_locations(geoname_id, locale_code);";
+
+constexpr const char *kFixtureContinents[][2] = {
+    {"AF", "Africa"},        {"AS", "Asia"},    {"EU", "Europe"},
+    {"NA", "North America"}, {"OC", "Oceania"}, {"SA", "South America"}};
+constexpr const char *kFixtureTimeZones[] = {
+    "Europe/Berlin", "Asia/Tokyo", "America/New_York", "Australia/Sydney"};
+constexpr int64_t kFixtureCountries = 60;
+
+struct FixtureOptions {
+  std::string output;
+  std::string ips;
+  size_t blocks = 20000;
+  size_t ip_count = 100000;
+  uint64_t seed = 1;
+};
+
+struct FixtureNetwork {
+  int64_t ip_version;
+  TriePrefix prefix;
+};
+
+// Walks the address space, placing aligned networks with a length picked
+// from `lengths` and leaving about one slot in four empty. IPv6 starts at
+// 2400::, clear of the reserved 2001::/23.
+std::vector<FixtureNetwork> fixture_networks(std::mt19937_64 &rng,
+                                             int64_t ip_version, size_t count,
+                                             const std::vector<int> &lengths) {
+  Uint128 cursor = ip_version == 4 ? Uint128{1} << 120 : Uint128{0x2400} << 112;
+  Uint128 end = ip_version == 4 ? Uint128{224} << 120 : Uint128{0x3000} << 112;
+  std::vector<FixtureNetwork> networks;
+  while (networks.size() < count) {
+    int length = lengths[rng() % lengths.size()];
+    Uint128 size = Uint128{1} << (128 - length);
+    cursor = (cursor + size - 1) & ~(size - 1);
+    if (cursor >= end || end - cursor < size) {
+      break;
+    }
+    if (rng() % 4 != 0) {
+      networks.push_back({ip_version, {cursor, length, kNoRow}});
+    }
+    cursor += size;
+  }
+  return networks;
+}
+
+template <typename T>
+void bind_value(sqlite3_stmt *stmt, int index, const T &value) {
+  if constexpr (std::is_same_v<T, std::nullopt_t>) {
+    sqlite3_bind_null(stmt, index);
+  } else if constexpr (std::is_floating_point_v<T>) {
+    sqlite3_bind_double(stmt, index, value);
+  } else if constexpr (std::is_integral_v<T>) {
+    sqlite3_bind_int64(stmt, index, value);
+  } else {
+    std::string_view text(value);
+    sqlite3_bind_text(stmt, index, text.data(), static_cast<int>(text.size()),
+                      SQLITE_TRANSIENT);
+  }
+}
+
+template <typename T>
+void bind_value(sqlite3_stmt *stmt, int index, const std::optional<T> &value) {
+  if (value.has_value()) {
+    bind_value(stmt, index, *value);
+  } else {
+    sqlite3_bind_null(stmt, index);
+  }
+}
+
+template <typename... Values>
+bool insert_row(sqlite3_stmt *stmt, const Values &...values) {
+  int index = 0;
+  (bind_value(stmt, ++index, values), ...);
+  bool done = sqlite3_step(stmt) == SQLITE_DONE;
+  sqlite3_reset(stmt);
+  return done;
+}
+
+// network, network_start and network_end of a fixture block.
+std::tuple<std::string, int64_t, int64_t>
+network_columns(const FixtureNetwork &network) {
+  IpAddress addr{network.ip_version, network.prefix.bits};
+  int shift = network.ip_version == 4 ? 96 : 64;
+  Uint128 last =
+      network.prefix.bits | host_mask(network.ip_version, network.prefix.length);
+  std::string text =
+      format_address(addr) + "/" + std::to_string(network.prefix.length);
+  return {text, static_cast<int64_t>(network.prefix.bits >> shift),
+          static_cast<int64_t>(last >> shift)};
+}
+
+bool write_fixture(sqlite3 *db, const FixtureOptions &options,
+                   std::mt19937_64 &rng,
+                   std::vector<FixtureNetwork> &sample_networks) {
+  if (sqlite3_exec(db, kFixtureSchema, nullptr, nullptr, nullptr) != SQLITE_OK ||
+      sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    return false;
+  }
+  const char *inserts[] = {
+      "INSERT INTO country_locations VALUES (?,?,?,?,?,?,?)",
+      "INSERT INTO city_locations VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?)",
+      "INSERT INTO country_blocks VALUES (?,?,?,?,?,?,?,?,?,?,?)",
+      "INSERT INTO city_blocks VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)",
+      "INSERT INTO asn_blocks VALUES (?,?,?,?,?,?,?)"};
+  sqlite3_stmt *stmts[5] = {};
+  bool ok = true;
+  for (int i = 0; i < 5 && ok; ++i) {
+    ok = sqlite3_prepare_v2(db, inserts[i], -1, &stmts[i], nullptr) == SQLITE_OK;
+  }
+  auto [country_locations, city_locations, country_blocks, city_blocks,
+        asn_blocks] = stmts;
+
+  // Country geoname ids are 1000 + n, city ids 100000 + n. German names are
+  // missing for some cities, as in the real data.
+  for (int64_t n = 0; ok && n < kFixtureCountries; ++n) {
+    const auto &continent = kFixtureContinents[n % 6];
+    std::string iso = {static_cast<char>('A' + n / 26),
+                       static_cast<char>('A' + n % 26)};
+    int64_t eu = continent[0][0] == 'E' ? 1 : 0;
+    ok = insert_row(country_locations, 1000 + n, "en", continent[0],
+                    continent[1], iso, "Country " + std::to_string(n), eu) &&
+         insert_row(country_locations, 1000 + n, "de", continent[0],
+                    continent[1], iso, "Land " + std::to_string(n), eu);
+  }
+  int64_t cities = static_cast<int64_t>(std::max<size_t>(options.blocks / 10, 1));
+  for (int64_t n = 0; ok && n < cities; ++n) {
+    int64_t country = n % kFixtureCountries;
+    const auto &continent = kFixtureContinents[country % 6];
+    std::string iso = {static_cast<char>('A' + country / 26),
+                       static_cast<char>('A' + country % 26)};
+    std::string subdivision = "S" + std::to_string(n % 17);
+    std::optional<std::string> metro;
+    if (n % 9 == 0) {
+      metro = std::to_string(500 + n % 300);
+    }
+    const char *time_zone = kFixtureTimeZones[n % 4];
+    int64_t eu = continent[0][0] == 'E' ? 1 : 0;
+    ok = insert_row(city_locations, 100000 + n, "en", continent[0],
+                    continent[1], iso, "Country " + std::to_string(country),
+                    subdivision, "Region " + subdivision, std::nullopt,
+                    std::nullopt, "City " + std::to_string(n), metro, time_zone,
+                    eu);
+    if (ok && n % 3 != 0) {
+      ok = insert_row(city_locations, 100000 + n, "de", continent[0],
+                      continent[1], iso, "Land " + std::to_string(country),
+                      subdivision, "Region " + subdivision, std::nullopt,
+                      std::nullopt, "Stadt " + std::to_string(n) + " \xc3\xbc",
+                      metro, time_zone, eu);
+    }
+  }
+
+  std::uniform_real_distribution<double> latitude(-80, 80);
+  std::uniform_real_distribution<double> longitude(-180, 180);
+  for (int64_t ip_version : {4, 6}) {
+    size_t count = ip_version == 4 ? options.blocks : options.blocks / 4;
+    std::vector<int> lengths = ip_version == 4
+                                   ? std::vector<int>{16, 20, 22, 24, 24, 24, 26, 28}
+                                   : std::vector<int>{32, 36, 40, 44, 48, 48, 56, 64};
+    auto networks = fixture_networks(rng, ip_version, count, lengths);
+    for (const FixtureNetwork &network : networks) {
+      if (!ok) {
+        break;
+      }
+      auto [text, start, end] = network_columns(network);
+      int64_t city = static_cast<int64_t>(rng() % static_cast<uint64_t>(cities));
+      int64_t country = 1000 + city % kFixtureCountries;
+      // One block in five only has a country, so lookups fall back.
+      ok = insert_row(country_blocks, text, start, end,
+                      network.prefix.length,
+                      ip_version, country, country, std::nullopt, 0, 0, 0);
+      if (ok && rng() % 5 != 0) {
+        std::optional<std::string> postal;
+        if (rng() % 2 == 0) {
+          postal = std::to_string(10000 + rng() % 90000);
+        }
+        ok = insert_row(city_blocks, text, start, end,
+                        network.prefix.length,
+                        ip_version, 100000 + city, country, std::nullopt, 0, 0,
+                        0, postal, std::round(latitude(rng) * 1e4) / 1e4,
+                        std::round(longitude(rng) * 1e4) / 1e4,
+                        int64_t{5} << (rng() % 8));
+      }
+    }
+    sample_networks.insert(sample_networks.end(), networks.begin(),
+                           networks.end());
+
+    for (int &length : lengths) {
+      length -= 2;
+    }
+    for (const FixtureNetwork &network :
+         fixture_networks(rng, ip_version, count / 3, lengths)) {
+      if (!ok) {
+        break;
+      }
+      auto [text, start, end] = network_columns(network);
+      int64_t number = 1000 + static_cast<int64_t>(rng() % 60000);
+      ok = insert_row(asn_blocks, text, start, end,
+                      network.prefix.length,
+                      ip_version, number,
+                      "Example Networks " + std::to_string(number));
+    }
+  }
+  for (sqlite3_stmt *stmt : stmts) {
+    sqlite3_finalize(stmt);
+  }
+  return ok && sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) == SQLITE_OK;
+}
+
+int fixture_usage() {
+  std::cerr << "Usage: geoip fixture [--blocks N] [--seed N] [--ips FILE] "
+               "[--ip-count N] OUTPUT"
+            << std::endl;
+  return 2;
+}
+
+// Writes a deterministic synthetic database for benchmarks and, with
+// --ips, a list of addresses to replay against it: mostly inside the
+// blocks, the rest anywhere in the generated ranges.
+int run_fixture(int argc, char **argv) {
+  FixtureOptions options;
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--blocks" && i + 1 < argc) {
+      options.blocks = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--seed" && i + 1 < argc) {
+      options.seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--ips" && i + 1 < argc) {
+      options.ips = argv[++i];
+    } else if (arg == "--ip-count" && i + 1 < argc) {
+      options.ip_count = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!arg.empty() && arg[0] != '-' && options.output.empty()) {
+      options.output = arg;
+    } else {
+      return fixture_usage();
+    }
+  }
+  if (options.output.empty() || options.blocks == 0) {
+    return fixture_usage();
+  }
+
+  std::error_code removed;
+  std::filesystem::remove(options.output, removed);
+  sqlite3 *db = nullptr;
+  if (sqlite3_open(options.output.c_str(), &db) != SQLITE_OK) {
+    std::cerr << "Failed to create database: " << options.output << std::endl;
+    sqlite3_close(db);
+    return 1;
+  }
+  std::mt19937_64 rng(options.seed);
+  std::vector<FixtureNetwork> networks;
+  bool written = write_fixture(db, options, rng, networks);
+  sqlite3_close(db);
+  if (!written || networks.empty()) {
+    std::cerr << "Failed to write database: " << options.output << std::endl;
+    return 1;
+  }
+
+  if (!options.ips.empty()) {
+    std::ofstream file(options.ips, std::ios::trunc);
+    const TriePrefix anywhere[2] = {{Uint128{0}, 1, kNoRow},
+                                    {Uint128{0x2400} << 112, 16, kNoRow}};
+    for (size_t i = 0; i < options.ip_count; ++i) {
+      IpAddress addr;
+      if (rng() % 10 == 0) {
+        int slot = static_cast<int>(rng() % 2);
+        addr = random_address(rng, slot == 0 ? 4 : 6, anywhere[slot]);
+      } else {
+        const FixtureNetwork &network = networks[rng() % networks.size()];
+        addr = random_address(rng, network.ip_version, network.prefix);
+      }
+      file << format_address(addr) << '\n';
+    }
+    if (!file) {
+      std::cerr << "Failed to write " << options.ips << std::endl;
+      return 1;
+    }
+  }
+  std::cout << "Wrote " << options.output << " with " << networks.size()
+            << " networks" << std::endl;
+  return 0;
+}
+
+constexpr size_t kBenchSamples = 4096;
+constexpr size_t kBenchBatch = 256;
+
+volatile uint64_t bench_sink = 0;
+
+struct BenchOptions {
+  double min_seconds = 0.5;
+  std::string filter;
+  std::string ips;
+};
+
+// Runs `op(i)` for i = 0, 1, ... until `min_seconds` have passed and prints
+// one JSON line. Results are summed into bench_sink so the work is kept.
+template <typename Op>
+void run_benchmark(const BenchOptions &options, const char *name, Op &&op) {
+  if (!options.filter.empty() &&
+      std::string_view(name).find(options.filter) == std::string_view::npos) {
+    return;
+  }
+  uint64_t sink = 0;
+  for (size_t i = 0; i < kBenchBatch; ++i) {
+    sink += op(i);
+  }
+  auto started = std::chrono::steady_clock::now();
+  uint64_t iterations = 0;
+  double elapsed = 0;
+  do {
+    for (size_t i = 0; i < kBenchBatch; ++i) {
+      sink += op(iterations + i);
+    }
+    iterations += kBenchBatch;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            started)
+                  .count();
+  } while (elapsed < options.min_seconds);
+  bench_sink = sink;
+  std::cout << std::fixed << std::setprecision(1) << "{\"benchmark\":\""
+            << name << "\",\"iterations\":" << iterations
+            << ",\"ns_per_op\":" << elapsed * 1e9 / iterations
+            << ",\"ops_per_sec\":" << std::setprecision(0)
+            << iterations / elapsed << "}" << std::endl;
+}
+
+bool load_bench_index(const EngineConfig &config, bool prefix_match,
+                      MemoryIndex &index, std::string &error) {
+  index.prefix_match = prefix_match;
+  return load_index(config.db_path, "", index, error);
+}
+
+// Addresses inside random city and country blocks, one in eight of them
+// outside every block.
+std::vector<std::string> bench_samples(const MemoryIndex &index) {
+  std::mt19937_64 rng(1);
+  std::vector<std::string> ips;
+  while (ips.size() < kBenchSamples) {
+    bool country = rng() % 5 == 0;
+    size_t count = country ? index.country_blocks.size() : index.city_blocks.size();
+    if (count == 0 || rng() % 8 == 0) {
+      IpAddress addr;
+      addr.version = 4;
+      addr.bits = static_cast<Uint128>(rng()) << 64;
+      addr.bits &= ~Uint128{0} << 96;
+      ips.push_back(format_address(addr));
+      continue;
+    }
+    size_t pos = rng() % count;
+    PoolString network = country ? index.country_blocks[pos].network
+                                 : index.city_blocks[pos].network;
+    int64_t prefix_length = country ? index.country_blocks[pos].prefix_length
+                                    : index.city_blocks[pos].prefix_length;
+    int64_t ip_version = country ? index.country_blocks[pos].ip_version
+                                 : index.city_blocks[pos].ip_version;
+    TriePrefix prefix;
+    if (parse_network(pool_view(index.strings, network), prefix_length,
+                      ip_version, prefix)) {
+      ips.push_back(format_address(random_address(rng, ip_version, prefix)));
+    }
+  }
+  return ips;
+}
+
+int bench_usage() {
+  std::cerr << "Usage: geoip bench [--min-time SECONDS] [--filter TEXT] "
+               "[--ips FILE]"
+            << std::endl;
+  return 2;
+}
+
+// Microbenchmarks of the lookup path against GEOIP_DB_PATH (see `geoip
+// fixture`), one JSON line per benchmark.
+int run_bench(int argc, char **argv) {
+  EngineConfig config = engine_config();
+  BenchOptions options;
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--min-time" && i + 1 < argc) {
+      options.min_seconds = std::atof(argv[++i]);
+    } else if (arg == "--filter" && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (arg == "--ips" && i + 1 < argc) {
+      options.ips = argv[++i];
+    } else {
+      return bench_usage();
+    }
+  }
+  MemoryIndex ranges;
+  MemoryIndex tries;
+  std::string error;
+  if (!load_bench_index(config, false, ranges, error) ||
+      !load_bench_index(config, true, tries, error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  std::vector<std::string> ips;
+  if (!options.ips.empty()) {
+    std::vector<std::string> listed;
+    if (!read_ip_list(options.ips, listed) || listed.empty()) {
+      std::cerr << "Failed to read " << options.ips << std::endl;
+      return 1;
+    }
+    for (size_t i = 0; i < kBenchSamples; ++i) {
+      ips.push_back(listed[i % listed.size()]);
+    }
+  } else {
+    ips = bench_samples(ranges);
+  }
+  std::vector<IpAddress> addrs(kBenchSamples);
+  std::vector<int64_t> keys(kBenchSamples);
+  for (size_t i = 0; i < kBenchSamples; ++i) {
+    parse_ip(ips[i], addrs[i]);
+    keys[i] = range_key(addrs[i]).value_or(0);
+  }
+
+  // Rows and blocks for the renderers, from the addresses that matched.
+  std::vector<CityRow> city_rows;
+  std::vector<CountryRow> country_rows;
+  std::vector<std::optional<AsnRow>> asn_rows;
+  std::vector<JoinedRow> joined;
+  const LocaleTables &locale = find_locale(ranges, {}, config.locale);
+  for (const IpAddress &addr : addrs) {
+    AddressSpan span;
+    JoinedRow row = find_joined(ranges, addr, span);
+    if (row.city != kNoRow) {
+      city_rows.push_back(city_row(ranges, locale, row.city));
+    } else if (row.country != kNoRow) {
+      country_rows.push_back(country_row(ranges, locale, row.country));
+    } else {
+      continue;
+    }
+    asn_rows.push_back(row.asn != kNoRow
+                           ? std::optional<AsnRow>(asn_row(ranges, row.asn))
+                           : std::nullopt);
+    joined.push_back(row);
+  }
+  if (city_rows.empty() || country_rows.empty()) {
+    std::cerr << "Too few matching addresses to benchmark rendering."
+              << std::endl;
+    return 1;
+  }
+  std::vector<uint32_t> city_blocks;
+  std::vector<uint32_t> country_blocks;
+  for (const JoinedRow &row : joined) {
+    (row.city != kNoRow ? city_blocks : country_blocks)
+        .push_back(row.city != kNoRow ? row.city : row.country);
+  }
+
+  LookupService service;
+  service.db_path = config.db_path;
+  service.locale = config.locale;
+  LookupContext context(service, 0);
+  if (open_sqlite(context.sqlite, config.db_path) != OpenResult::kOk) {
+    std::cerr << "Failed to open database: " << config.db_path << std::endl;
+    return 1;
+  }
+  bind_locale(context.sqlite, {}, config.locale);
+
+  std::string out;
+  auto mask = kBenchSamples - 1;
+  run_benchmark(options, "parse_ip", [&](size_t i) {
+    IpAddress addr;
+    return parse_ip(ips[i & mask], addr) ? static_cast<uint64_t>(addr.bits >> 96)
+                                         : 0;
+  });
+  run_benchmark(options, "parse_ip/scalar", [&](size_t i) {
+    const std::string &ip = ips[i & mask];
+    uint32_t ipv4 = 0;
+    Uint128 ipv6 = 0;
+    if (parse_ipv4_scalar(ip.data(), ip.size(), ipv4)) {
+      return static_cast<uint64_t>(ipv4);
+    }
+    return parse_ipv6_scalar(ip.data(), ip.size(), ipv6)
+               ? static_cast<uint64_t>(ipv6 >> 64)
+               : 0;
+  });
+  run_benchmark(options, "sqlite/lookup_asn", [&](size_t i) {
+    i &= mask;
+    return static_cast<uint64_t>(
+        lookup_asn(context.sqlite.asn, addrs[i].version, keys[i]).has_value());
+  });
+  run_benchmark(options, "sqlite/lookup_city", [&](size_t i) {
+    i &= mask;
+    return static_cast<uint64_t>(
+        lookup_city(context.sqlite.city, addrs[i].version, keys[i]).has_value());
+  });
+  run_benchmark(options, "sqlite/lookup_country", [&](size_t i) {
+    i &= mask;
+    return static_cast<uint64_t>(
+        lookup_country(context.sqlite.country, addrs[i].version, keys[i])
+            .has_value());
+  });
+  run_benchmark(options, "memory/find_joined", [&](size_t i) {
+    AddressSpan span;
+    JoinedRow row = find_joined(ranges, addrs[i & mask], span);
+    return static_cast<uint64_t>(row.city ^ row.country ^ row.asn);
+  });
+  // The same addresses in unsorted windows of one ip_version, as batches
+  // search them. Every kSearchLanes-th call searches a whole window.
+  std::vector<const IpAddress *> lanes;
+  for (int64_t ip_version : {4, 6}) {
+    for (const IpAddress &addr : addrs) {
+      if (addr.version == ip_version && range_key(addr)) {
+        lanes.push_back(&addr);
+      }
+    }
+  }
+  size_t windows = lanes.size() / kSearchLanes;
+  run_benchmark(options, "memory/find_joined_lanes", [&](size_t i) {
+    if (i % kSearchLanes != 0 || windows == 0) {
+      return uint64_t{0};
+    }
+    size_t window = i / kSearchLanes % windows;
+    JoinedRow rows[kSearchLanes];
+    AddressSpan spans[kSearchLanes];
+    size_t count = kSearchLanes;
+    const IpAddress *const *first = &lanes[window * kSearchLanes];
+    if (first[0]->version != first[kSearchLanes - 1]->version) {
+      count = 1;
+    }
+    find_joined(ranges, first, count, rows, spans);
+    return static_cast<uint64_t>(rows[0].city ^ rows[count - 1].asn);
+  });
+  const std::pair<const char *, BlockTable> lpm_tables[] = {
+      {"lpm/find_prefix_asn", kAsnTable},
+      {"lpm/find_prefix_city", kCityTable},
+      {"lpm/find_prefix_country", kCountryTable}};
+  for (const auto &[name, table] : lpm_tables) {
+    run_benchmark(options, name, [&, table = table](size_t i) {
+      const IpAddress &addr = addrs[i & mask];
+      int slot = version_slot(addr.version);
+      AddressSpan span;
+      return slot < 0 ? 0
+                      : static_cast<uint64_t>(
+                            find_prefix(tries, table, slot, addr, span));
+    });
+  }
+  run_benchmark(options, "append_location/city_row", [&](size_t i) {
+    out.clear();
+    append_location(out, city_rows[i % city_rows.size()], "city");
+    return out.size();
+  });
+  run_benchmark(options, "append_location/country_row", [&](size_t i) {
+    out.clear();
+    append_location(out, country_rows[i % country_rows.size()], "country");
+    return out.size();
+  });
+  run_benchmark(options, "append_location/city_block", [&](size_t i) {
+    out.clear();
+    append_location(out, ranges, locale,
+                    ranges.city_blocks[city_blocks[i % city_blocks.size()]]);
+    return out.size();
+  });
+  run_benchmark(options, "append_location/country_block", [&](size_t i) {
+    out.clear();
+    append_location(
+        out, ranges, locale,
+        ranges.country_blocks[country_blocks[i % country_blocks.size()]]);
+    return out.size();
+  });
+  run_benchmark(options, "append_asn/row", [&](size_t i) {
+    out.clear();
+    append_asn(out, asn_rows[i % asn_rows.size()]);
+    return out.size();
+  });
+  run_benchmark(options, "append_escaped/plain", [&](size_t i) {
+    out.clear();
+    append_escaped(out, ips[i & mask]);
+    append_escaped(out, kMessage);
+    return out.size();
+  });
+  run_benchmark(options, "append_escaped/quoted", [&](size_t i) {
+    out.clear();
+    append_escaped(out, "Sub\tdivision \"N\\\" \xc3\xbc\xe4\xb8\xad");
+    return out.size() + i;
+  });
+  const std::pair<const char *, const MemoryIndex *> engines[] = {
+      {"lookup_address/sqlite", nullptr},
+      {"lookup_address/memory", &ranges},
+      {"lookup_address/lpm", &tries}};
+  for (const auto &[name, index] : engines) {
+    context.memory = index;
+    run_benchmark(options, name, [&](size_t i) {
+      i &= mask;
+      Response response = lookup_address(context, ips[i], addrs[i]);
+      return static_cast<uint64_t>(response.status) + response.body.size();
+    });
+  }
+  context.memory = nullptr;
+  return 0;
+}
+
+struct LoadOptions {
+  std::string host = "127.0.0.1";
+  int port = 5022;
+  int connections = 8;
+  double duration = 10;
+  // Requests per second across all connections. Zero waits for each
+  // response before sending the next request (closed loop).
+  double rate = 0;
+  std::string path = "/lookup?ip=";
+};
+
+struct LoadStats {
+  std::vector<uint64_t> latencies;
+  std::map<int, uint64_t> statuses;
+  uint64_t errors = 0;
+};
+
+int connect_to(const LoadOptions &options) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(options.port));
+  if (inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr) != 1) {
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int opt = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  return fd;
+}
+
+// Sends one request and reads its response. Returns the status, or 0 when
+// the connection failed.
+int exchange(int fd, const std::string &request, std::string &buffer) {
+  size_t sent = 0;
+  while (sent < request.size()) {
+    ssize_t n = send(fd, request.data() + sent, request.size() - sent,
+                     MSG_NOSIGNAL);
+    if (n <= 0) {
+      return 0;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  buffer.clear();
+  size_t body = std::string::npos;
+  size_t length = 0;
+  char chunk[16384];
+  while (body == std::string::npos || buffer.size() < body + length) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return 0;
+    }
+    buffer.append(chunk, static_cast<size_t>(n));
+    if (body != std::string::npos) {
+      continue;
+    }
+    size_t end = buffer.find("\r\n\r\n");
+    if (end == std::string::npos) {
+      continue;
+    }
+    body = end + 4;
+    std::string_view head(buffer.data(), end);
+    while (!head.empty()) {
+      size_t eol = head.find("\r\n");
+      std::string_view line = head.substr(0, eol);
+      head = eol == std::string_view::npos ? std::string_view()
+                                           : head.substr(eol + 2);
+      size_t colon = line.find(':');
+      if (colon != std::string_view::npos &&
+          iequals(trim(line.substr(0, colon)), "content-length")) {
+        std::string_view value = trim(line.substr(colon + 1));
+        std::from_chars(value.data(), value.data() + value.size(), length);
+      }
+    }
+  }
+  int status = 0;
+  if (buffer.size() > 12 && buffer.compare(0, 7, "HTTP/1.") == 0) {
+    std::from_chars(buffer.data() + 9, buffer.data() + 12, status);
+  }
+  return status;
+}
+
+// Reads geoip_io_syscalls_total from the server's /metrics, or returns -1
+// when it cannot.
+double scrape_syscalls(const LoadOptions &options) {
+  int fd = connect_to(options);
+  if (fd < 0) {
+    return -1;
+  }
+  std::string buffer;
+  int status = exchange(fd,
+                        "GET /metrics HTTP/1.1\r\nHost: " + options.host +
+                            "\r\nConnection: close\r\n\r\n",
+                        buffer);
+  close(fd);
+  constexpr std::string_view kName = "\ngeoip_io_syscalls_total ";
+  size_t pos = buffer.find(kName);
+  if (status != 200 || pos == std::string::npos) {
+    return -1;
+  }
+  return std::strtod(buffer.c_str() + pos + kName.size(), nullptr);
+}
+
+// One connection's share of the run. In the open loop, requests are due at
+// fixed intervals and latency counts from when a request was due, so a
+// stalled server is charged for the requests it delayed.
+void run_load_connection(const LoadOptions &options,
+                         const std::vector<std::string> &ips, size_t connection,
+                         std::chrono::steady_clock::time_point start,
+                         std::chrono::steady_clock::time_point stop,
+                         LoadStats &stats) {
+  using Clock = std::chrono::steady_clock;
+  std::chrono::nanoseconds interval{0};
+  if (options.rate > 0) {
+    interval = std::chrono::nanoseconds(
+        static_cast<int64_t>(1e9 * options.connections / options.rate));
+  }
+  auto connections = static_cast<size_t>(options.connections);
+  size_t first = connection * ips.size() / connections;
+  Clock::time_point due =
+      start + interval * static_cast<int64_t>(connection) / options.connections;
+  std::string request;
+  std::string buffer;
+  int fd = -1;
+  for (size_t i = first;; ++i) {
+    if (options.rate > 0) {
+      if (due >= stop) {
+        break;
+      }
+      std::this_thread::sleep_until(due);
+    } else {
+      due = Clock::now();
+      if (due >= stop) {
+        break;
+      }
+    }
+    if (fd < 0 && (fd = connect_to(options)) < 0) {
+      ++stats.errors;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      due += interval;
+      continue;
+    }
+    request = "GET " + options.path + ips[i % ips.size()] +
+              " HTTP/1.1\r\nHost: " + options.host + "\r\n\r\n";
+    int status = exchange(fd, request, buffer);
+    if (status == 0) {
+      ++stats.errors;
+      close(fd);
+      fd = -1;
+    } else {
+      stats.latencies.push_back(static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - due)
+              .count()));
+      ++stats.statuses[status];
+    }
+    due += interval;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+int loadgen_usage() {
+  std::cerr << "Usage: geoip loadgen [--host ADDR] [--port N] "
+               "[--connections N] [--duration SECONDS] [--rate RPS] "
+               "[--path PREFIX] FILE"
+            << std::endl;
+  return 2;
+}
+
+// Replays an address list against a running server over keep-alive
+// connections and prints throughput and latency percentiles as JSON.
+int run_loadgen(int argc, char **argv) {
+  LoadOptions options;
+  if (const char *port_env = std::getenv("GEOIP_PORT")) {
+    options.port = std::atoi(port_env);
+  }
+  std::string file;
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--host" && i + 1 < argc) {
+      options.host = argv[++i];
+    } else if (arg == "--port" && i + 1 < argc) {
+      options.port = std::atoi(argv[++i]);
+    } else if (arg == "--connections" && i + 1 < argc) {
+      options.connections = std::atoi(argv[++i]);
+    } else if (arg == "--duration" && i + 1 < argc) {
+      options.duration = std::atof(argv[++i]);
+    } else if (arg == "--rate" && i + 1 < argc) {
+      options.rate = std::atof(argv[++i]);
+    } else if (arg == "--path" && i + 1 < argc) {
+      options.path = argv[++i];
+    } else if (!arg.empty() && arg[0] != '-' && file.empty()) {
+      file = arg;
+    } else {
+      return loadgen_usage();
+    }
+  }
+  if (file.empty() || options.connections < 1 || options.duration <= 0 ||
+      options.rate < 0) {
+    return loadgen_usage();
+  }
+  std::vector<std::string> ips;
+  if (!read_ip_list(file, ips) || ips.empty()) {
+    std::cerr << "Failed to read addresses from " << file << std::endl;
+    return 1;
+  }
+
+  double syscalls_before = scrape_syscalls(options);
+  auto start = std::chrono::steady_clock::now();
+  auto stop = start + std::chrono::nanoseconds(
+                          static_cast<int64_t>(options.duration * 1e9));
+  std::vector<LoadStats> stats(static_cast<size_t>(options.connections));
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < stats.size(); ++i) {
+    threads.emplace_back(run_load_connection, std::cref(options), std::cref(ips),
+                         i, start, stop,
+                         std::ref(stats[i]));
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  double syscalls_after = scrape_syscalls(options);
+
+  LoadStats total;
+  for (LoadStats &part : stats) {
+    total.latencies.insert(total.latencies.end(), part.latencies.begin(),
+                           part.latencies.end());
+    for (const auto &[status, count] : part.statuses) {
+      total.statuses[status] += count;
+    }
+    total.errors += part.errors;
+  }
+  std::vector<uint64_t> &latencies = total.latencies;
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double q) {
+    if (latencies.empty()) {
+      return 0.0;
+    }
+    size_t pos = std::min(latencies.size() - 1,
+                          static_cast<size_t>(q * latencies.size()));
+    return latencies[pos] / 1e3;
+  };
+
+  std::cout << std::fixed << std::setprecision(1) << "{\"mode\":\""
+            << (options.rate > 0 ? "open" : "closed")
+            << "\",\"connections\":" << options.connections
+            << ",\"target_rps\":" << options.rate
+            << ",\"duration_s\":" << elapsed
+            << ",\"requests\":" << latencies.size()
+            << ",\"errors\":" << total.errors
+            << ",\"throughput_rps\":" << latencies.size() / elapsed
+            << ",\"latency_us\":{\"p50\":" << percentile(0.5)
+            << ",\"p90\":" << percentile(0.9) << ",\"p99\":" << percentile(0.99)
+            << ",\"p999\":" << percentile(0.999)
+            << ",\"max\":" << (latencies.empty() ? 0.0 : latencies.back() / 1e3)
+            << "}";
+  // Server-side system calls per request, from the network loops' counter.
+  if (syscalls_before >= 0 && syscalls_after >= 0 && !latencies.empty()) {
+    std::cout << std::setprecision(2) << ",\"syscalls_per_request\":"
+              << (syscalls_after - syscalls_before) / latencies.size()
+              << std::setprecision(1);
+  }
+  std::cout << ",\"statuses\":{";
+  const char *separator = "";
+  for (const auto &[status, count] : total.statuses) {
+    std::cout << separator << '"' << status << "\":" << count;
+    separator = ",";
+  }
+  std::cout << "}}" << std::endl;
+  return total.errors > 0 && latencies.empty() ? 1 : 0;
+}
+
+// Reads encoded bodies back for `geoip check-encodings`.
+struct EncodedInput {
+  std::string_view data;
+  size_t pos = 0;
+
+  bool bytes(size_t count, std::string_view &value) {
+    if (data.size() - pos < count) {
+      return false;
+    }
+    value = data.substr(pos, count);
+    pos += count;
+    return true;
+  }
+  bool big_endian(size_t count, uint64_t &value) {
+    std::string_view raw;
+    if (!bytes(count, raw)) {
+      return false;
+    }
+    value = 0;
+    for (char c : raw) {
+      value = value << 8 | static_cast<uint8_t>(c);
+    }
+    return true;
+  }
+};
+
+uint64_t read_little_endian(std::string_view data, size_t offset, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; --i) {
+    value = value << 8 | static_cast<uint8_t>(data[offset + i]);
+  }
+  return value;
+}
+
+// Decoded values are written back the way the JSON renderer writes them:
+// strings escaped alike and doubles with its six significant digits.
+void append_decoded_string(std::string &out, std::string_view value) {
+  out += '"';
+  append_escaped(out, value);
+  out += '"';
+}
+
+void append_decoded_double(std::string &out, uint64_t bits) {
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  append_json_number(out, std::optional<double>(value));
+}
+
+// Appends the MessagePack value at `in` as JSON text.
+bool msgpack_to_json(EncodedInput &in, std::string &out, int depth = 0) {
+  uint64_t type;
+  if (depth > 16 || !in.big_endian(1, type)) {
+    return false;
+  }
+  uint64_t size = 0;
+  if (type < 0x80 || type >= 0xe0) {
+    append_int(out, static_cast<int8_t>(type));
+    return true;
+  }
+  if (type <= 0x9f || type == 0xdc || type == 0xdd || type == 0xde ||
+      type == 0xdf) {
+    bool map = type <= 0x8f || type >= 0xde;
+    if (type <= 0x9f) {
+      size = type & 0x0f;
+    } else if (!in.big_endian(type == 0xdc || type == 0xde ? 2 : 4, size)) {
+      return false;
+    }
+    out += map ? '{' : '[';
+    for (uint64_t i = 0; i < size; ++i) {
+      if (i > 0) {
+        out += ',';
+      }
+      if (map) {
+        if (!msgpack_to_json(in, out, depth + 1)) {
+          return false;
+        }
+        out += ':';
+      }
+      if (!msgpack_to_json(in, out, depth + 1)) {
+        return false;
+      }
+    }
+    out += map ? '}' : ']';
+    return true;
+  }
+  std::string_view text;
+  uint64_t value;
+  switch (type) {
+  case 0xc0:
+    out += "null";
+    return true;
+  case 0xc2:
+    out += "false";
+    return true;
+  case 0xc3:
+    out += "true";
+    return true;
+  case 0xcb:
+    if (!in.big_endian(8, value)) {
+      return false;
+    }
+    append_decoded_double(out, value);
+    return true;
+  case 0xcc:
+  case 0xcd:
+  case 0xce:
+  case 0xcf:
+    if (!in.big_endian(size_t{1} << (type - 0xcc), value)) {
+      return false;
+    }
+    append_int(out, static_cast<int64_t>(value));
+    return true;
+  case 0xd0:
+  case 0xd1:
+  case 0xd2:
+  case 0xd3: {
+    int bits = 8 << (type - 0xd0);
+    if (!in.big_endian(static_cast<size_t>(bits / 8), value)) {
+      return false;
+    }
+    int64_t extended = static_cast<int64_t>(value << (64 - bits));
+    append_int(out, extended >> (64 - bits));
+    return true;
+  }
+  case 0xd9:
+  case 0xda:
+  case 0xdb:
+    if (!in.big_endian(size_t{1} << (type - 0xd9), size)) {
+      return false;
+    }
+    break;
+  default:
+    if (type < 0xa0 || type > 0xbf) {
+      return false;
+    }
+    size = type & 0x1f;
+  }
+  if (!in.bytes(size, text)) {
+    return false;
+  }
+  append_decoded_string(out, text);
+  return true;
+}
+
+// Appends the CBOR data item at `in` as JSON text. Byte strings, tags and
+// indefinite lengths are never written and fail.
+bool cbor_to_json(EncodedInput &in, std::string &out, int depth = 0) {
+  uint64_t initial;
+  if (depth > 16 || !in.big_endian(1, initial)) {
+    return false;
+  }
+  int major = static_cast<int>(initial >> 5);
+  uint64_t value = initial & 0x1f;
+  if (major == 7) {
+    if (value == 20 || value == 21 || value == 22) {
+      out += value == 20 ? "false" : value == 21 ? "true" : "null";
+      return true;
+    }
+    if (value != 27 || !in.big_endian(8, value)) {
+      return false;
+    }
+    append_decoded_double(out, value);
+    return true;
+  }
+  if (value >= 24 && value <= 27) {
+    if (!in.big_endian(size_t{1} << (value - 24), value)) {
+      return false;
+    }
+  } else if (value > 27) {
+    return false;
+  }
+  std::string_view text;
+  switch (major) {
+  case 0:
+    append_int(out, static_cast<int64_t>(value));
+    return true;
+  case 1:
+    append_int(out, -1 - static_cast<int64_t>(value));
+    return true;
+  case 3:
+    if (!in.bytes(value, text)) {
+      return false;
+    }
+    append_decoded_string(out, text);
+    return true;
+  case 4:
+  case 5:
+    out += major == 5 ? '{' : '[';
+    for (uint64_t i = 0; i < value; ++i) {
+      if (i > 0) {
+        out += ',';
+      }
+      if (major == 5) {
+        if (!cbor_to_json(in, out, depth + 1)) {
+          return false;
+        }
+        out += ':';
+      }
+      if (!cbor_to_json(in, out, depth + 1)) {
+        return false;
+      }
+    }
+    out += major == 5 ? '}' : ']';
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Collects the scalar members of a JSON object by dotted path, as their
+// source text.
+bool flatten_json(std::string_view text, size_t &pos, const std::string &path,
+                  std::unordered_map<std::string, std::string_view> &members,
+                  int depth = 0) {
+  pos = skip_space(text, pos);
+  if (depth > 16 || pos >= text.size() || text[pos] == '[') {
+    return false;
+  }
+  if (text[pos] == '{') {
+    pos = skip_space(text, pos + 1);
+    if (pos < text.size() && text[pos] == '}') {
+      ++pos;
+      return true;
+    }
+    while (true) {
+      std::string key;
+      if (!parse_json_string(text, pos, key)) {
+        return false;
+      }
+      pos = skip_space(text, pos);
+      if (pos >= text.size() || text[pos] != ':') {
+        return false;
+      }
+      ++pos;
+      if (!flatten_json(text, pos, path.empty() ? key : path + "." + key,
+                        members, depth + 1)) {
+        return false;
+      }
+      pos = skip_space(text, pos);
+      if (pos < text.size() && text[pos] == ',') {
+        pos = skip_space(text, pos + 1);
+        continue;
+      }
+      if (pos < text.size() && text[pos] == '}') {
+        ++pos;
+        return true;
+      }
+      return false;
+    }
+  }
+  size_t begin = pos;
+  if (text[pos] == '"') {
+    for (++pos; pos < text.size() && text[pos] != '"'; ++pos) {
+      pos += text[pos] == '\\';
+    }
+    if (pos >= text.size()) {
+      return false;
+    }
+    ++pos;
+  } else {
+    while (pos < text.size() && text[pos] != ',' && text[pos] != '}' &&
+           !std::isspace(static_cast<unsigned char>(text[pos]))) {
+      ++pos;
+    }
+  }
+  members[path] = text.substr(begin, pos - begin);
+  return pos > begin;
+}
+
+// The JSON member each record slot stands for.
+struct RecordMember {
+  RecordSlot slot;
+  const char *path;
+};
+
+constexpr RecordMember kRecordMembers[] = {
+    {kRecordLocationPrefixLength, "location.network.prefix_length"},
+    {kRecordLocationIpVersion, "location.network.ip_version"},
+    {kRecordIsInEuropeanUnion, "location.geo.country.is_in_european_union"},
+    {kRecordLatitude, "location.coordinates.latitude"},
+    {kRecordLongitude, "location.coordinates.longitude"},
+    {kRecordAccuracyRadius, "location.coordinates.accuracy_radius"},
+    {kRecordIsAnonymousProxy, "location.traits.is_anonymous_proxy"},
+    {kRecordIsSatelliteProvider, "location.traits.is_satellite_provider"},
+    {kRecordIsAnycast, "location.traits.is_anycast"},
+    {kRecordGeonameId, "location.geoname_id"},
+    {kRecordRegisteredCountryGeonameId,
+     "location.registered_country_geoname_id"},
+    {kRecordRepresentedCountryGeonameId,
+     "location.represented_country_geoname_id"},
+    {kRecordAsnPrefixLength, "asn.network.prefix_length"},
+    {kRecordAsnIpVersion, "asn.network.ip_version"},
+    {kRecordAsnNumber, "asn.number"},
+    {kRecordIp, "ip"},
+    {kRecordLocationCidr, "location.network.cidr"},
+    {kRecordContinentCode, "location.geo.continent.code"},
+    {kRecordContinentName, "location.geo.continent.name"},
+    {kRecordCountryIsoCode, "location.geo.country.iso_code"},
+    {kRecordCountryName, "location.geo.country.name"},
+    {kRecordFlagEmoji, "location.geo.country.flag_emoji"},
+    {kRecordSubdivision1IsoCode, "location.geo.subdivision_1.iso_code"},
+    {kRecordSubdivision1Name, "location.geo.subdivision_1.name"},
+    {kRecordSubdivision2IsoCode, "location.geo.subdivision_2.iso_code"},
+    {kRecordSubdivision2Name, "location.geo.subdivision_2.name"},
+    {kRecordCityName, "location.geo.city.name"},
+    {kRecordMetroCode, "location.geo.city.metro_code"},
+    {kRecordTimeZone, "location.geo.time_zone"},
+    {kRecordPostalCode, "location.postal_code"},
+    {kRecordAsnCidr, "asn.network.cidr"},
+    {kRecordAsnOrganization, "asn.organization"},
+};
+
+static_assert(std::size(kRecordMembers) == kRecordSlotCount,
+              "every record slot has a JSON member");
+
+// Compares a 200 record with the JSON body of the same lookup: the header
+// with the status, ip version, source and ASN, and every slot with its
+// member, which is null or left out when the slot is null.
+bool check_record(std::string_view record, std::string_view json,
+                  std::string &problem) {
+  std::unordered_map<std::string, std::string_view> members;
+  size_t pos = 0;
+  if (!flatten_json(json, pos, "", members)) {
+    problem = "JSON body does not parse";
+    return false;
+  }
+  auto member = [&](const std::string &path) -> std::string_view {
+    auto it = members.find(path);
+    return it == members.end() ? "null" : it->second;
+  };
+  auto mismatch = [&](const std::string &what, const std::string &got,
+                      std::string_view expected) {
+    problem = what + ": record " + got + ", JSON " + std::string(expected);
+    return false;
+  };
+  if (record.size() < kRecordStringsOffset) {
+    return mismatch("size", std::to_string(record.size()), "a full record");
+  }
+  uint64_t size = read_little_endian(record, 0, 4);
+  if (size != record.size()) {
+    return mismatch("size", std::to_string(size),
+                    std::to_string(record.size()));
+  }
+  if (read_little_endian(record, 4, 2) != kRecordVersion) {
+    return mismatch("version", std::to_string(read_little_endian(record, 4, 2)),
+                    std::to_string(kRecordVersion));
+  }
+  const std::pair<std::string, std::string> header[] = {
+      {"status", std::to_string(read_little_endian(record, 6, 2))},
+      {"ip_version", std::to_string(read_little_endian(record, 8, 1))},
+  };
+  for (const auto &[path, value] : header) {
+    if (value != member(path)) {
+      return mismatch(path, value, member(path));
+    }
+  }
+  const char *sources[] = {"null", "\"city\"", "\"country\"", "\"reserved\""};
+  uint64_t source = read_little_endian(record, 9, 1);
+  std::string_view location_source = member("location.source");
+  if (source >= std::size(sources) || sources[source] != location_source) {
+    return mismatch("source", std::to_string(source), location_source);
+  }
+  bool has_asn = read_little_endian(record, 10, 1) != 0;
+  if (has_asn != (members.count("asn.network.cidr") > 0)) {
+    return mismatch("asn", has_asn ? "present" : "absent", member("asn"));
+  }
+
+  uint64_t nulls = read_little_endian(record, 12, 4);
+  for (const RecordMember &slot : kRecordMembers) {
+    std::string value = "null";
+    if (!(nulls >> slot.slot & 1)) {
+      value.clear();
+      if (slot.slot < kRecordNumberSlots) {
+        uint64_t bits =
+            read_little_endian(record, kRecordHeaderBytes + slot.slot * 8, 8);
+        if (slot.slot == kRecordLatitude || slot.slot == kRecordLongitude) {
+          append_decoded_double(value, bits);
+        } else {
+          append_int(value, static_cast<int64_t>(bits));
+        }
+      } else {
+        size_t at = kRecordHeaderBytes + kRecordNumberSlots * 8 +
+                    (slot.slot - kRecordNumberSlots) * 4;
+        size_t offset = read_little_endian(record, at, 2);
+        size_t length = read_little_endian(record, at + 2, 2);
+        if (offset < kRecordStringsOffset || offset + length > record.size()) {
+          return mismatch(slot.path, "out of bounds", member(slot.path));
+        }
+        append_decoded_string(value, record.substr(offset, length));
+      }
+    }
+    if (value != member(slot.path)) {
+      return mismatch(slot.path, value, member(slot.path));
+    }
+  }
+  return true;
+}
+
+// Field selections the check runs under, the first selecting everything.
+constexpr const char *kCheckedFields[] = {
+    "",
+    "location",
+    "asn",
+    "network,coordinates,postal_code",
+    "continent,country,city,traits",
+    "subdivision_1,subdivision_2,time_zone,geoname_id",
+};
+
+// Reserved addresses checked besides the listed ones.
+constexpr const char *kCheckedReserved[] = {"10.1.2.3", "127.0.0.1",
+                                            "2001:db8::1", "fe80::1"};
+
+constexpr Encoding kEncodings[] = {Encoding::kJson, Encoding::kMsgpack,
+                                   Encoding::kCbor, Encoding::kRecord};
+
+int check_encodings_usage() {
+  std::cerr << "Usage: geoip check-encodings [--engine sqlite|memory|lpm] "
+               "[--lang CODE] FILE"
+            << std::endl;
+  return 2;
+}
+
+// Looks every address in FILE up in each encoding and checks that the
+// MessagePack and CBOR bodies decode to the JSON body and that the record
+// holds its values. Batch entries must match the GET /lookup bodies.
+int run_check_encodings(int argc, char **argv) {
+  EngineConfig config = engine_config();
+  if (!std::getenv("GEOIP_ENGINE")) {
+    config.engine = "memory";
+  }
+  std::string file;
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--engine" && i + 1 < argc) {
+      config.engine = argv[++i];
+    } else if (arg == "--lang" && i + 1 < argc) {
+      config.locale = argv[++i];
+    } else if (!arg.empty() && arg[0] != '-' && file.empty()) {
+      file = arg;
+    } else {
+      return check_encodings_usage();
+    }
+  }
+  std::vector<std::string> ips;
+  if (file.empty() || !read_ip_list(file, ips)) {
+    std::cerr << "Failed to read " << file << std::endl;
+    return file.empty() ? check_encodings_usage() : 1;
+  }
+  ips.insert(ips.end(), std::begin(kCheckedReserved),
+             std::end(kCheckedReserved));
+
+  std::unique_ptr<MemoryIndex> memory;
+  EngineVersion version;
+  if (!load_engine(config, memory, version, std::cerr)) {
+    return 1;
+  }
+  if (!memory && !std::filesystem::exists(config.db_path)) {
+    std::cerr << "Failed to open database: " << config.db_path << std::endl;
+    return 1;
+  }
+  EngineState engine(1);
+  publish_engine(engine, std::move(memory), std::move(version));
+  LookupService service;
+  service.db_path = config.db_path;
+  service.locale = config.locale;
+  service.engine = &engine;
+  LookupContext context(service, 0);
+  enter_read(context);
+
+  std::vector<IpAddress> addrs(ips.size());
+  std::vector<size_t> order;
+  for (size_t i = 0; i < ips.size(); ++i) {
+    if (parse_ip(ips[i], addrs[i])) {
+      order.push_back(i);
+    }
+  }
+  sort_by_address(order, addrs);
+
+  size_t checked = 0;
+  size_t mismatches = 0;
+  auto report = [&](size_t i, const char *fields, Encoding encoding,
+                    const std::string &problem) {
+    if (++mismatches <= 10) {
+      std::cerr << ips[i] << " fields=" << fields << " "
+                << content_type(encoding) << ": " << problem << std::endl;
+    }
+  };
+  std::vector<LookupResult> results(ips.size());
+  for (const char *fields : kCheckedFields) {
+    parse_fields(fields, context.fields);
+    lookup_rows(context, addrs, order, results);
+    for (size_t i : order) {
+      std::string bodies[std::size(kEncodings)];
+      int status = 0;
+      for (Encoding encoding : kEncodings) {
+        Response response =
+            lookup_address(context, ips[i], addrs[i], encoding);
+        bodies[static_cast<size_t>(encoding)] = std::string(response.body);
+        status = response.status;
+      }
+      const std::string &json = bodies[static_cast<size_t>(Encoding::kJson)];
+      for (Encoding encoding : kEncodings) {
+        const std::string &body = bodies[static_cast<size_t>(encoding)];
+        std::string problem;
+        if (status != 200) {
+          std::string expected;
+          encode_error(expected, encoding, status, json);
+          if (body != expected) {
+            problem = "error body differs from JSON";
+          }
+        } else if (encoding == Encoding::kRecord) {
+          check_record(body, json, problem);
+        } else if (encoding != Encoding::kJson) {
+          EncodedInput in{body};
+          std::string decoded;
+          bool ok = encoding == Encoding::kMsgpack
+                        ? msgpack_to_json(in, decoded)
+                        : cbor_to_json(in, decoded);
+          if (!ok || in.pos != body.size()) {
+            problem = "does not decode";
+          } else if (decoded != json) {
+            problem = "decodes to " + decoded;
+          }
+        }
+        std::string entry;
+        LookupResult result = results[i];
+        encode_result(entry, encoding, ips[i], addrs[i], result);
+        if (problem.empty() && entry != body) {
+          problem = "batch entry differs from GET /lookup";
+        }
+        if (!problem.empty()) {
+          report(i, fields, encoding, problem);
+        }
+      }
+      ++checked;
+    }
+  }
+  leave_read(context);
+  std::cout << "Checked " << checked << " lookups ("
+            << std::size(kCheckedFields) << " field selections) in "
+            << std::size(kEncodings) << " encodings: " << mismatches
+            << " mismatch(es)" << std::endl;
+  return mismatches > 0 ? 1 : 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string command = argc > 1 ? argv[1] : "";
+  if (command == "enrich") {
+    return run_enrich(argc - 2, argv + 2);
+  }
+  if (command == "compile") {
+    return run_compile(argc - 2, argv + 2);
+  }
+  if (command == "verify") {
+    return run_verify(argc - 2, argv + 2);
+  }
+  if (command == "prepare-db") {
+    return run_prepare_db(argc - 2, argv + 2);
+  }
+  if (command == "fixture") {
+    return run_fixture(argc - 2, argv + 2);
+  }
+  if (command == "bench") {
+    return run_bench(argc - 2, argv + 2);
+  }
+  if (command == "check-encodings") {
+    return run_check_encodings(argc - 2, argv + 2);
+  }
+  if (command == "loadgen") {
+    return run_loadgen(argc - 2, argv + 2);
+  }
+  if (argc > 1) {
+    std::cerr << "Usage: geoip [enrich|compile|verify|prepare-db|fixture|bench|"
+                 "loadgen|check-encodings ...]"
+              << std::endl;
+    return 2;
   }
+  return run_server();
 }
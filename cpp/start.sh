@@ -34,5 +34,5 @@ echo -e "\033[0;36mIf you find it useful, please reference https://whattimeis.in
 echo -e "\033[0;33mRunning on: http://localhost:${PORT}\033[0m\n"
 
 mkdir -p bin
-c++ -std=c++17 -O2 -o bin/geoip main.cpp -lsqlite3
+c++ -std=c++17 -O2 -pthread -o bin/geoip main.cpp geoip.cpp -lsqlite3
 ./bin/geoip